@@ -0,0 +1,132 @@
+/* See LICENSE for license details. */
+/*
+ * Throughput of memfind()/memrfind() against memmem(), of refind() and of
+ * dfind() across the gap on generated text. Run with make bench CFLAGS=-O2;
+ * the size in MB is an optional argument.
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "editor.c"
+
+static const char *words[] = {
+	"the ", "quick ", "brown ", "fox ", "jumps ", "over ", "lazy ", "dog ",
+	"\n", "error: ", "value=42 "
+};
+
+static const char *needles[] = {
+	"zq",
+	"the quack",
+	"jumps over the lazy cat",
+	"error: value=43",
+	"a long needle that is not present anywhere in the text at all",
+};
+
+/* patterns that run the DFA over every byte, then ones that start with a literal */
+static const char *patterns[] = {
+	"[0-9]+x",
+	"(foo|bar)baz",
+	"^q[a-z]*zzzz$",
+	"e.r.o.r.!",
+	"error: value=43",
+	"value=4[3-9]",
+};
+
+/* editor.c draws through this */
+uchar
+tstyle(ushort mode, uint32_t fg, uint32_t bg)
+{
+	(void)mode; (void)fg; (void)bg;
+	return 0;
+}
+
+double
+now(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec / 1E9;
+}
+
+int
+main(int argc, char *argv[])
+{
+	size_t n = (argc > 1 ? strtoul(argv[1], NULL, 10) : 256) << 20, i, l, gap = 4096;
+	char *h = umalloc(n + gap);
+	const char *a, *b, *c, *s, *e, *err, *w;
+	double t0, t1, t2, t3;
+	ReText t;
+	Regex *re;
+	size_t k, m;
+	Document d;
+
+	srand(2);
+	for (i = 0; i < n; i += l) {
+		w = words[rand() % LEN(words)];
+		l = MIN(strlen(w), n - i);
+		memcpy(h + i, w, l);
+	}
+
+	printf("%-64s %10s %10s %10s\n", "needle", "memmem", "memfind", "memrfind");
+	for (k = 0; k < LEN(needles); k++) {
+		l = strlen(needles[k]);
+		t0 = now();
+		a = memmem(h, n, needles[k], l);
+		t1 = now();
+		b = memfind(h, n, needles[k], l);
+		t2 = now();
+		c = memrfind(h, n, needles[k], l);
+		t3 = now();
+		if (a != b || (a == NULL) != (c == NULL))
+			udie("memfind disagrees with memmem on \"%s\"\n", needles[k]);
+		printf("%-64s %5.0f MB/s %5.0f MB/s %5.0f MB/s\n", needles[k],
+			n / 1E6 / (t1 - t0), n / 1E6 / (t2 - t1), n / 1E6 / (t3 - t2));
+	}
+
+	/* the text is split in two around a gap as in the document */
+	memmove(h + n / 2 + gap, h + n / 2, n - n / 2);
+	t = (ReText){ { h, h + n / 2 + gap }, { h + n / 2, h + n + gap } };
+	printf("\n%-64s %10s %10s\n", "regex", "forward", "backward");
+	for (k = 0; k < LEN(patterns); k++) {
+		if (!(re = recompile(patterns[k], strlen(patterns[k]), &err)))
+			udie("%s: %s\n", patterns[k], err);
+		t0 = now();
+		refind(re, &t, h, h + n + gap, 1, &s, &e);
+		t1 = now();
+		refind(re, &t, h + n + gap, h, -1, &s, &e);
+		t2 = now();
+		printf("%-64s %5.0f MB/s %5.0f MB/s\n", patterns[k],
+			n / 1E6 / (t1 - t0), n / 1E6 / (t2 - t1));
+		refree(re);
+	}
+
+	/*
+	 * each needle written over the middle of the text so the gap splits it,
+	 * which each direction finds after searching half the text in place
+	 */
+	if (!dinit(&d, h, n + gap, n))
+		udie("could not make the document\n");
+	d.curleft = h + n / 2;
+	d.curright = d.curleft + gap;
+	printf("\n%-64s %10s %10s\n", "needle split by the gap", "dfind", "backward");
+	for (k = 0; k < LEN(needles); k++) {
+		l = strlen(needles[k]);
+		m = (l + 1) / 2;
+		memcpy(d.curleft - m, needles[k], m);
+		memcpy(d.curright, needles[k] + m, l - m);
+		t0 = now();
+		a = dfind(&d, d.bufstart, d.bufend, needles[k], l, 1);
+		t1 = now();
+		b = dfind(&d, d.bufend, d.bufstart, needles[k], l, -1);
+		t2 = now();
+		if (a != d.curleft - m || b != a)
+			udie("dfind missed \"%s\" across the gap\n", needles[k]);
+		printf("%-64s %5.0f MB/s %5.0f MB/s\n", needles[k],
+			n / 2E6 / (t1 - t0), n / 2E6 / (t2 - t1));
+	}
+	dfree(&d);
+	return 0;
+}
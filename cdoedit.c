@@ -12,11 +12,133 @@
 typedef struct {
 	int row;      /* nb row */
 	int col;      /* nb col */
-	Line *line;   /* screen */
+	Grid line;    /* screen */
+	Grid prev;    /* screen as it was last drawn */
+	uint32_t *hash; /* hashes of the lines in prev */
+	int *dirty;   /* dirtyness of lines */
+	int ocx, ocy; /* cursor position as it was last drawn */
 } Term;
 
 /* Globals */
 static Term term;
+static struct {
+	Glyph g[256];       /* what each style stands for, u is unused */
+	int n, last;
+} styles = { .n = 1 };
+static struct {
+	int rows;           /* rows drawn in the last frame */
+	unsigned long frames, total;
+} drawstat;
+
+void
+tfulldirt(void)
+{
+	int i;
+
+	for (i = 0; i < term.row; i++)
+		term.dirty[i] = 1;
+}
+
+uchar
+tstyle(ushort mode, uint32_t fg, uint32_t bg)
+{
+	Glyph *g = &styles.g[styles.last];
+	int i;
+
+	if (g->mode == mode && g->fg == fg && g->bg == bg)
+		return styles.last;
+	for (i = 0; i < styles.n; i++) {
+		g = &styles.g[i];
+		if (g->mode == mode && g->fg == fg && g->bg == bg)
+			return styles.last = i;
+	}
+	/* redraw() empties the table long before a frame could fill it */
+	if (styles.n == LEN(styles.g))
+		return 0;
+	g = &styles.g[styles.n];
+	g->u = 0;
+	g->mode = mode;
+	g->fg = fg;
+	g->bg = bg;
+	return styles.last = styles.n++;
+}
+
+Glyph
+tglyph(Rune u, uchar style)
+{
+	Glyph g = styles.g[style];
+
+	g.u = u;
+	return g;
+}
+
+static int
+tlinediff(int y, int n)
+{
+	int i = y * term.line.stride;
+
+	return memcmp(term.line.u + i, term.prev.u + i, n * sizeof(Rune)) ||
+		memcmp(term.line.style + i, term.prev.style + i, n);
+}
+
+static uint32_t
+tlinehash(const Rune *u, const uchar *style, int n)
+{
+	uint32_t h = 2166136261u;
+	int i;
+
+	for (i = 0; i < n; i++)
+		h = (h ^ u[i] ^ (uint32_t)style[i] << 24) * 16777619u;
+	return h;
+}
+
+/*
+ * Find the vertical shift between the last drawn grid and the new one with the
+ * line hashes h, and move the rows that are still on screen into place in the
+ * pixmap. Returns the number of rows the content moved up by, negative for
+ * down, and 0 if blitting wouldn't save drawing anything.
+ */
+static int
+tscroll(const uint32_t *h)
+{
+	int y, k, n, best = 0, bestn = 0, stride = term.prev.stride;
+	uint32_t hashes[term.row];
+
+	for (y = 0; y < term.row; y++) {
+		/* the pixmap was cleared, there's nothing to move */
+		if (term.dirty[y])
+			return 0;
+		bestn += h[y] == term.hash[y];
+	}
+	for (k = 1 - term.row; k < term.row; k++) {
+		if (k == 0)
+			continue;
+		n = 0;
+		for (y = MAX(0, -k); y < MIN(term.row, term.row - k); y++)
+			n += h[y] == term.hash[y + k];
+		if (n > bestn) {
+			best = k;
+			bestn = n;
+		}
+	}
+	if (!best)
+		return 0;
+
+	/* new row y is old row y + best, the rows scrolled in are drawn from scratch */
+	xscroll(MAX(0, best), MIN(term.row, term.row + best), best);
+	n = (term.row - abs(best)) * stride;
+	k = MAX(0, best) * stride;
+	y = MAX(0, -best) * stride;
+	memmove(term.prev.u + y, term.prev.u + k, n * sizeof(Rune));
+	memmove(term.prev.style + y, term.prev.style + k, n);
+	memcpy(hashes, term.hash, sizeof(hashes));
+	for (y = 0; y < term.row; y++) {
+		k = (y + best + term.row) % term.row;
+		term.hash[y] = hashes[k];
+		term.dirty[y] = y + best < 0 || y + best >= term.row;
+	}
+	return best;
+}
 
 void
 tnew(int col, int row)
@@ -27,7 +149,8 @@ tnew(int col, int row)
 void
 tresize(int col, int row)
 {
-	int i;
+	/* rows start on a 16 cell boundary so comparing them vectorises well */
+	int stride = DIVCEIL(col, 16) * 16;
 
 	if (col < 1 || row < 1) {
 		fprintf(stderr,
@@ -35,25 +158,21 @@ tresize(int col, int row)
 		return;
 	}
 
-	for (i = row; i < term.row; i++) {
-		free(term.line[i]);
-	}
-
-	/* resize to new height */
-	term.line = urealloc(term.line, row * sizeof(Line));
-
-	/* resize each row to new width, zero-pad if needed */
-	for (i = 0; i < MIN(row, term.row); i++) {
-		term.line[i] = urealloc(term.line[i], col * sizeof(Glyph));
-	}
+	/* nothing needs keeping, every row is drawn again after a resize */
+	term.line.stride = term.prev.stride = stride;
+	term.line.u = urealloc(term.line.u, row * stride * sizeof(Rune));
+	term.prev.u = urealloc(term.prev.u, row * stride * sizeof(Rune));
+	term.line.style = urealloc(term.line.style, row * stride);
+	term.prev.style = urealloc(term.prev.style, row * stride);
+	term.hash = urealloc(term.hash, row * sizeof(*term.hash));
+	term.dirty = urealloc(term.dirty, row * sizeof(*term.dirty));
 
-	/* allocate any new rows */
-	for (; i < row; i++) {
-		term.line[i] = umalloc(col * sizeof(Glyph));
-	}
 	/* update display buffer size */
 	term.col = col;
 	term.row = row;
+	term.ocx = term.ocy = 0;
+	/* the window's pixmap is cleared whenever the grid is resized */
+	tfulldirt();
 }
 
 void
@@ -62,12 +181,53 @@ resettitle(void)
 	xsettitle(NULL);
 }
 
+/* Draws the cursor where it's moved to over the grid as it was last drawn. */
+void
+movecursor(int cx, int cy)
+{
+	int stride = term.prev.stride, i = cy * stride;
+
+	if (!xstartdraw())
+		return;
+	if (cx != term.ocx || cy != term.ocy) {
+		xdrawline(term.prev.u + term.ocy * stride, term.prev.style + term.ocy * stride,
+				term.ocx, term.ocy, term.ocx + 1);
+		xcopyarea(term.ocx, term.ocy, term.ocx + 1, term.ocy + 1);
+	}
+	xdrawcursor(cx, cy, tglyph(term.prev.u[i + cx], term.prev.style[i + cx]));
+	xcopyarea(cx, cy, cx + 1, cy + 1);
+	xfinishdraw();
+	xximspot(cx, cy);
+	term.ocx = cx;
+	term.ocy = cy;
+	drawstat.rows = 0;
+	drawstat.frames++;
+}
+
 void
 redraw(void)
 {
-	int cx, cy;
-	edraw(term.line, term.col, term.row, &cx, &cy);
-	
+	int cx, cy, y, stride = term.line.stride;
+	Rune *u = term.line.u;
+	uchar *style = term.line.style;
+
+	/* styles are only ever added, start again before the table gets full */
+	if (styles.n > (int)LEN(styles.g) / 2) {
+		styles.n = 1;
+		styles.last = 0;
+		tfulldirt();
+	}
+	/* when only the cursor has moved the grid isn't built again */
+	for (y = 0; y < term.row && !term.dirty[y]; y++)
+		;
+	if (y == term.row && ecursoronly(term.col, term.row, &cx, &cy) &&
+	    BETWEEN(cx, 0, term.col-1) && BETWEEN(cy, 0, term.row-1) &&
+	    BETWEEN(term.ocy, 0, term.row-1)) {
+		movecursor(cx, cy);
+		return;
+	}
+	edraw(&term.line, term.col, term.row, &cx, &cy);
+
 	if (!xstartdraw())
 		return;
 
@@ -75,11 +235,90 @@ redraw(void)
 	LIMIT(cx, 0, term.col-1);
 	LIMIT(cy, 0, term.row-1);
 
-	int y;
+	int y1, shift;
+	uint32_t h[term.row];
+	for (y = 0; y < term.row; y++)
+		h[y] = tlinehash(u + y * stride, style + y * stride, term.col);
+
+	/* rows that only moved are copied within the pixmap rather than drawn again */
+	shift = tscroll(h);
+
+	/* the cursor is painted over its cell, so that's all that's drawn for the cells it leaves and enters */
+	term.ocy -= shift;
+
+	drawstat.rows = 0;
 	for (y = 0; y < term.row; y++) {
-		xdrawline(term.line[y], 0, y, term.col);
+		if (!term.dirty[y] && h[y] == term.hash[y] &&
+		    !tlinediff(y, term.col))
+			continue;
+		term.dirty[y] = 1;
+		xdrawline(u + y * stride, style + y * stride, 0, y, term.col);
+		memcpy(term.prev.u + y * stride, u + y * stride, term.col * sizeof(Rune));
+		memcpy(term.prev.style + y * stride, style + y * stride, term.col);
+		term.hash[y] = h[y];
+		drawstat.rows++;
+	}
+	if (BETWEEN(term.ocy, 0, term.row-1) && !term.dirty[term.ocy]) {
+		xdrawline(u + term.ocy * stride, style + term.ocy * stride,
+				term.ocx, term.ocy, term.ocx + 1);
+		xcopyarea(term.ocx, term.ocy, term.ocx + 1, term.ocy + 1);
+	}
+	xdrawcursor(cx, cy, tglyph(u[cy * stride + cx], style[cy * stride + cx]));
+	if (!term.dirty[cy])
+		xcopyarea(cx, cy, cx + 1, cy + 1);
+
+	/* only copy the runs of rows that changed or moved to the window */
+	for (y = 0; y < term.row; y++) {
+		if (!term.dirty[y] && !shift)
+			continue;
+		for (y1 = y; y < term.row && (term.dirty[y] || shift); y++)
+			term.dirty[y] = 0;
+		xcopyarea(0, y1, term.col, y);
 	}
-	xdrawcursor(cx, cy, term.line[cy][cx]);
 	xfinishdraw();
 	xximspot(cx, cy);
+	term.ocx = cx;
+	term.ocy = cy;
+	drawstat.frames++;
+	drawstat.total += drawstat.rows;
+}
+
+void
+redrawcursor(void)
+{
+	int cx = term.ocx, cy = term.ocy, i = cy * term.prev.stride;
+
+	/* the grid hasn't been drawn since it was cleared */
+	if (term.dirty[cy]) {
+		redraw();
+		return;
+	}
+	if (!xstartdraw())
+		return;
+
+	xdrawline(term.prev.u + i, term.prev.style + i, cx, cy, cx + 1);
+	xdrawcursor(cx, cy, tglyph(term.prev.u[i + cx], term.prev.style[i + cx]));
+	xcopyarea(cx, cy, cx + 1, cy + 1);
+	xfinishdraw();
+}
+
+void
+drawstats(const Arg *arg)
+{
+	double p50 = 0, p99 = 0, fonts, frame, reqavg;
+	size_t n = xlatency(&p50, &p99);
+	int loaded, cached = xstartup(&fonts, &frame, &loaded);
+	const char *how;
+	unsigned long req = xrequests(&reqavg, &how);
+
+	(void)arg;
+	emessage("Rows %d/%d last frame, %.1f avg over %lu | "
+			"latency p50 %.1fms p99 %.1fms over %zu | "
+			"specs %.0fus per 300x100 | "
+			"fonts at %.0fms %d/%d cached, first frame at %.0fms | "
+			"%lu X requests last frame, %.1f avg, %s",
+			drawstat.rows, term.row,
+			drawstat.frames ? (double)drawstat.total / drawstat.frames : 0.0,
+			drawstat.frames, p50, p99, n, xspectime() * 300 * 100 / 1E3,
+			fonts, cached, loaded, frame, req, reqavg, how);
 }
@@ -13,11 +13,11 @@
 #define DIVCEIL(n, d)		(((n) + ((d) - 1)) / (d))
 #define DEFAULT(a, b)		(a) = (a) ? (a) : (b)
 #define LIMIT(x, a, b)		(x) = (x) < (a) ? (a) : (x) > (b) ? (b) : (x)
-#define ATTRCMP(a, b)		((a).mode != (b).mode || (a).fg != (b).fg || \
-				(a).bg != (b).bg)
 #define TIMEDIFF(t1, t2)	((t1.tv_sec-t2.tv_sec)*1000 + \
 				(t1.tv_nsec-t2.tv_nsec)/1E6)
 #define MODBIT(x, set, bit)	((set) ? ((x) |= (bit)) : ((x) &= ~(bit)))
+#define GRIDSET(g, y, x, r, s)	((g)->u[(y) * (g)->stride + (x)] = (r), \
+				(g)->style[(y) * (g)->stride + (x)] = (s))
 
 #define TRUECOLOR(r,g,b)	(1 << 24 | (r) << 16 | (g) << 8 | (b))
 #define IS_TRUECOL(x)		(1 << 24 & (x))
@@ -37,6 +37,13 @@ enum glyph_attribute {
 	ATTR_BOLD_FAINT = ATTR_BOLD | ATTR_FAINT,
 };
 
+/* indexes into the colour table loaded by xloadcols() */
+enum glyph_color {
+	COLOR_BG    = 0,
+	COLOR_FG    = 1,
+	COLOR_MATCH = 2,
+};
+
 enum selection_mode {
 	SEL_IDLE = 0,
 	SEL_EMPTY = 1,
@@ -70,7 +77,15 @@ typedef struct {
 	uint32_t bg;      /* background  */
 } Glyph;
 
-typedef Glyph *Line;
+/*
+ * The screen, with the cell at column x of row y at y * stride + x of each
+ * array. A cell's style stands for its attributes and colours, see tstyle().
+ */
+typedef struct {
+	int stride;
+	Rune *u;      /* character codes */
+	uchar *style; /* 0 is a cell with every attribute and colour 0 */
+} Grid;
 
 typedef union {
 	int i;
@@ -82,11 +97,17 @@ typedef union {
 
 void udie(const char *, ...);
 void redraw(void);
+void redrawcursor(void);
 
 void sendbreak(const Arg *);
 
+void drawstats(const Arg *);
+
+void tfulldirt(void);
+Glyph tglyph(Rune, uchar);
 void tnew(int, int);
 void tresize(int, int);
+uchar tstyle(ushort, uint32_t, uint32_t);
 
 void resettitle(void);
 
@@ -11,6 +11,31 @@ static int borderpx = 2;
 /* identification sequence returned in DA and DECID */
 char *vtiden = "\033[?6c";
 
+/*
+ * where the fonts fontconfig finds are kept for the next run, under
+ * $XDG_CACHE_HOME or ~/.cache. NULL to match them every time.
+ */
+static char *fontcachename = "cdoedit/fonts";
+
+/*
+ * a rune from each of these blocks has its fallback font looked up in the
+ * background at startup, if the font doesn't have it
+ */
+static Rune prefetchrunes[] = {
+	0x03b1, /* Greek */
+	0x0430, /* Cyrillic */
+	0x05d0, /* Hebrew */
+	0x0627, /* Arabic */
+	0x0915, /* Devanagari */
+	0x2190, /* arrows */
+	0x2200, /* mathematical operators */
+	0x2500, /* box drawing */
+	0x3042, /* Hiragana */
+	0x4e00, /* CJK ideographs */
+	0xac00, /* Hangul */
+	0x1f600, /* emoticons */
+};
+
 /* Kerning / character bounding-box multipliers */
 static float cwscale = 1.0;
 static float chscale = 1.0;
@@ -25,9 +50,15 @@ wchar_t *worddelimiters = L" ";
 /* alt screens */
 int allowaltscreen = 1;
 
+/*
+ * draw into memory shared with the X server, compositing the glyphs in
+ * cdoedit, rather than with Xft. Servers without MIT-SHM, or over the network,
+ * are drawn to with Xft either way.
+ */
+static int xshm = 1;
+
 /* frames per second cdoedit should at maximum draw to the screen */
 static unsigned int xfps = 120;
-static unsigned int actionfps = 30;
 
 /*
  * blinking timeout (set to 0 to disable blinking) for the blinking
@@ -51,6 +82,16 @@ static int bellvolume = 0;
  */
 unsigned int tabspaces = 8;
 
+/*
+ * Colors, indexed by enum glyph_color. NULL entries are generated: black for
+ * the background and white for the foreground.
+ */
+static const char *colorname[] = {
+	[COLOR_BG]    = NULL,
+	[COLOR_FG]    = NULL,
+	[COLOR_MATCH] = "#5f5f00",
+};
+
 /*
  * Default colors (colorname index)
  * foreground, background, cursor, reverse cursor
@@ -116,6 +157,42 @@ static Shortcut shortcuts[] = {
 	{ DEFAULT_MASK,     CTRL,                 'v',            clippaste,      {.i =  0} },
 	{ DEFAULT_MASK,     CTRL,                 'X',            clipcut,        {.i =  0} },
 	{ DEFAULT_MASK,     CTRL,                 'x',            clipcut,        {.i =  0} },
+	{ DEFAULT_MASK,     META,                 'S',            sortlines,      {.i =  0} },
+	{ DEFAULT_MASK,     META,                 's',            sortlines,      {.i =  0} },
+	{ DEFAULT_MASK,     META|SHIFT,           'S',            sortlines,      {.i = +1} },
+	{ DEFAULT_MASK,     META|SHIFT,           's',            sortlines,      {.i = +1} },
+	{ DEFAULT_MASK,     META,                 'R',            reverselines,   {.i =  0} },
+	{ DEFAULT_MASK,     META,                 'r',            reverselines,   {.i =  0} },
+	{ IGNORE_SHIFT,     META,                 XK_bar,         pipeselection,  {.i =  0} },
+	{ IGNORE_SHIFT,     0,                    XK_Escape,      cancel,         {.i =  0} },
+	{ DEFAULT_MASK,     CTRL|META,            XK_Up,          addcursor,      {.i = -1} },
+	{ DEFAULT_MASK,     CTRL|META,            XK_Down,        addcursor,      {.i = +1} },
+	{ DEFAULT_MASK,     META|SHIFT,           'I',            splitselection, {.i = +1} },
+	{ DEFAULT_MASK,     META|SHIFT,           'i',            splitselection, {.i = +1} },
+
+	/* search */
+	/* modmask          modval                keysym          function        argument */
+	{ DEFAULT_MASK,     CTRL,                 'F',            find,           {.i = +1} },
+	{ DEFAULT_MASK,     CTRL,                 'f',            find,           {.i = +1} },
+	{ DEFAULT_MASK,     CTRL|SHIFT,           'F',            find,           {.i = -1} },
+	{ DEFAULT_MASK,     CTRL|SHIFT,           'f',            find,           {.i = -1} },
+	{ DEFAULT_MASK,     CTRL|META,            'F',            findre,         {.i = +1} },
+	{ DEFAULT_MASK,     CTRL|META,            'f',            findre,         {.i = +1} },
+	{ DEFAULT_MASK,     CTRL|META|SHIFT,      'F',            findre,         {.i = -1} },
+	{ DEFAULT_MASK,     CTRL|META|SHIFT,      'f',            findre,         {.i = -1} },
+	{ DEFAULT_MASK,     0,                    XK_F3,          findnext,       {.i = +1} },
+	{ DEFAULT_MASK,     SHIFT,                XK_F3,          findnext,       {.i = -1} },
+	{ DEFAULT_MASK,     CTRL,                 'G',            findnext,       {.i = +1} },
+	{ DEFAULT_MASK,     CTRL,                 'g',            findnext,       {.i = +1} },
+	{ DEFAULT_MASK,     CTRL|SHIFT,           'G',            findnext,       {.i = -1} },
+	{ DEFAULT_MASK,     CTRL|SHIFT,           'g',            findnext,       {.i = -1} },
+	{ DEFAULT_MASK,     CTRL,                 'H',            replaceall,     {.i =  0} },
+	{ DEFAULT_MASK,     CTRL,                 'h',            replaceall,     {.i =  0} },
+	{ DEFAULT_MASK,     META,                 'K',            filterlines,    {.i = +1} },
+	{ DEFAULT_MASK,     META,                 'k',            filterlines,    {.i = +1} },
+	{ DEFAULT_MASK,     META,                 'D',            filterlines,    {.i = -1} },
+	{ DEFAULT_MASK,     META,                 'd',            filterlines,    {.i = -1} },
+	{ DEFAULT_MASK,     META,                 XK_Return,      selectmatches,  {.i =  0} },
 
 	/* history */
 	/* modmask          modval                keysym          function        argument */
@@ -164,6 +241,31 @@ static Shortcut shortcuts[] = {
 	{ DEFAULT_MASK,     CTRL,                 's',            save,           {.i =  0} },
 	{ DEFAULT_MASK,     CTRL,                 'R',            load,           {.i =  0} },
 	{ DEFAULT_MASK,     CTRL,                 'r',            load,           {.i =  0} },
+	{ DEFAULT_MASK,     META,                 'Z',            togglewrap,     {.i =  0} },
+	{ DEFAULT_MASK,     META,                 'z',            togglewrap,     {.i =  0} },
+	{ DEFAULT_MASK,     0,                    XK_F12,         drawstats,      {.i =  0} },
+};
+
+/* Keyboard shortcuts while the prompt at the bottom of the window is open. */
+static Shortcut promptshortcuts[] = {
+	/* modmask          modval                keysym          function        argument */
+	{ IGNORE_SHIFT,     0,                    XK_Return,      promptaccept,   {.i =  0} },
+	{ IGNORE_SHIFT,     0,                    XK_KP_Enter,    promptaccept,   {.i =  0} },
+	{ IGNORE_SHIFT,     0,                    XK_Escape,      promptcancel,   {.i =  0} },
+	{ IGNORE_SHIFT,     0,                    XK_BackSpace,   promptdelete,   {.i =  0} },
+	{ DEFAULT_MASK,     CTRL,                 'V',            clippaste,      {.i =  0} },
+	{ DEFAULT_MASK,     CTRL,                 'v',            clippaste,      {.i =  0} },
+	{ DEFAULT_MASK,     0,                    XK_F3,          findnext,       {.i = +1} },
+	{ DEFAULT_MASK,     SHIFT,                XK_F3,          findnext,       {.i = -1} },
+	{ DEFAULT_MASK,     0,                    XK_Down,        findnext,       {.i = +1} },
+	{ DEFAULT_MASK,     0,                    XK_Up,          findnext,       {.i = -1} },
+	{ DEFAULT_MASK,     CTRL,                 'H',            replaceall,     {.i =  0} },
+	{ DEFAULT_MASK,     CTRL,                 'h',            replaceall,     {.i =  0} },
+	{ DEFAULT_MASK,     META,                 'K',            filterlines,    {.i = +1} },
+	{ DEFAULT_MASK,     META,                 'k',            filterlines,    {.i = +1} },
+	{ DEFAULT_MASK,     META,                 'D',            filterlines,    {.i = -1} },
+	{ DEFAULT_MASK,     META,                 'd',            filterlines,    {.i = -1} },
+	{ DEFAULT_MASK,     META,                 XK_Return,      selectmatches,  {.i =  0} },
 };
 
 /*
@@ -0,0 +1,505 @@
+/* See LICENSE for license details. */
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "util.h"
+#include "re.h"
+#include "count.h"
+
+/*
+ * Counts the matches of a search in the document on worker threads, so the count of a huge
+ * document doesn't hold up the editor.
+ *
+ * The threads read the document where it is, in the two spans either side of the gap, with
+ * positions given as indexes into the text. Before the editor moves the text around in memory it
+ * calls countpause(), which waits for the threads to stop reading, and countresume() afterwards
+ * with the new spans. Once the text itself changes the count is of no use and is stopped instead.
+ *
+ * The text is split into chunks which the threads take one at a time. Each chunk counts the matches
+ * that start inside it, searching past its end for the end of the last one. Matches don't overlap,
+ * so a match running over the end of a chunk means the next chunk may have started its search in
+ * the wrong place. Chunks are merged in order on the main thread, and a chunk that started in the
+ * middle of a match is searched again from the end of it until the two searches find the same
+ * match, after which they find the same matches all the way to the end of the chunk. That's usually
+ * straight away so the main thread only searches a few bytes per chunk.
+ *
+ * Whenever a chunk is finished a byte is written to a pipe, which the run loop waits on along with
+ * the X connection.
+ *
+ * The matches themselves are kept as well, up to COUNT_MAXMATCHES of them, so the editor can use
+ * them as an index once the count is finished instead of searching again.
+ */
+
+#define COUNT_MAXTHREADS 16
+#define COUNT_MAXCHUNKS 1024      /* so the overview and countbefore() have something to work with */
+#define COUNT_MINCHUNK 4096
+#define COUNT_STEP 65536          /* bytes searched between checks for cancellation */
+#define COUNT_FIRST 16            /* match starts kept to line a chunk up with the one before */
+#define COUNT_MAXMATCHES (1 << 22)  /* matches kept, 64MB of them */
+
+typedef struct {
+	size_t start, end;      /* matches starting in [start, end) are counted */
+	size_t count;
+	size_t first[COUNT_FIRST];
+	size_t next;            /* where the search carries on after the last match */
+	Match *m;               /* the matches, NULL if there are too many to keep */
+	size_t cap;
+	bool done;
+	/* set when the chunk is merged */
+	size_t from;            /* where the search of the whole text enters the chunk */
+	size_t before;          /* matches in the chunks before */
+} Chunk;
+
+struct Count {
+	ReText t;               /* the text either side of the gap */
+	size_t len;
+	char *needle;
+	size_t nlen;
+	bool regex;
+	Regex *re;              /* each thread has its own as the DFA is built as it's used */
+	Chunk *chunks;
+	size_t nchunks, chunksize;
+	size_t taken;           /* chunks handed out to threads */
+	size_t merged;
+	size_t total;           /* matches in the merged chunks */
+	size_t next;            /* where the search carries on after the last merged match */
+	Match *m;               /* the merged matches */
+	size_t cap;
+	size_t kept;            /* matches there's room for in all the chunks, up to COUNT_MAXMATCHES */
+	bool overflow;          /* there were too many matches to keep */
+	bool cancel;
+	bool paused;            /* the text is being moved, so the threads wait */
+	int reading;            /* threads that are reading the text */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;    /* signalled when paused, reading or cancel change */
+	pthread_t threads[COUNT_MAXTHREADS];
+	int nthreads;
+	int pipe[2];
+};
+
+static const char *
+textpointer(const Count *c, size_t i)
+{
+	size_t left = c->t.e[0] - c->t.s[0];
+	return i <= left ? c->t.s[0] + i : c->t.s[1] + (i - left);
+}
+
+static size_t
+textindex(const Count *c, const char *p)
+{
+	if (c->t.s[0] <= p && p <= c->t.e[0]) return p - c->t.s[0];
+	return (c->t.e[0] - c->t.s[0]) + (p - c->t.s[1]);
+}
+
+/* the first occurrence of the needle in [at, limit), or SIZE_MAX, searching each side of the gap
+   and a small window across it like dfind() does */
+static size_t
+textfind(const Count *c, size_t at, size_t limit)
+{
+	size_t left = c->t.e[0] - c->t.s[0], wl, wr, i;
+	const char *s;
+	char *window;
+	if (at >= limit) return SIZE_MAX;
+	if (limit <= left) {
+		s = memfind(c->t.s[0] + at, limit - at, c->needle, c->nlen);
+		return s ? (size_t)(s - c->t.s[0]) : SIZE_MAX;
+	}
+	if (at >= left) {
+		s = memfind(c->t.s[1] + (at - left), limit - at, c->needle, c->nlen);
+		return s ? left + (s - c->t.s[1]) : SIZE_MAX;
+	}
+	if ((s = memfind(c->t.s[0] + at, left - at, c->needle, c->nlen))) return s - c->t.s[0];
+	wl = MAX(at, left - MIN(left, c->nlen - 1));
+	wr = MIN(limit, left + c->nlen - 1);
+	if (wr - wl >= c->nlen) {
+		window = umalloc(wr - wl);
+		memcpy(window, c->t.s[0] + wl, left - wl);
+		memcpy(window + (left - wl), c->t.s[1], wr - left);
+		s = memfind(window, wr - wl, c->needle, c->nlen);
+		i = s ? wl + (s - window) : SIZE_MAX;
+		free(window);
+		if (i != SIZE_MAX) return i;
+	}
+	s = memfind(c->t.s[1], limit - left, c->needle, c->nlen);
+	return s ? left + (s - c->t.s[1]) : SIZE_MAX;
+}
+
+/* Looks for the first match starting at or after at, giving up around stop. Returns true with the
+   match in [*ms, *me), or false with *ms set to where to carry on from, SIZE_MAX if there's no match. */
+static bool
+findmatch(const Count *c, Regex *re, size_t at, size_t stop, size_t *ms, size_t *me)
+{
+	const char *s, *e;
+	size_t limit;
+	int r;
+	if (!re) {
+		limit = MIN(stop + c->nlen - 1, c->len);
+		if ((*ms = textfind(c, at, limit)) != SIZE_MAX) {
+			*me = *ms + c->nlen;
+			return true;
+		}
+		*ms = limit < c->len ? stop : SIZE_MAX;
+		return false;
+	}
+	r = refindfrom(re, &c->t, textpointer(c, at), textpointer(c, at), c->t.e[1], +1, MAX(stop - at, 1), &s, &e);
+	if (r > 0) {
+		*ms = textindex(c, s);
+		*me = textindex(c, e);
+		return true;
+	}
+	*ms = r < 0 ? textindex(c, s) : SIZE_MAX;
+	return false;
+}
+
+/* where the search carries on after the match [ms, me), stepping over an empty match like findnext does */
+static size_t
+aftermatch(const Count *c, size_t ms, size_t me)
+{
+	if (me > ms) return me;
+	if (me >= c->len) return c->len + 1;
+	do me++;
+	while (me < c->len && ((uchar)*textpointer(c, me) >> 6) == 2);
+	return me;
+}
+
+/* Stops reading the text while it's being moved. Returns false if the count was cancelled. */
+static bool
+countyield(Count *c)
+{
+	bool r;
+	pthread_mutex_lock(&c->lock);
+	if (c->paused && !c->cancel) {
+		c->reading--;
+		pthread_cond_broadcast(&c->cond);
+		while (c->paused && !c->cancel)
+			pthread_cond_wait(&c->cond, &c->lock);
+		c->reading++;
+	}
+	r = !c->cancel;
+	pthread_mutex_unlock(&c->lock);
+	return r;
+}
+
+/* asked by a thread's regex every so often, so that a long match doesn't hold up a pause */
+static bool
+countinterrupted(void *arg)
+{
+	Count *c = arg;
+	bool r;
+	pthread_mutex_lock(&c->lock);
+	r = c->paused || c->cancel;
+	pthread_mutex_unlock(&c->lock);
+	return r;
+}
+
+/* keeps a match found by a thread, unless it would be too many */
+static void
+chunkkeep(Count *c, Chunk *ch, size_t ms, size_t me)
+{
+	bool room;
+	if (ch->count == ch->cap) {
+		pthread_mutex_lock(&c->lock);
+		room = !c->overflow && c->kept + ch->cap + 64 <= COUNT_MAXMATCHES;
+		if (room) c->kept += ch->cap + 64;
+		else c->overflow = true;
+		pthread_mutex_unlock(&c->lock);
+		if (!room) {
+			free(ch->m);
+			ch->m = NULL;
+			ch->cap = SIZE_MAX;
+			return;
+		}
+		ch->cap += ch->cap + 64;
+		ch->m = urealloc(ch->m, ch->cap * sizeof(Match));
+	}
+	if (ch->m) ch->m[ch->count] = (Match){ ms, me };
+}
+
+/* returns false if the count was cancelled part way through */
+static bool
+countchunk(Count *c, Regex *re, Chunk *ch)
+{
+	size_t at = ch->start, ms, me;
+	ch->count = 0;
+	ch->next = ch->start;
+	ch->cap = 0;
+	while (at < ch->end) {
+		if ((ch->count & 255) == 0 && !countyield(c)) return false;
+		if (!findmatch(c, re, at, MIN(at + COUNT_STEP, ch->end), &ms, &me)) {
+			at = ms;
+			if (!countyield(c)) return false;
+			continue;
+		}
+		if (ms >= ch->end) break;
+		if (ch->count < COUNT_FIRST) ch->first[ch->count] = ms;
+		chunkkeep(c, ch, ms, me);
+		ch->count++;
+		at = ch->next = aftermatch(c, ms, me);
+	}
+	return true;
+}
+
+static void *
+countwork(void *arg)
+{
+	Count *c = arg;
+	Regex *re = NULL;
+	const char *err;
+	size_t i;
+	bool done;
+	if (c->regex && !(re = recompile(c->needle, c->nlen, &err))) return NULL;
+	if (re) restop(re, countinterrupted, c);
+	for (;;) {
+		pthread_mutex_lock(&c->lock);
+		while (c->paused && !c->cancel)
+			pthread_cond_wait(&c->cond, &c->lock);
+		i = c->cancel ? c->nchunks : c->taken < c->nchunks ? c->taken++ : c->nchunks;
+		if (i < c->nchunks) c->reading++;
+		pthread_mutex_unlock(&c->lock);
+		if (i >= c->nchunks) break;
+		done = countchunk(c, re, &c->chunks[i]);
+		pthread_mutex_lock(&c->lock);
+		c->reading--;
+		c->chunks[i].done = done;
+		pthread_cond_broadcast(&c->cond);
+		pthread_mutex_unlock(&c->lock);
+		if (!done) break;
+		/* the pipe only wakes the run loop up so if it's full that's fine */
+		while (write(c->pipe[1], "", 1) < 0 && errno == EINTR);
+	}
+	refree(re);
+	return NULL;
+}
+
+/* Starts counting the matches in the text t of length len, which has to stay where it is until
+   countpause() is called. */
+Count *
+countstart(const ReText *t, size_t len, const char *needle, size_t nlen, bool regex)
+{
+	Count *c = umalloc(sizeof(Count));
+	const char *err;
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	int i, r;
+	memset(c, 0, sizeof(Count));
+	c->t = *t;
+	c->len = len;
+	c->needle = umalloc(nlen + 1);
+	memcpy(c->needle, needle, nlen);
+	c->nlen = nlen;
+	c->regex = regex;
+	c->pipe[0] = c->pipe[1] = -1;
+	c->chunksize = MAX(DIVCEIL(len, COUNT_MAXCHUNKS), COUNT_MINCHUNK);
+	c->nchunks = MAX(DIVCEIL(len, c->chunksize), 1);
+	c->chunks = umalloc(c->nchunks * sizeof(Chunk));
+	for (size_t k = 0; k < c->nchunks; k++) {
+		c->chunks[k].m = NULL;
+		c->chunks[k].start = k * c->chunksize;
+		/* an empty match can start at the very end */
+		c->chunks[k].end = k + 1 < c->nchunks ? (k + 1) * c->chunksize : len + 1;
+		c->chunks[k].done = false;
+	}
+	pthread_mutex_init(&c->lock, NULL);
+	pthread_cond_init(&c->cond, NULL);
+	if (regex && !(c->re = recompile(needle, nlen, &err))) {
+		countfree(c);
+		return NULL;
+	}
+	if (pipe(c->pipe) < 0) {
+		printsyserror("Could not count matches");
+		countfree(c);
+		return NULL;
+	}
+	fcntl(c->pipe[0], F_SETFL, O_NONBLOCK);
+	fcntl(c->pipe[1], F_SETFL, O_NONBLOCK);
+	LIMIT(ncpu, 1, COUNT_MAXTHREADS);
+	for (i = 0; i < ncpu && (size_t)i < c->nchunks; i++) {
+		if ((r = pthread_create(&c->threads[i], NULL, countwork, c))) {
+			errno = r;
+			printsyserror("Could not start a thread to count matches");
+			break;
+		}
+		c->nthreads++;
+	}
+	if (!c->nthreads) {
+		countfree(c);
+		return NULL;
+	}
+	return c;
+}
+
+void
+countfree(Count *c)
+{
+	if (!c) return;
+	pthread_mutex_lock(&c->lock);
+	c->cancel = true;
+	pthread_cond_broadcast(&c->cond);
+	pthread_mutex_unlock(&c->lock);
+	for (int i = 0; i < c->nthreads; i++)
+		pthread_join(c->threads[i], NULL);
+	pthread_cond_destroy(&c->cond);
+	pthread_mutex_destroy(&c->lock);
+	if (c->pipe[0] >= 0) close(c->pipe[0]);
+	if (c->pipe[1] >= 0) close(c->pipe[1]);
+	refree(c->re);
+	for (size_t k = 0; k < c->nchunks; k++)
+		free(c->chunks[k].m);
+	free(c->m);
+	free(c->chunks);
+	free(c->needle);
+	free(c);
+}
+
+/* Waits for the threads to stop reading the text, so it can be moved until countresume(). */
+void
+countpause(Count *c)
+{
+	pthread_mutex_lock(&c->lock);
+	c->paused = true;
+	while (c->reading)
+		pthread_cond_wait(&c->cond, &c->lock);
+	pthread_mutex_unlock(&c->lock);
+}
+
+/* Lets the threads carry on with the same text, which is now in t. */
+void
+countresume(Count *c, const ReText *t)
+{
+	pthread_mutex_lock(&c->lock);
+	c->t = *t;
+	c->paused = false;
+	pthread_cond_broadcast(&c->cond);
+	pthread_mutex_unlock(&c->lock);
+}
+
+/* becomes readable when countupdate() has something to do */
+int
+countfd(const Count *c)
+{
+	return c->pipe[0];
+}
+
+static void
+countkeep(Count *c, const Match *m, size_t n)
+{
+	bool overflow;
+	pthread_mutex_lock(&c->lock);
+	overflow = c->overflow;
+	pthread_mutex_unlock(&c->lock);
+	if (overflow || !n) return;
+	if (c->total + n > c->cap) {
+		c->cap = MAX(c->total + n, 2 * c->cap);
+		c->m = urealloc(c->m, c->cap * sizeof(Match));
+	}
+	memcpy(c->m + c->total, m, n * sizeof(Match));
+}
+
+/* merge the next chunk, searching it again if the search of the whole text doesn't enter it at its start */
+static void
+countmerge(Count *c, Chunk *ch)
+{
+	size_t at, ms, me, n = 0, j = 0, nfirst = MIN(ch->count, COUNT_FIRST);
+	ch->before = c->total;
+	ch->from = MAX(c->next, ch->start);
+	if (c->next <= ch->start) {
+		countkeep(c, ch->m, ch->count);
+		c->total += ch->count;
+		if (ch->count) c->next = ch->next;
+		return;
+	}
+	for (at = c->next; at < ch->end;) {
+		if (!findmatch(c, c->re, at, ch->end, &ms, &me)) {
+			at = ms;
+			continue;
+		}
+		if (ms >= ch->end) break;
+		while (j < nfirst && ch->first[j] < ms) j++;
+		if (j < nfirst && ch->first[j] == ms) {
+			/* caught up with the chunk's own search, from here on they find the same matches */
+			countkeep(c, ch->m + j, ch->count - j);
+			c->total += ch->count - j;
+			c->next = ch->next;
+			return;
+		}
+		countkeep(c, &(Match){ ms, me }, 1);
+		c->total++;
+		n++;
+		at = c->next = aftermatch(c, ms, me);
+	}
+}
+
+/* Merge the chunks the threads have finished. */
+void
+countupdate(Count *c)
+{
+	char buf[256];
+	bool done;
+	while (read(c->pipe[0], buf, sizeof(buf)) > 0);
+	while (c->merged < c->nchunks) {
+		pthread_mutex_lock(&c->lock);
+		done = c->chunks[c->merged].done;
+		pthread_mutex_unlock(&c->lock);
+		if (!done) break;
+		countmerge(c, &c->chunks[c->merged]);
+		free(c->chunks[c->merged].m);
+		c->chunks[c->merged].m = NULL;
+		c->merged++;
+	}
+}
+
+/* the number of matches counted so far, done is set once they all have been */
+size_t
+counttotal(const Count *c, bool *done)
+{
+	*done = c->merged == c->nchunks;
+	return c->total;
+}
+
+/* Once the count is finished, hands over the matches found unless there were too many to keep. */
+bool
+countmatches(Count *c, Match **m, size_t *n)
+{
+	if (c->merged < c->nchunks || c->overflow) return false;
+	*m = c->m;
+	*n = c->total;
+	c->m = NULL;
+	c->cap = 0;
+	return true;
+}
+
+/* The number of matches before the index pos, or SIZE_MAX if that isn't known yet. */
+size_t
+countbefore(Count *c, size_t pos)
+{
+	size_t k = MIN(pos / c->chunksize, c->nchunks - 1), n, at, ms, me;
+	if (k >= c->merged) return SIZE_MAX;
+	n = c->chunks[k].before;
+	for (at = c->chunks[k].from; at < pos;) {
+		if (!findmatch(c, c->re, at, pos, &ms, &me)) {
+			at = ms;
+			continue;
+		}
+		if (ms >= pos) break;
+		n++;
+		at = aftermatch(c, ms, me);
+	}
+	return n;
+}
+
+/* Spread the matches counted so far over n rows by where they are in the text. */
+void
+countoverview(const Count *c, size_t *rows, int n)
+{
+	memset(rows, 0, n * sizeof(*rows));
+	for (size_t k = 0; k < c->merged; k++) {
+		rows[c->chunks[k].start * n / (c->len + 1)] +=
+			(k + 1 < c->merged ? c->chunks[k+1].before : c->total) - c->chunks[k].before;
+	}
+}
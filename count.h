@@ -0,0 +1,21 @@
+/* See LICENSE for license details. */
+
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef struct Count Count;
+
+typedef struct {
+	size_t start, end;
+} Match;
+
+Count *countstart(const ReText *t, size_t len, const char *needle, size_t nlen, bool regex);
+void countfree(Count *c);
+void countpause(Count *c);
+void countresume(Count *c, const ReText *t);
+int countfd(const Count *c);
+void countupdate(Count *c);
+size_t counttotal(const Count *c, bool *done);
+bool countmatches(Count *c, Match **m, size_t *n);
+size_t countbefore(Count *c, size_t pos);
+void countoverview(const Count *c, size_t *rows, int n);
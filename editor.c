@@ -2,18 +2,27 @@
 #define _GNU_SOURCE
 #include <assert.h>
 #include <ctype.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "util.c"
 #include "editor.h"
+#include "re.h"
+#include "count.h"
+#include "sort.h"
 
 typedef enum {
 	LEFTONDELETE = 1,
@@ -29,8 +38,27 @@ typedef enum {
 	NOP,
 	INSERT,
 	DELETE,
+	BATCH,
+	UNBATCH,
 } ActionType;
 
+/* bytes searched by a long running search before it checks for input */
+#define SEARCH_CHUNK (16 << 20)
+/* matches replaced by a replace-all before it checks for input */
+#define REPLACE_BATCH 65536
+/* bytes between the column checkpoints of a long line, and how long a line has to be to get them */
+#define COL_STEP 4096
+#define COL_LONG 65536
+/* long lines the checkpoints are kept for, the one used longest ago is dropped to make room */
+#define COL_LINES 256
+/* lines kept in the wrap cache, it's emptied when it fills up */
+#define WRAP_CACHE 4096
+/* milliseconds without an edit before the matches are counted again */
+#define COUNT_QUIET 250
+/* milliseconds a cancelled command has to exit before it's killed, and between looking for exits */
+#define COMMAND_GRACE 1000
+#define COMMAND_POLL 50
+
 #define ISSELECT(a) ((a) == -2 || (a) == 2)
 #define POSCMP(d, a, b) ( \
 	((a) >= (d)->curright ? (a) - ((d)->curright - (d)->curleft) : (a)) - \
@@ -67,17 +95,63 @@ typedef struct {
 	char *curright;         /* start of the lower section */
 	char *renderstart;      /* top left of the editor */
 	char *selanchor;
+	int scrollcol;          /* first column shown when lines aren't wrapped */
 	bool coldirty;
 	int col;
+	unsigned long version;  /* changes whenever the text does */
 	UpdateSet us;
+	void (*beforemove)(void);  /* called before the text is moved in memory, can be NULL */
+	void (*aftermove)(bool edited);  /* and after, edited if it was changed as well */
 } Document;
 
+/* one replacement in a batch of edits made in a single pass, see dapplybatch() */
+typedef struct {
+	size_t position;        /* index in the document before the batch */
+	size_t len;             /* bytes replaced */
+	size_t newlen;          /* bytes replacing them */
+} Edit;
+
+/* walks indexes in increasing order through a batch of edits, see dmapnext() */
+typedef struct {
+	const Edit *e;
+	size_t n, j;
+	ptrdiff_t shift;        /* how far the edits before e[j] moved things */
+	bool reverse;
+} BatchMap;
+
+/* an extra cursor, the document's own cursor is the main one */
+typedef struct {
+	size_t anchor;          /* other end of the selection, SIZE_MAX if there isn't one */
+	size_t pos;
+	int col;                /* column kept while moving up and down, -1 if it needs working out */
+} Cursor;
+
+typedef enum {
+	NAVCHAR,
+	NAVWORD,
+	NAVLINE,
+	NAVROW,
+	NAVPAGE,
+	NAVPARAGRAPH,
+	NAVDOCUMENT,
+} NavUnit;
+
+/* what a keystroke deletes from a cursor without a selection */
+typedef enum {
+	DELNONE,
+	DELCHAR,
+	DELWORD,
+	DELROW,
+} DeleteUnit;
+
 typedef struct {
 	ActionType type;
 	size_t position;
 	size_t size;
 	size_t curbefore, curafter;
-	char *data;
+	char *data;             /* for a batch, the old then the new text of each edit */
+	Edit *edits;
+	size_t nedits;
 } Action;
 
 typedef struct {
@@ -87,9 +161,165 @@ typedef struct {
 	size_t cur;
 } History;
 
+/* single line of input shown on the bottom row, eg. for the find command */
+typedef struct {
+	bool active;
+	const char *label;
+	const char *status;     /* shown after the text, eg. "not found" */
+	char *text;
+	size_t len;
+	size_t cap;
+	void (*update)(void);   /* called whenever the text changes */
+	void (*accept)(void);
+	void (*cancel)(void);
+} Prompt;
+
+typedef struct {
+	char *needle;
+	size_t len;
+	bool regex;             /* the needle is a pattern */
+	Regex *re;              /* NULL if the pattern doesn't compile */
+	bool highlight;         /* highlight every visible match */
+	int dir;                /* direction of the find prompt */
+	size_t origin;          /* cursor index to go back to if the find prompt is cancelled */
+	size_t originanchor;    /* SIZE_MAX if there was no selection */
+} Search;
+
+/* work too slow to do between two frames, done a piece at a time from the run loop */
+typedef struct {
+	bool active;
+	bool (*work)(void);     /* does the next piece, returns false once the job is finished, NULL
+	                           while the job is waiting on a file descriptor instead */
+} Job;
+
+/* a cancelled command that hasn't been reaped yet */
+typedef struct {
+	pid_t pid;
+	struct timespec at;     /* when its process group was sent SIGTERM, SIGKILL follows after a while */
+	bool exited;
+} Killed;
+
+/* a command the selection is being piped through */
+typedef struct {
+	pid_t pid;              /* and its process group, 0 when there isn't one running */
+	int in, out;            /* the command's stdin and stdout, -1 once they're closed */
+	size_t lo, hi;          /* the text piped in, as indexes */
+	size_t sent;
+	char *buf;              /* what the command has written so far */
+	size_t len, cap;
+	char status[48];
+	Killed *killed;
+	size_t nkilled, killedcap;
+} Command;
+
+typedef struct {
+	char *with;             /* replacement, \0 in it stands for the match when the search is a regex */
+	size_t withlen;
+	size_t from, at;        /* the search in progress started at from and carries on from at */
+	size_t len;             /* length of the document */
+	Edit *edits;
+	size_t nedits, editcap;
+	char *data;
+	size_t datalen, datacap;
+	char status[32];
+	int filter;             /* instead of replacing, +1 keeps the lines with a match and -1 deletes them */
+	size_t line, next;      /* the first line not filtered yet, and the start of the one after if known */
+	size_t kept, removed;   /* lines */
+} Replace;
+
+/* The matches of the search, kept up to date as the document is edited instead of being searched
+   for again. Like the document it has a gap, which is wherever the last edit was: matches before it
+   are stored as indexes from the start of the document and matches after it as distances from the
+   end, so an edit only touches the matches near it. */
+typedef struct {
+	Match *m;
+	size_t cap;
+	size_t left;            /* m[0, left) count from the start */
+	size_t right;           /* m[right, cap) count from the end */
+	size_t len;             /* of the document */
+	unsigned long version;  /* of the document the matches are for */
+	bool valid;
+} MatchIndex;
+
+/* How many rows a line takes when it's wrapped to the width of the window, for the lines that have
+   been scrolled past. It follows edits like the match index, only dropping the lines that changed. */
+typedef struct {
+	size_t start;           /* index of the line's first char */
+	size_t len;             /* bytes up to the start of the next line */
+	size_t rows;
+} WrapLine;
+
+typedef struct {
+	WrapLine *l;            /* in order */
+	size_t n, cap;
+	int colc;               /* the width the lines were wrapped to */
+	unsigned long version;  /* of the document the lines are for */
+} WrapCache;
+
+/* Columns at checkpoints every COL_STEP bytes along the long lines whose columns were needed lately, so
+   finding a column in one only walks from the checkpoint before it. They're kept as offsets from the
+   start of the line so edits before it only move the start, and like the wrap cache they follow edits
+   instead of being thrown away, so every long line on screen keeps its own. The starts of its rows when
+   it's wrapped are kept the same way, so placing the view in it only walks from the row before. */
+typedef struct {
+	size_t off;             /* from the start of the line, on a char boundary */
+	int col;
+} ColMark;
+
+typedef struct {
+	size_t off;             /* from the start of the line */
+	size_t row;             /* of the line that starts there */
+} RowMark;
+
+typedef struct {
+	size_t start;           /* index of the line's first char */
+	size_t known;           /* bytes from the start known to be in the line */
+	size_t end;             /* offset of the '\n' or the end of the document ending it, SIZE_MAX if not known */
+	ColMark *m;             /* in order, m[0] is the start of the line */
+	size_t n, cap;
+	RowMark *r;             /* the same for rows when the line is wrapped to rowcolc */
+	size_t nr, rcap;
+	int rowcolc;
+	unsigned long used;     /* when it was last looked up */
+} ColIndex;
+
+typedef struct {
+	ColIndex *x;            /* in order of their starts, COL_LINES of them */
+	size_t n;
+	unsigned long version;  /* of the document the lines are for */
+	unsigned long clock;    /* counts lookups */
+} ColCache;
+
+/* what the last edraw() drew apart from the cursor, to tell when only the cursor has moved since */
+typedef struct {
+	bool valid;             /* nothing but the text, the search and the bottom row was drawn */
+	unsigned long version;
+	size_t top;             /* index of the top left */
+	int scrollcol, textc, docrows;
+	bool nowrap, highlight;
+	char status[256];       /* the bottom row */
+} Drawn;
+
 /* Globals */
 static Document doc;
 static History history;
+static Prompt prompt;
+static Search search;
+static Job job;
+static Replace replace;
+static Command command;
+static char message[256];   /* shown on the bottom row until the next edit */
+static Count *count;        /* of the matches of the search being highlighted */
+static MatchIndex matches;  /* of the search being highlighted once they've been counted */
+static WrapCache wraps;     /* rows taken by the lines around the viewport */
+static ColCache cols;       /* column checkpoints along the long lines used lately */
+static Drawn drawn;
+static Cursor *cursors;     /* extra cursors in order, their selections don't overlap */
+static size_t ncursors, cursorcap;
+static bool sortunique;     /* for the sort whose prompt is open */
+static bool nowrap;         /* lines run off the side of the screen instead of wrapping */
+static unsigned long countversion; /* of the document that was counted */
+static struct timespec edittime;   /* of the last edit, the count waits for typing to stop */
 char *filename = NULL;
 
 bool
@@ -146,6 +376,11 @@ dreadchar(const Document *d, const char *pos, const char **next, int dir)
 			return RUNE_EOF;
 		}
 		assert_valid_read(d, pos);
+		/* most text is ascii, which doesn't need decoding */
+		if (!((uchar)*pos & 128)) {
+			*next = pos + 1;
+			return (uchar)*pos;
+		}
 		Rune r;
 		*next = pos + utf8decode(pos, &r, d->bufend - pos);
 		return r;
@@ -333,6 +568,18 @@ dupdateonnavigate(Document *d, char *newcursor)
 	usflip(&d->us);
 }
 
+void
+dbeforemove(Document *d)
+{
+	if (d->beforemove) d->beforemove();
+}
+
+void
+daftermove(Document *d, bool edited)
+{
+	if (d->aftermove) d->aftermove(edited);
+}
+
 void
 dgrowgap(Document *d, size_t change)
 {
@@ -350,6 +597,7 @@ void
 dinsert(Document *d, char *pos, char *insertstr, size_t len)
 {
 	usadd(&d->us, &pos, 0);
+	dbeforemove(d);
 	dgrowgap(d, len);
 	if (pos <= d->curleft) {
 		memmove(pos + len, pos, d->curleft - pos);
@@ -359,8 +607,10 @@ dinsert(Document *d, char *pos, char *insertstr, size_t len)
 		memcpy(pos - len, insertstr, len);
 	}
 	d->coldirty = true;
+	d->version++;
 	dupdateoninsert(d, pos, len);
 	usremv(&d->us, &pos);
+	daftermove(d, true);
 }
 
 bool
@@ -375,25 +625,209 @@ disparagraphboundry(const Document *d, const char *pos)
 	return true;
 }
 
+/* index means index to character in the document. Ie. excluding the gap. */
+char *
+dindextopointer(const Document *d, size_t index)
+{
+	char *p = index <= (size_t)(d->curleft - d->bufstart) ?
+		d->bufstart + index :
+		d->bufstart + (index + (d->curright - d->curleft));
+	assert_valid_pos(d, p);
+	return p;
+}
+
+size_t
+dpointertoindex(const Document *d, const char *p)
+{
+	assert_valid_pos(d, p);
+	size_t index = p <= d->curleft ?
+		p - d->bufstart :
+		(p - d->bufstart) - (d->curright - d->curleft);
+	return index;
+}
+
+void
+cifree(ColIndex *x)
+{
+	free(x->m);
+	free(x->r);
+}
+
+/* Drop the indexed lines if the document has changed other than through eafteraction(). */
+void
+cicheck(ColCache *c, const Document *d)
+{
+	size_t i;
+	if (c->version == d->version) return;
+	for (i = 0; i < c->n; i++)
+		cifree(&c->x[i]);
+	c->n = 0;
+	c->version = d->version;
+}
+
+/* The indexed line the index i is known to be in, up to and including the '\n' ending it, or NULL. */
+ColIndex *
+cifind(ColCache *c, const Document *d, size_t i)
+{
+	size_t lo = 0, hi, mid;
+	ColIndex *x;
+	cicheck(c, d);
+	for (hi = c->n; lo < hi; ) {
+		mid = lo + (hi - lo) / 2;
+		if (c->x[mid].start <= i) lo = mid + 1;
+		else hi = mid;
+	}
+	if (lo == 0) return NULL;
+	x = &c->x[lo-1];
+	if (i - x->start > x->known && (x->end == SIZE_MAX || i - x->start > x->end)) return NULL;
+	x->used = ++c->clock;
+	return x;
+}
+
+/* The column index for the line starting at start, which is started if it isn't indexed yet. */
+ColIndex *
+ciline(ColCache *c, const Document *d, size_t start)
+{
+	size_t i, old = 0;
+	ColIndex *x = cifind(c, d, start);
+	if (x && x->start == start) return x;
+	if (c->n == COL_LINES) {
+		for (i = 1; i < c->n; i++)
+			if (c->x[i].used < c->x[old].used) old = i;
+		cifree(&c->x[old]);
+		memmove(&c->x[old], &c->x[old+1], (c->n - old - 1) * sizeof(*c->x));
+		c->n--;
+	}
+	for (i = c->n; i > 0 && c->x[i-1].start > start; i--);
+	memmove(&c->x[i+1], &c->x[i], (c->n - i) * sizeof(*c->x));
+	c->n++;
+	x = &c->x[i];
+	*x = (ColIndex){ .start = start, .end = SIZE_MAX, .cap = 16, .rcap = 16, .used = ++c->clock };
+	x->m = umalloc(x->cap * sizeof(*x->m));
+	x->m[0] = (ColMark){ 0, 0 };
+	x->n = 1;
+	x->r = umalloc(x->rcap * sizeof(*x->r));
+	x->r[0] = (RowMark){ 0, 0 };
+	x->nr = 1;
+	return x;
+}
+
+/* Keep the indexed lines right after a batch of edits, given in the same way as to dmapnext() along
+   with the text of the action. Edits before a line move it and an edit that joins it to the line
+   before drops it. The checkpoints after the first edit in a line are dropped since a tab after it
+   could now line up differently and the rows after it could break elsewhere, but unless the edits in
+   it add or remove a '\n' the line still ends where it did, moved along by what they added. */
+void
+ciedit(ColCache *c, const Edit *e, size_t n, bool reverse, const char *data)
+{
+	size_t i, j = 0, jj, k = 0, sp = 0, sl = 0, dl, off = 0, o, first;
+	ptrdiff_t shift = 0, s, within;
+	ColIndex *x;
+	for (i = 0; i < c->n; i++) {
+		x = &c->x[i];
+		for (; j < n; off += e[j].len + e[j].newlen, j++) {
+			sp = reverse ? e[j].position - shift : e[j].position;
+			sl = reverse ? e[j].newlen : e[j].len;
+			dl = reverse ? e[j].len : e[j].newlen;
+			if (sp + sl >= x->start) break;
+			shift += (ptrdiff_t)dl - (ptrdiff_t)sl;
+		}
+		if (j < n && sp < x->start) {
+			cifree(x);
+			continue;
+		}
+		first = SIZE_MAX;
+		within = 0;
+		for (jj = j, o = off, s = shift; jj < n; o += e[jj].len + e[jj].newlen, jj++) {
+			sp = reverse ? e[jj].position - s : e[jj].position;
+			sl = reverse ? e[jj].newlen : e[jj].len;
+			dl = reverse ? e[jj].len : e[jj].newlen;
+			if (x->end != SIZE_MAX && sp > x->start + x->end) break;
+			first = MIN(first, sp - x->start);
+			within += (ptrdiff_t)dl - (ptrdiff_t)sl;
+			s += (ptrdiff_t)dl - (ptrdiff_t)sl;
+			if (x->end == SIZE_MAX || memchr(data + o, '\n', e[jj].len + e[jj].newlen)) {
+				x->end = SIZE_MAX;
+				break;
+			}
+		}
+		if (first != SIZE_MAX) {
+			for (jj = x->n; jj > 1 && x->m[jj-1].off > first; jj--);
+			x->n = jj;
+			for (jj = x->nr; jj > 1 && x->r[jj-1].off > first; jj--);
+			x->nr = jj;
+			x->known = MIN(x->known, first);
+			if (x->end != SIZE_MAX) x->end += within;
+		}
+		x->start += shift;
+		c->x[k++] = *x;
+	}
+	c->n = k;
+}
+
+/* Walk the indexed line from the last checkpoint before the offset to or the column tocol, up to
+   whichever comes first or the end of the line, adding checkpoints along new ground on the way. */
+const char *
+ciwalk(ColIndex *x, const Document *d, size_t to, int tocol, int *col)
+{
+	size_t lo = 0, hi = x->n, mid, off;
+	const char *p, *q;
+	Rune r;
+	while (hi - lo > 1) {
+		mid = lo + (hi - lo) / 2;
+		if (x->m[mid].off <= to && x->m[mid].col < tocol) lo = mid;
+		else hi = mid;
+	}
+	off = x->m[lo].off;
+	*col = x->m[lo].col;
+	p = dindextopointer(d, x->start + off);
+	while (off < to && *col < tocol) {
+		r = dreadchar(d, p, &q, +1);
+		if (r == '\n' || r == RUNE_EOF) break;
+		if (r == '\t') *col = ((*col+8) & ~7);
+		else if (isprint(r)) (*col)++;
+		off += POSCMP(d, q, p);
+		p = q;
+		if (off >= x->m[x->n-1].off + COL_STEP) {
+			x->m = grow(x->m, &x->cap, x->n + 1, sizeof(*x->m));
+			x->m[x->n++] = (ColMark){ off, *col };
+		}
+	}
+	x->known = MAX(x->known, off);
+	return p;
+}
+
 int
 dgetcol(const Document *d, const char *pos)
 {
 	assert_valid_pos(d, pos);
-	const char *q;
+	const char *q, *left;
+	size_t i = dpointertoindex(d, pos), start;
 	int col = 0;
+	ColIndex *x;
+	/* a long line that's been indexed doesn't need its start finding */
+	if ((x = cifind(&cols, d, i))) {
+		ciwalk(x, d, i - x->start, INT_MAX, &col);
+		return col;
+	}
+	q = NULL;
 	if (pos >= d->curright) {
 		assert_valid_read_range(d, d->curright, pos);
 		q = memrchr(d->curright, '\n', pos - d->curright);
-		if (q) {
-			q++; /* start of next line */
-			goto walk;
-		}
 	}
-	assert_valid_read_range(d, d->bufstart, pos);
-	q = memrchr(d->bufstart, '\n', pos - d->bufstart);
+	if (!q) {
+		/* the line starts left of the gap */
+		left = pos >= d->curright ? d->curleft : pos;
+		assert_valid_read_range(d, d->bufstart, left);
+		q = memrchr(d->bufstart, '\n', left - d->bufstart);
+	}
 	if (!q) q = d->bufstart;
-	else q++;
-walk:
+	else q++; /* start of next line */
+	start = dpointertoindex(d, q);
+	if (i - start >= COL_LONG) {
+		ciwalk(ciline(&cols, d, start), d, i - start, INT_MAX, &col);
+		return col;
+	}
 	for (;;) {
 		if (0 == POSCMP(d, q, pos)) return col;
 		Rune r = dreadchar(d, q, &q, +1);
@@ -407,8 +841,15 @@ char *
 dgetposnearcol(const Document *d, const char *linestart, int col)
 {
 	int c = 0;
+	size_t start = dpointertoindex(d, linestart), n = 0;
 	const char *pos = linestart, *q;
+	ColIndex *x = cifind(&cols, d, start);
+	if (x && x->start == start)
+		return (char *)ciwalk(x, d, SIZE_MAX, col, &c);
 	while (c < col) {
+		/* carry on through a long line with checkpoints for next time */
+		if (++n == COL_LONG)
+			return (char *)ciwalk(ciline(&cols, d, start), d, SIZE_MAX, col, &c);
 		Rune r = dreadchar(d, pos, &q, +1);
 		if (r == '\n') break;
 		else if (r == '\t') c = ((c+8) & ~7);
@@ -435,6 +876,19 @@ dwalkword(const Document *d, const char *pos, int change)
 char *
 dwalkrow(const Document *d, const char *pos, int change)
 {
+	size_t i, len = (d->bufend - d->bufstart) - (d->curright - d->curleft);
+	ColIndex *x = cifind(&cols, d, dpointertoindex(d, pos));
+	/* the start of an indexed long line and its end once it's been found aren't looked for again */
+	if (x && change <= 0) {
+		if (change == 0 || x->start == 0) return dindextopointer(d, x->start);
+		return dwalkrow(d, dindextopointer(d, x->start - 1), change + 1);
+	}
+	if (x && x->end != SIZE_MAX) {
+		i = x->start + x->end;
+		if (i == len) return d->bufend;
+		pos = dindextopointer(d, i + 1);
+		return change == 1 ? (char *)pos : dwalkrow(d, pos, change - 1);
+	}
 	pos = change > 0 ?
 		(pos == d->curleft ? d->curright : pos) :
 		(pos == d->curright ? d->curleft : pos);
@@ -444,6 +898,10 @@ dwalkrow(const Document *d, const char *pos, int change)
 	if (change > 0) {
 		while (change > 0) {
 			char *q = memchr(pos, '\n', end - pos);
+			if (q && x) {
+				x->end = x->known = dpointertoindex(d, q) - x->start;
+				x = NULL;
+			}
 			if (q) {
 				pos = q + 1;
 				change--;
@@ -451,6 +909,7 @@ dwalkrow(const Document *d, const char *pos, int change)
 				pos = d->curright;
 				end = d->bufend;
 			} else {
+				if (x) x->end = x->known = len - x->start;
 				pos = end;
 				break;
 			}
@@ -476,6 +935,42 @@ dwalkrow(const Document *d, const char *pos, int change)
 	return (char *)pos;
 }
 
+/* Where navigating from pos by one unit in the direction dir goes. col is the column kept while
+   moving up and down, worked out if it's -1, and is set to -1 by moves that don't keep it. */
+char *
+dnavtarget(const Document *d, const char *pos, NavUnit unit, int dir, int *col)
+{
+	const char *q;
+	Rune r;
+	if (unit != NAVROW && unit != NAVPAGE) *col = -1;
+	else if (*col < 0) *col = dgetcol(d, pos);
+	switch (unit) {
+	case NAVCHAR:
+		return dwalkrune(d, pos, dir);
+	case NAVWORD:
+		return dwalkword(d, pos, dir);
+	case NAVLINE:
+		if (dir < 0) return dwalkrow(d, pos, 0);
+		while ((r = dreadchar(d, pos, &q, +1)) != '\n' && r != RUNE_EOF)
+			pos = q;
+		return (char *)pos;
+	case NAVROW:
+		return dgetposnearcol(d, dwalkrow(d, pos, dir), *col);
+	case NAVPAGE:
+		return dgetposnearcol(d, dwalkrow(d, pos, dir * 20), *col);
+	case NAVPARAGRAPH:
+		do {
+			pos = dwalkrow(d, pos, dir);
+			if (0 == POSCMP(d, pos, d->bufstart) && dir < 0) break;
+			if (0 == POSCMP(d, pos, d->bufend) && dir > 0) break;
+		} while (!disparagraphboundry(d, pos));
+		return (char *)pos;
+	case NAVDOCUMENT:
+		return dir > 0 ? d->bufend : d->bufstart;
+	}
+	return (char *)pos;
+}
+
 /* return value heap-allocated and null terminated */
 char *
 dgetsubstr(const Document *d, char *start, char *end)
@@ -501,18 +996,21 @@ dnavigate(Document *d, char *pos, bool isselect)
 {
 	if (isselect && !d->selanchor) d->selanchor = d->curright;
 	else if (!isselect) d->selanchor = NULL;
+	dbeforemove(d);
 	if (pos <= d->curleft) {
 		memmove(d->curright - (d->curleft - pos), pos, d->curleft - pos);
 	} else if (pos >= d->curright) {
 		memmove(d->curleft, d->curright, pos - d->curright);
 	}
 	dupdateonnavigate(d, pos);
+	daftermove(d, false);
 	d->coldirty = true; /* it's the caller's responsibility to correct this if moving vertically */
 }
 
 void
 ddeleterange(Document *d, char *left, char *right)
 {
+	dbeforemove(d);
 	if (left <= d->curleft && d->curright <= right) {
 		/* nothing needs to be done in here */
 	} else if (right <= d->curleft) {
@@ -522,6 +1020,25 @@ ddeleterange(Document *d, char *left, char *right)
 	}
 	dupdateondelete(d, left, right);
 	d->coldirty = true;
+	d->version++;
+	daftermove(d, true);
+}
+
+/* Where the index u ends up after a batch of edits, for indexes given in increasing order. Like a
+   cursor it goes after text inserted where it is, and to the end of the text replacing what it was in. */
+size_t
+dmapnext(BatchMap *m, size_t u)
+{
+	size_t sp = 0, sl, dl = 0;
+	for (; m->j < m->n; m->j++) {
+		sp = m->reverse ? m->e[m->j].position - m->shift : m->e[m->j].position;
+		sl = m->reverse ? m->e[m->j].newlen : m->e[m->j].len;
+		dl = m->reverse ? m->e[m->j].len : m->e[m->j].newlen;
+		if (u < sp + sl) break;
+		m->shift += (ptrdiff_t)dl - (ptrdiff_t)sl;
+	}
+	if (m->j < m->n && u > sp) return sp + m->shift + dl;
+	return u + m->shift;
 }
 
 const char *
@@ -538,34 +1055,42 @@ dnextrenderline(Document *d, const char *pos, int colc)
 	return pos;
 }
 
-const char *
-dwalkrenderline(Document *d, const char *pos, int colc, int step)
-{
-	while (step < 0 && POSCMP(d, d->bufstart, pos) < 0) {
-		const char *p = dwalkrow(d, pos, -1);
-		const char *prev = p;
-		/* can be null if the file doesn't end with a newline char */
-		while (p && POSCMP(d, p, pos) < 0) {
-			p = dnextrenderline(d, p, colc);
-			step++;
-		}
-		pos = prev;
+/* Walk the rows of the indexed line wrapped to colc from the last row checkpoint before the offset to
+   or the row torow, to the start of the row to is on or of row torow, whichever comes first, adding
+   checkpoints along new ground on the way. The row's number is put in *row. */
+size_t
+cirow(ColIndex *x, Document *d, size_t to, size_t torow, int colc, size_t *row)
+{
+	size_t lo = 0, hi = x->nr, mid, off, next;
+	const char *p, *q, *t;
+	if (x->rowcolc != colc) {
+		x->rowcolc = colc;
+		x->nr = 1;
+		hi = 1;
 	}
-	for (int i = 0; i < step && pos; i++)
-		pos = dnextrenderline(d, pos, colc);
-	return pos;
-}
-
-void
-dscroll(Document *d, int colc, int rowc)
-{
-	d->renderstart = dwalkrow(d, d->renderstart, 0);
-	const char *renderend = dwalkrenderline(d, d->renderstart, colc, rowc);
-	if (POSCMP(d, d->curleft, d->renderstart) < 0 ||
-			(renderend && POSCMP(d, d->curleft, renderend) >= 0)) {
-		d->renderstart = (char *)dwalkrenderline(
-			d, d->curleft, colc, -rowc/2);
+	while (hi - lo > 1) {
+		mid = lo + (hi - lo) / 2;
+		if (x->r[mid].off <= to && x->r[mid].row <= torow) lo = mid;
+		else hi = mid;
+	}
+	off = x->r[lo].off;
+	*row = x->r[lo].row;
+	p = dindextopointer(d, x->start + off);
+	while (*row < torow) {
+		/* the last row of the line ends with its '\n' or runs into the end of the document */
+		if (!(q = dnextrenderline(d, p, colc))) break;
+		next = off + POSCMP(d, q, p);
+		if (next > to || dreadchar(d, q, &t, -1) == '\n') break;
+		off = next;
+		(*row)++;
+		p = q;
+		if (off >= x->r[x->nr-1].off + COL_STEP) {
+			x->r = grow(x->r, &x->rcap, x->nr + 1, sizeof(*x->r));
+			x->r[x->nr++] = (RowMark){ off, *row };
+		}
 	}
+	x->known = MAX(x->known, off);
+	return off;
 }
 
 /* content must appear at end of buffer */
@@ -578,7 +1103,11 @@ dinit(Document *d, char *buf, size_t buflen, size_t contentlen)
 	d->curright = (buf + buflen) - contentlen;
 	d->renderstart = buf;
 	d->selanchor = NULL;
+	d->scrollcol = 0;
 	d->coldirty = true;
+	d->version = 0;
+	d->beforemove = NULL;
+	d->aftermove = NULL;
 	if (!usinit(&d->us)) return false;
 	usadd(&d->us, &d->bufstart, LEFTONINSERT | LEFTONDELETE);
 	usadd(&d->us, &d->bufend, RIGHTONINSERT | RIGHTONDELETE);
@@ -623,32 +1152,16 @@ dreinit(Document *old, char *buf, size_t buflen, size_t contentlen)
 	if (!dinit(&new, buf, buflen, contentlen)) {
 		return false;
 	}
+	new.version = old->version + 1;
+	new.beforemove = old->beforemove;
+	new.aftermove = old->aftermove;
+	dbeforemove(old);
 	dfree(old);
 	dmove(old, &new);
+	daftermove(old, true);
 	return true;
 }
 
-/* index means index to character in the document. Ie. excluding the gap. */
-char *
-dindextopointer(const Document *d, size_t index)
-{
-	char *p = index <= (size_t)(d->curleft - d->bufstart) ?
-		d->bufstart + index :
-		d->bufstart + (index + (d->curright - d->curleft));
-	assert_valid_pos(d, p);
-	return p;
-}
-
-size_t
-dpointertoindex(const Document *d, const char *p)
-{
-	assert_valid_pos(d, p);
-	size_t index = p <= d->curleft ?
-		p - d->bufstart :
-		(p - d->bufstart) - (d->curright - d->curleft);
-	return index;
-}
-
 size_t
 dgetrangelength(const Document *d, const char *left, const char *right)
 {
@@ -683,114 +1196,729 @@ drangeeq(const Document *d, const char *left, const char *right, const char *str
 	return r;
 }
 
-Action
-actionreverse(Action a)
+/* Find the occurrence of the needle nearest to from (in direction dir) that lies entirely between
+   from and limit, and return a pointer to its first byte. Each side of the gap is searched in place.
+   Only matches that straddle the gap need copying, and then only nlen-1 bytes from each side. */
+char *
+dfind(const Document *d, const char *from, const char *limit, const char *n, size_t nlen, int dir)
 {
-	size_t curbefore = a.curafter;
-	a.curafter = a.curbefore;
-	a.curbefore = curbefore;
-	switch(a.type) {
-	case INSERT:
-		a.type = DELETE;
-		break;
-	case DELETE:
-		a.type = INSERT;
-		break;
-	default: fail();
+	assert_valid_pos(d, from);
+	assert_valid_pos(d, limit);
+	assert2(dir == SIGN(dir), dir != 0);
+	const char *m = NULL, *wl, *wr, *left, *right;
+	char *window;
+	left = dir > 0 ? from : limit;
+	right = dir > 0 ? limit : from;
+	/* positions at the gap can be given as either edge; use the one that keeps left <= right */
+	if (left == d->curleft) left = d->curright;
+	if (right == d->curright) right = d->curleft;
+	if (nlen == 0 || POSCMP(d, right, left) < (ptrdiff_t)nlen) return NULL;
+	if (left >= d->curright || right <= d->curleft) {
+		m = dir > 0 ? memfind(left, right - left, n, nlen) : memrfind(left, right - left, n, nlen);
+		return (char *)m;
 	}
-	return a;
-}
-
-void
-actiondo(Action a, Document *d)
-{
-	switch (a.type) {
-	case DELETE: {
-		char *left = dindextopointer(d, a.position);
-		char *right = dindextopointer(d, a.position + a.size);
-		assert(drangeeq(d, left, right, a.data, a.size));
-		ddeleterange(d, left, right);
-	} break;
-	case INSERT: {
-		char *pos = dindextopointer(d, a.position);
-		dinsert(d, pos, a.data, a.size);
-	} break;
-	default: fail();
+	/* left is before the gap and right after it */
+	if (dir > 0 && (m = memfind(left, d->curleft - left, n, nlen)))
+		return (char *)m;
+	if (dir < 0 && (m = memrfind(d->curright, right - d->curright, n, nlen)))
+		return (char *)m;
+	if (nlen > 1) {
+		wl = MAX(left, d->curleft - (nlen-1));
+		wr = MIN(right, d->curright + (nlen-1));
+		window = umalloc((d->curleft - wl) + (wr - d->curright));
+		memcpy(window, wl, d->curleft - wl);
+		memcpy(window + (d->curleft - wl), d->curright, wr - d->curright);
+		m = (dir > 0 ? memfind : memrfind)(window, (d->curleft - wl) + (wr - d->curright), n, nlen);
+		/* a match contained in either half would have been found by the searches either side */
+		if (m) m = wl + (m - window);
+		free(window);
+		if (m) return (char *)m;
 	}
+	if (dir > 0)
+		m = memfind(d->curright, right - d->curright, n, nlen);
+	else
+		m = memrfind(left, d->curleft - left, n, nlen);
+	return (char *)m;
 }
 
-void
-hrecord(History *h, Action a)
-{
-	h->a = grow(h->a, &h->max, h->cur+1, sizeof(*h->a));
-	h->a[h->cur] = a;
-	h->cur++;
-	h->count = h->cur;
+/* Carries on a search for a regular expression started at from from at, giving up after about budget
+   bytes. See refindfrom(). */
+int
+dfindrefrom(const Document *d, Regex *re, const char *from, const char *at, const char *limit, int dir,
+	size_t budget, char **start, char **end)
+{
+	assert_valid_pos(d, from);
+	assert_valid_pos(d, at);
+	assert_valid_pos(d, limit);
+	ReText t = { { d->bufstart, d->curright }, { d->curleft, d->bufend } };
+	const char *s, *e;
+	int r = refindfrom(re, &t, from, at, limit, dir, budget, &s, &e);
+	*start = (char *)s;
+	if (r > 0) *end = (char *)e;
+	return r;
 }
 
-Action
-hundo(History *h, Document *d)
+/* Same as dfind() but for a regular expression. The end of the match is returned through end. */
+char *
+dfindre(const Document *d, Regex *re, const char *from, const char *limit, int dir, char **end)
 {
-	Action a = { .type = NOP };
-	if (h->cur > 0) {
-		h->cur--;
-		a = actionreverse(h->a[h->cur]);
-		actiondo(a, d);
-	}
-	return a;
+	char *s;
+	return dfindrefrom(d, re, from, from, limit, dir, SIZE_MAX, &s, end) > 0 ? s : NULL;
 }
 
-Action
-hredo(History *h, Document *d)
+typedef struct {
+	size_t index;           /* SIZE_MAX for NULL */
+	UpdateSetEntry *entry;
+} BatchMark;
+
+int
+batchmarkcmp(const void *a, const void *b)
 {
-	Action a = { .type = NOP };
-	if (h->cur < h->count) {
-		a = h->a[h->cur];
-		actiondo(a, d);
-		h->cur++;
-	}
-	return a;
+	const BatchMark *x = a, *y = b;
+	if (x->index != y->index) return x->index < y->index ? -1 : 1;
+	/* marks that stay left of an insertion must be mapped before those that go right of it */
+	return (x->entry->behaviour & RIGHTONINSERT) - (y->entry->behaviour & RIGHTONINSERT);
 }
 
 void
-hinit(History *h, size_t capacity)
+dbatchput(char *buf, size_t split, size_t gap, size_t *o, const char *s, size_t n)
 {
-	h->a = umalloc(capacity * sizeof(Action));
-	h->max = capacity;
-	h->count = 0;
-	h->cur = 0;
+	size_t k = *o < split ? MIN(n, split - *o) : 0;
+	memcpy(buf + *o, s, k);
+	if (n > k) memcpy(buf + gap + *o + k, s + k, n - k);
+	*o += n;
 }
 
 void
-hfree(/* move */ History *h)
+dbatchcopy(const Document *d, char *buf, size_t split, size_t gap, size_t *o, size_t src, size_t n)
 {
-	free(h->a);
-	h->a = 0;
-	h->count = 0;
-	h->max = 0;
-	h->cur = 0;
+	size_t left = d->curleft - d->bufstart, k = src < left ? MIN(n, left - src) : 0;
+	dbatchput(buf, split, gap, o, d->bufstart + src, k);
+	if (n > k) dbatchput(buf, split, gap, o, d->curright + (src + k - left), n - k);
 }
 
+/* Apply a batch of edits in one pass. Edits are sorted, don't overlap and give positions in the
+   document as it was before the batch. Rather than moving the gap to each edit in turn, the result is
+   copied straight into a new buffer with the gap where the cursor ends up, so every byte is moved
+   once however many edits there are, and the update set is fixed up in one walk over the edits.
+   Applying the same batch reversed undoes it. */
 void
-edeleterange(char *left, char *right)
+dapplybatch(Document *d, const Edit *e, size_t n, const char *data, bool reverse)
+{
+	size_t oldlen = dgetrangelength(d, d->bufstart, d->bufend), newlen = oldlen;
+	size_t i, j, u, sp, sl, dl, src, o, off, split = 0, gap, size;
+	ptrdiff_t shift;
+	BatchMark *marks = umalloc(d->us.count * sizeof(BatchMark));
+	UpdateSetEntryBehaviour b;
+	char *buf;
+	for (i = 0; i < n; i++)
+		newlen = reverse ? newlen + e[i].len - e[i].newlen : newlen + e[i].newlen - e[i].len;
+
+	/* map every pointer to its index after the batch, shift is how far the edits so far moved things */
+	for (i = 0; i < d->us.count; i++) {
+		marks[i].entry = &d->us.array[i];
+		u = (size_t)*d->us.array[i].ptr;
+		marks[i].index = u ? dpointertoindex(d, (char *)u) : SIZE_MAX;
+	}
+	qsort(marks, d->us.count, sizeof(BatchMark), batchmarkcmp);
+	for (i = j = 0, shift = 0; i < d->us.count && marks[i].index != SIZE_MAX; i++) {
+		u = marks[i].index;
+		b = marks[i].entry->behaviour;
+		for (; j < n; j++) {
+			sp = reverse ? e[j].position - shift : e[j].position;
+			sl = reverse ? e[j].newlen : e[j].len;
+			if (u < sp + sl || (u == sp && !(sl == 0 && (b & RIGHTONINSERT)))) break;
+			shift += reverse ? (ptrdiff_t)e[j].len - (ptrdiff_t)e[j].newlen : (ptrdiff_t)e[j].newlen - (ptrdiff_t)e[j].len;
+		}
+		if (j < n && u > (sp = reverse ? e[j].position - shift : e[j].position)) {
+			/* inside text that's being replaced */
+			dl = reverse ? e[j].len : e[j].newlen;
+			marks[i].index = (b & NULLONDELETE) ? SIZE_MAX : (b & RIGHTONDELETE) ? sp + shift + dl : sp + shift;
+		} else {
+			marks[i].index = u + shift;
+		}
+		if (marks[i].entry->ptr == &d->curleft) split = marks[i].index;
+	}
+
+	gap = MAX((size_t)(d->curright - d->curleft), (size_t)UTF_SIZ);
+	size = newlen + gap;
+	buf = umalloc(size);
+	for (i = o = src = off = 0, shift = 0; i < n; i++) {
+		sp = reverse ? e[i].position - shift : e[i].position;
+		sl = reverse ? e[i].newlen : e[i].len;
+		dl = reverse ? e[i].len : e[i].newlen;
+		dbatchcopy(d, buf, split, gap, &o, src, sp - src);
+		dbatchput(buf, split, gap, &o, data + off + (reverse ? 0 : e[i].len), dl);
+		src = sp + sl;
+		off += e[i].len + e[i].newlen;
+		shift += (ptrdiff_t)dl - (ptrdiff_t)sl;
+	}
+	dbatchcopy(d, buf, split, gap, &o, src, oldlen - src);
+	assert(o == newlen);
+
+	for (i = 0; i < d->us.count; i++) {
+		char **p = marks[i].entry->ptr;
+		u = marks[i].index;
+		marks[i].entry->newval =
+			p == &d->bufstart ? buf :
+			p == &d->bufend ? buf + size :
+			p == &d->curleft ? buf + split :
+			p == &d->curright ? buf + split + gap :
+			u == SIZE_MAX ? NULL :
+			u <= split ? buf + u : buf + gap + u;
+	}
+	dbeforemove(d);
+	free(d->bufstart);
+	usflip(&d->us);
+	free(marks);
+	d->coldirty = true;
+	d->version++;
+	daftermove(d, true);
+}
+
+/* the first line in the wrap cache starting at or after start */
+size_t
+wcfind(const WrapCache *w, size_t start)
 {
-	Action a = {
-		.type = DELETE,
-		.position = dpointertoindex(&doc, left),
-		.size = dgetrangelength(&doc, left, right),
-		.curbefore = dpointertoindex(&doc, doc.curleft),
-	};
-	a.data = malloc(a.size);
-	dgetrange(&doc, left, right, a.data);
-	hrecord(&history, a);
-	actiondo(a, &doc);
-	a.curafter = dpointertoindex(&doc, doc.curleft);
+	size_t lo = 0, hi = w->n, mid;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (w->l[mid].start < start) lo = mid + 1;
+		else hi = mid;
+	}
+	return lo;
 }
 
+/* Drop the lines touched by a batch of edits and move the ones after them, for the edits given in the
+   same way as to dmapnext(). An edit at either end of a line counts as touching it. */
+void
+wcedit(WrapCache *w, const Edit *e, size_t n, bool reverse)
+{
+	size_t i, j = 0, k = 0, sp = 0, sl = 0, dl;
+	ptrdiff_t shift = 0;
+	for (i = 0; i < w->n; i++) {
+		for (; j < n; j++) {
+			sp = reverse ? e[j].position - shift : e[j].position;
+			sl = reverse ? e[j].newlen : e[j].len;
+			dl = reverse ? e[j].len : e[j].newlen;
+			if (sp + sl >= w->l[i].start) break;
+			shift += (ptrdiff_t)dl - (ptrdiff_t)sl;
+		}
+		if (j < n && sp <= w->l[i].start + w->l[i].len) continue;
+		w->l[k] = w->l[i];
+		w->l[k++].start += shift;
+	}
+	w->n = k;
+}
+
+/* how many rows the line starting at linestart takes, which is worked out and kept if it isn't known */
+size_t
+wcrows(WrapCache *w, Document *d, const char *linestart, int colc)
+{
+	size_t start = dpointertoindex(d, linestart), i, rows = 0;
+	const char *p = linestart, *next;
+	if (w->colc != colc || w->version != d->version || w->n == WRAP_CACHE) {
+		w->n = 0;
+		w->colc = colc;
+		w->version = d->version;
+	}
+	i = wcfind(w, start);
+	if (i < w->n && w->l[i].start == start) return w->l[i].rows;
+	next = dwalkrow(d, linestart, +1);
+	if (POSCMP(d, next, linestart) >= COL_LONG) {
+		/* the row checkpoints of a long line are wanted for scrolling back into it */
+		cirow(ciline(&cols, d, start), d, POSCMP(d, next, linestart) - 1, SIZE_MAX, colc, &rows);
+		rows++;
+	} else {
+		while (p && POSCMP(d, p, next) < 0) {
+			p = dnextrenderline(d, p, colc);
+			rows++;
+		}
+	}
+	w->l = grow(w->l, &w->cap, w->n + 1, sizeof(*w->l));
+	memmove(&w->l[i+1], &w->l[i], (w->n - i) * sizeof(*w->l));
+	w->l[i] = (WrapLine){ start, POSCMP(d, next, linestart), rows };
+	w->n++;
+	return rows;
+}
+
+/* The start of the row pos is on when lines are wrapped to colc, and the row's number in its line. A
+   long line is walked from its row checkpoint before pos instead of from its start. */
+const char *
+drowstart(Document *d, const char *pos, int colc, size_t *row)
+{
+	const char *p = dwalkrow(d, pos, 0), *q;
+	size_t start = dpointertoindex(d, p), i = dpointertoindex(d, pos);
+	if (i - start >= COL_LONG)
+		return dindextopointer(d, start + cirow(ciline(&cols, d, start), d, i - start, SIZE_MAX, colc, row));
+	for (*row = 0; ; (*row)++) {
+		q = dnextrenderline(d, p, colc);
+		if (!q || POSCMP(d, q, pos) > 0) return p;
+		p = q;
+	}
+}
+
+/* the start of row n of the line starting at linestart when it's wrapped to colc */
+const char *
+drowat(Document *d, const char *linestart, int colc, size_t n)
+{
+	size_t start = dpointertoindex(d, linestart), row;
+	ColIndex *x = cifind(&cols, d, start);
+	const char *p = linestart;
+	if (!x || x->start != start) {
+		for (row = 0; row < n && p && POSCMP(d, p, linestart) < COL_LONG; row++)
+			p = dnextrenderline(d, p, colc);
+		if (row == n || !p) return p;
+		x = ciline(&cols, d, start);
+	}
+	return dindextopointer(d, start + cirow(x, d, SIZE_MAX, n, colc, &row));
+}
+
+/* The start of the row step rows on from pos, NULL past the end of the document. Going back, the
+   rows are counted from the start of the row pos is on, or from pos if it's in the middle of one. */
+const char *
+dwalkrenderline(Document *d, const char *pos, int colc, int step)
+{
+	const char *start, *prev;
+	size_t row, rows;
+	if (step < 0) {
+		start = drowstart(d, pos, colc, &row);
+		if (POSCMP(d, start, pos) < 0) row++;
+		if (row >= (size_t)-step) return drowat(d, dwalkrow(d, start, 0), colc, row + step);
+		step += row;
+		start = dwalkrow(d, start, 0);
+		/* the lines before, whose row counts are usually known already */
+		while (POSCMP(d, d->bufstart, start) < 0) {
+			prev = dwalkrow(d, start, -1);
+			rows = wcrows(&wraps, d, prev, colc);
+			if (rows >= (size_t)-step) return drowat(d, prev, colc, rows + step);
+			step += rows;
+			start = prev;
+		}
+		return start;
+	}
+	for (int i = 0; i < step && pos; i++)
+		pos = dnextrenderline(d, pos, colc);
+	return pos;
+}
+
+/* The start of the line after the one starting at linestart, NULL if it's the last line. Where a long
+   line ends is kept with its column checkpoints so it's only read through once. */
+char *
+dnextline(const Document *d, const char *linestart)
+{
+	size_t start = dpointertoindex(d, linestart), len = dgetrangelength(d, d->bufstart, d->bufend), end;
+	const char *q;
+	char *next;
+	ColIndex *x = cifind(&cols, d, start);
+	if (x && x->start == start && x->end != SIZE_MAX) {
+		end = start + x->end;
+		return end == len ? NULL : dindextopointer(d, end + 1);
+	}
+	next = dwalkrow(d, linestart, +1);
+	end = dpointertoindex(d, next);
+	if (end == len && (end == start || dreadchar(d, next, &q, -1) != '\n'))
+		next = NULL;
+	else
+		end--;
+	if (end - start >= COL_LONG) {
+		x = ciline(&cols, d, start);
+		x->end = x->known = end - start;
+	}
+	return next;
+}
+
+/* the start of the line n lines on from the one starting at pos, NULL past the end of the document */
+const char *
+dwalklines(const Document *d, const char *pos, int n)
+{
+	for (; n > 0 && pos; n--)
+		pos = dnextline(d, pos);
+	return pos;
+}
+
+/* Keep the cursor on screen. Without wrapping each row is a line and the view also scrolls sideways,
+   by half a screen at a time like it does up and down. */
+void
+dscroll(Document *d, int colc, int rowc, bool wrap)
+{
+	int col;
+	size_t row;
+	/* the view can start part way through a wrapped line, on one of its rows */
+	d->renderstart = wrap ?
+		(char *)drowstart(d, d->renderstart, colc, &row) :
+		dwalkrow(d, d->renderstart, 0);
+	const char *renderend = wrap ?
+		dwalkrenderline(d, d->renderstart, colc, rowc) :
+		dwalklines(d, d->renderstart, rowc);
+	if (POSCMP(d, d->curleft, d->renderstart) < 0 ||
+			(renderend && POSCMP(d, d->curleft, renderend) >= 0)) {
+		d->renderstart = wrap ?
+			(char *)dwalkrenderline(d, d->curleft, colc, -rowc/2) :
+			dwalkrow(d, d->curleft, -rowc/2);
+	}
+	if (wrap) {
+		d->scrollcol = 0;
+		return;
+	}
+	col = dgetcol(d, d->curleft);
+	if (col < d->scrollcol || col >= d->scrollcol + colc)
+		d->scrollcol = MAX(0, col - colc/2);
+}
+
+void
+miinit(MatchIndex *x, /* move */ Match *m, size_t n, size_t len, unsigned long version)
+{
+	x->m = m;
+	x->cap = x->left = x->right = n;
+	x->len = len;
+	x->version = version;
+	x->valid = true;
+}
+
+void
+mifree(MatchIndex *x)
+{
+	free(x->m);
+	x->m = NULL;
+	x->cap = x->left = x->right = 0;
+	x->valid = false;
+}
+
+size_t
+micount(const MatchIndex *x)
+{
+	return x->left + (x->cap - x->right);
+}
+
+Match
+miget(const MatchIndex *x, size_t i)
+{
+	Match m;
+	if (i < x->left) return x->m[i];
+	m = x->m[x->right + (i - x->left)];
+	return (Match){ x->len - m.start, x->len - m.end };
+}
+
+/* the first match starting at or after pos */
+size_t
+mifind(const MatchIndex *x, size_t pos)
+{
+	size_t lo = 0, hi = micount(x), mid;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (miget(x, mid).start < pos) lo = mid + 1;
+		else hi = mid;
+	}
+	return lo;
+}
+
+/* move the gap so the matches before it are those starting before pos */
+void
+misplit(MatchIndex *x, size_t pos)
+{
+	Match m;
+	while (x->left > 0 && x->m[x->left-1].start >= pos) {
+		m = x->m[--x->left];
+		x->m[--x->right] = (Match){ x->len - m.start, x->len - m.end };
+	}
+	while (x->right < x->cap && x->len - x->m[x->right].start < pos) {
+		m = x->m[x->right++];
+		x->m[x->left++] = (Match){ x->len - m.start, x->len - m.end };
+	}
+}
+
+void
+mipush(MatchIndex *x, Match m)
+{
+	size_t after = x->cap - x->right, cap;
+	if (x->left == x->right) {
+		cap = 2 * x->cap + 64;
+		x->m = urealloc(x->m, cap * sizeof(Match));
+		memmove(x->m + cap - after, x->m + x->right, after * sizeof(Match));
+		x->right = cap - after;
+		x->cap = cap;
+	}
+	x->m[x->left++] = m;
+}
+
+/* Bring the matches of the literal n up to date after old bytes at p were replaced with new ones.
+   Matches that don't overlap the edit stay as they are, and those after it move with the end of
+   the document for free. Only the edit and len-1 bytes either side of it need searching again,
+   unless the needle overlaps itself, in which case the matches after the edit may shift along
+   until they line up with the old ones again. */
+void
+miedit(MatchIndex *x, const Document *d, size_t p, size_t old, size_t new, const char *n, size_t len)
+{
+	size_t lo = p > len - 1 ? p - (len - 1) : 0, at, limit, ms;
+	char *f;
+	misplit(x, lo);
+	/* drop the matches the edit touched */
+	while (x->right < x->cap && x->len - x->m[x->right].start < p + old) x->right++;
+	x->len = x->len - old + new;
+	at = MAX(x->left ? x->m[x->left-1].end : 0, lo);
+	/* anything new starts before the end of the edit, or overlaps one of the dropped matches */
+	limit = MIN(p + new + 2 * (len - 1), x->len);
+	for (;;) {
+		/* matches the new ones run into are dropped too, and what they overlapped could be a match now */
+		while (x->right < x->cap && x->len - x->m[x->right].start < at) {
+			limit = MIN(MAX(limit, x->len - x->m[x->right].end + len - 1), x->len);
+			x->right++;
+		}
+		if (at + len > limit || !(f = dfind(d, dindextopointer(d, at), dindextopointer(d, limit), n, len, +1)))
+			break;
+		ms = dpointertoindex(d, f);
+		/* lined up with the matches that were already there */
+		if (x->right < x->cap && x->len - x->m[x->right].start == ms) return;
+		mipush(x, (Match){ ms, ms + len });
+		at = ms + len;
+	}
+}
+
+Action
+actionreverse(Action a)
+{
+	size_t curbefore = a.curafter;
+	a.curafter = a.curbefore;
+	a.curbefore = curbefore;
+	switch(a.type) {
+	case INSERT:
+		a.type = DELETE;
+		break;
+	case DELETE:
+		a.type = INSERT;
+		break;
+	case BATCH:
+		a.type = UNBATCH;
+		break;
+	case UNBATCH:
+		a.type = BATCH;
+		break;
+	default: fail();
+	}
+	return a;
+}
+
+void
+actiondo(Action a, Document *d)
+{
+	switch (a.type) {
+	case DELETE: {
+		char *left = dindextopointer(d, a.position);
+		char *right = dindextopointer(d, a.position + a.size);
+		assert(drangeeq(d, left, right, a.data, a.size));
+		ddeleterange(d, left, right);
+	} break;
+	case INSERT: {
+		char *pos = dindextopointer(d, a.position);
+		dinsert(d, pos, a.data, a.size);
+	} break;
+	case BATCH:
+	case UNBATCH:
+		dapplybatch(d, a.edits, a.nedits, a.data, a.type == UNBATCH);
+		break;
+	default: fail();
+	}
+}
+
+void
+hrecord(History *h, Action a)
+{
+	h->a = grow(h->a, &h->max, h->cur+1, sizeof(*h->a));
+	h->a[h->cur] = a;
+	h->cur++;
+	h->count = h->cur;
+}
+
+Action
+hundo(History *h, Document *d)
+{
+	Action a = { .type = NOP };
+	if (h->cur > 0) {
+		h->cur--;
+		a = actionreverse(h->a[h->cur]);
+		actiondo(a, d);
+	}
+	return a;
+}
+
+Action
+hredo(History *h, Document *d)
+{
+	Action a = { .type = NOP };
+	if (h->cur < h->count) {
+		a = h->a[h->cur];
+		actiondo(a, d);
+		h->cur++;
+	}
+	return a;
+}
+
+void
+hinit(History *h, size_t capacity)
+{
+	h->a = umalloc(capacity * sizeof(Action));
+	h->max = capacity;
+	h->count = 0;
+	h->cur = 0;
+}
+
+void
+hfree(/* move */ History *h)
+{
+	free(h->a);
+	h->a = 0;
+	h->count = 0;
+	h->max = 0;
+	h->cur = 0;
+}
+
+bool
+eindexed(void)
+{
+	return matches.valid && matches.version == doc.version;
+}
+
+/* the start and end of the text selected by the cursor c, which are both c->pos if it hasn't a selection */
+size_t
+ecursorstart(const Cursor *c)
+{
+	return c->anchor == SIZE_MAX ? c->pos : MIN(c->anchor, c->pos);
+}
+
+size_t
+ecursorend(const Cursor *c)
+{
+	return c->anchor == SIZE_MAX ? c->pos : MAX(c->anchor, c->pos);
+}
+
+int
+ecursorcmp(const void *a, const void *b)
+{
+	size_t x = ecursorstart(a), y = ecursorstart(b);
+	if (x == y) x = ecursorend(a), y = ecursorend(b);
+	return (x > y) - (x < y);
+}
+
+/* Put the extra cursors back in order after they've moved, merging the ones that meet and dropping
+   the ones that meet the main cursor. */
+void
+ecursorsmerge(void)
+{
+	size_t i, n = 0, lo, hi, plo, phi;
+	size_t cur = dpointertoindex(&doc, doc.curleft);
+	size_t anchor = doc.selanchor ? dpointertoindex(&doc, doc.selanchor) : cur;
+	Cursor *c, *prev;
+	for (i = 1; i < ncursors && ecursorcmp(&cursors[i-1], &cursors[i]) <= 0; i++);
+	if (i < ncursors) qsort(cursors, ncursors, sizeof(Cursor), ecursorcmp);
+	plo = MIN(cur, anchor);
+	phi = MAX(cur, anchor);
+	for (i = 0; i < ncursors; i++) {
+		c = &cursors[i];
+		lo = ecursorstart(c);
+		hi = ecursorend(c);
+		if (c->pos == cur || (lo < phi && plo < hi) || (lo == hi && plo < lo && lo < phi))
+			continue;
+		cursors[n++] = *c;
+		/* merge the selections that overlap, or cursors in the same place, keeping the direction of the later one */
+		while (n > 1 && (ecursorstart(&cursors[n-1]) < ecursorend(&cursors[n-2]) ||
+				cursors[n-1].pos == cursors[n-2].pos)) {
+			c = &cursors[n-1];
+			prev = &cursors[n-2];
+			lo = MIN(ecursorstart(c), ecursorstart(prev));
+			hi = MAX(ecursorend(c), ecursorend(prev));
+			prev->anchor = c->anchor != SIZE_MAX && c->anchor > c->pos ? hi : lo;
+			prev->pos = prev->anchor == hi ? lo : hi;
+			if (prev->anchor == prev->pos) prev->anchor = SIZE_MAX;
+			n--;
+		}
+	}
+	ncursors = n;
+}
+
+/* whether the cursor c and its selection are drawn entirely before the index i */
+bool
+ecursorbefore(const Cursor *c, size_t i)
+{
+	return c->anchor == SIZE_MAX ? c->pos < i : ecursorend(c) <= i;
+}
+
+void
+ecursoradd(size_t anchor, size_t pos)
+{
+	size_t i;
+	cursors = grow(cursors, &cursorcap, ncursors + 1, sizeof(*cursors));
+	for (i = ncursors; i > 0 && ecursorstart(&cursors[i-1]) > MIN(anchor, pos); i--);
+	memmove(&cursors[i+1], &cursors[i], (ncursors - i) * sizeof(Cursor));
+	cursors[i] = (Cursor){ anchor == pos ? SIZE_MAX : anchor, pos, -1 };
+	ncursors++;
+}
+
+/* Do what the action a did to the text to the extra cursors, and keep the index of matches up to
+   date if it was up to date before. Regex matches can depend on text any distance away so those
+   are counted again instead. */
+void
+eafteraction(Action a, bool indexed)
+{
+	Edit e = { a.position, a.type == DELETE ? a.size : 0, a.type == INSERT ? a.size : 0 };
+	BatchMap m = { &e, 1, 0, 0, false }, am;
+	size_t i;
+	if (a.type == BATCH || a.type == UNBATCH)
+		m = (BatchMap){ a.edits, a.nedits, 0, 0, a.type == UNBATCH };
+	if (ncursors && a.type != NOP) {
+		am = m;
+		for (i = 0; i < ncursors; i++) {
+			cursors[i].pos = dmapnext(&m, cursors[i].pos);
+			cursors[i].col = -1;
+		}
+		/* the selections don't overlap so the anchors are in order too */
+		for (i = 0; i < ncursors; i++) {
+			if (cursors[i].anchor != SIZE_MAX)
+				cursors[i].anchor = dmapnext(&am, cursors[i].anchor);
+		}
+		ecursorsmerge();
+	}
+	/* every action moves the version on by one */
+	if (a.type != NOP && wraps.version + 1 == doc.version) {
+		wcedit(&wraps, m.e, m.n, m.reverse);
+		wraps.version = doc.version;
+	}
+	if (a.type != NOP && cols.version + 1 == doc.version) {
+		ciedit(&cols, m.e, m.n, m.reverse, a.data);
+		cols.version = doc.version;
+	}
+	if (!indexed || search.regex) return;
+	if (a.type == INSERT)
+		miedit(&matches, &doc, a.position, 0, a.size, search.needle, search.len);
+	else if (a.type == DELETE)
+		miedit(&matches, &doc, a.position, a.size, 0, search.needle, search.len);
+	else
+		return;
+	matches.version = doc.version;
+}
+
+void
+edeleterange(char *left, char *right)
+{
+	bool indexed = eindexed();
+	Action a = {
+		.type = DELETE,
+		.position = dpointertoindex(&doc, left),
+		.size = dgetrangelength(&doc, left, right),
+		.curbefore = dpointertoindex(&doc, doc.curleft),
+	};
+	a.data = malloc(a.size);
+	dgetrange(&doc, left, right, a.data);
+	hrecord(&history, a);
+	actiondo(a, &doc);
+	eafteraction(a, indexed);
+	a.curafter = dpointertoindex(&doc, doc.curleft);
+}
 
 void
 einsert(char *position, char *data, size_t length)
 {
+	bool indexed = eindexed();
 	Action a = {
 		.type = INSERT,
 		.position = dpointertoindex(&doc, position),
@@ -801,9 +1929,129 @@ einsert(char *position, char *data, size_t length)
 	memcpy(a.data, data, length);
 	hrecord(&history, a);
 	actiondo(a, &doc);
+	eafteraction(a, indexed);
 	a.curafter = dpointertoindex(&doc, doc.curleft);
 }
 
+/* Apply a sorted batch of edits as a single action, taking ownership of edits and data. The
+   cursor is left at the index cursor afterwards, or where the edits took it if that's SIZE_MAX. */
+void
+ebatch(Edit *edits, size_t n, char *data, size_t cursor)
+{
+	Action a = {
+		.type = BATCH,
+		.edits = edits,
+		.nedits = n,
+		.data = data,
+		.curbefore = dpointertoindex(&doc, doc.curleft),
+	};
+	actiondo(a, &doc);
+	if (cursor != SIZE_MAX) dnavigate(&doc, dindextopointer(&doc, cursor), false);
+	a.curafter = dpointertoindex(&doc, doc.curleft);
+	hrecord(&history, a);
+	eafteraction(a, false);
+}
+
+/* Replace the selection of every cursor, or if it hasn't got one the unit of text next to it in the
+   direction dir, with text. All the cursors are edited in one pass over the document, as one action,
+   and each is left after its own text. */
+void
+emultiedit(const char *text, size_t len, DeleteUnit unit, int dir)
+{
+	size_t n = ncursors + 1, i, j, k, ne = 0, datalen = 0, o = 0, cur = 0, l, r;
+	size_t *owner = umalloc(n * sizeof(size_t));
+	Edit *edits = umalloc(n * sizeof(Edit));
+	Cursor *c, primary;
+	char *data, *p;
+	ptrdiff_t shift = 0;
+	bool changes = len > 0;
+	cur = dpointertoindex(&doc, doc.curleft);
+	primary = (Cursor){ doc.selanchor ? dpointertoindex(&doc, doc.selanchor) : SIZE_MAX, cur, -1 };
+	/* the main cursor goes between the extra cursors either side of it */
+	for (k = 0; k < ncursors && cursors[k].pos < cur; k++);
+	for (i = 0; i < n; i++) {
+		c = i < k ? &cursors[i] : i == k ? &primary : &cursors[i-1];
+		p = dindextopointer(&doc, c->pos);
+		if (c->anchor != SIZE_MAX) {
+			l = ecursorstart(c);
+			r = ecursorend(c);
+		} else if (unit == DELNONE) {
+			l = r = c->pos;
+		} else if (unit == DELROW) {
+			l = dpointertoindex(&doc, dwalkrow(&doc, p, 0));
+			r = dpointertoindex(&doc, dwalkrow(&doc, p, +1));
+		} else {
+			p = unit == DELCHAR ? dwalkrune(&doc, p, dir) : dwalkword(&doc, p, dir);
+			l = dir < 0 ? dpointertoindex(&doc, p) : c->pos;
+			r = dir < 0 ? c->pos : dpointertoindex(&doc, p);
+		}
+		/* cursors whose text overlaps, or who are in the same place, share an edit */
+		if (ne && (l < edits[ne-1].position + edits[ne-1].len ||
+				(l == edits[ne-1].position && r == l))) {
+			edits[ne-1].len = MAX(edits[ne-1].position + edits[ne-1].len, r) - edits[ne-1].position;
+		} else {
+			edits[ne++] = (Edit){ l, r - l, len };
+		}
+		owner[i] = ne - 1;
+	}
+	for (j = 0; j < ne; j++) {
+		datalen += edits[j].len + len;
+		changes |= edits[j].len > 0;
+	}
+	if (!changes) goto done;
+	data = umalloc(datalen);
+	for (j = 0; j < ne; j++) {
+		dgetrange(&doc, dindextopointer(&doc, edits[j].position),
+			dindextopointer(&doc, edits[j].position + edits[j].len), data + o);
+		o += edits[j].len;
+		memcpy(data + o, text, len);
+		o += len;
+	}
+	/* where each cursor ends up, the edits before it have moved it by shift */
+	for (i = j = 0; i < n; i++) {
+		for (; j < owner[i]; j++)
+			shift += (ptrdiff_t)edits[j].newlen - (ptrdiff_t)edits[j].len;
+		c = i < k ? &cursors[i] : i == k ? &primary : &cursors[i-1];
+		c->pos = edits[j].position + shift + len;
+		c->anchor = SIZE_MAX;
+		c->col = -1;
+	}
+	/* the extra cursors' new positions are already worked out so ebatch doesn't move them */
+	n = ncursors;
+	ncursors = 0;
+	ebatch(edits, ne, data, primary.pos);
+	ncursors = n;
+	ecursorsmerge();
+	free(owner);
+	return;
+done:
+	free(owner);
+	free(edits);
+}
+
+/* Move every cursor by one unit in the direction of arg, selecting as they go if it asks to. */
+void
+enavigate(NavUnit unit, int arg)
+{
+	int col = doc.coldirty ? -1 : doc.col;
+	bool select = ISSELECT(arg);
+	Cursor *c;
+	char *pos;
+	for (c = cursors; c < cursors + ncursors; c++) {
+		pos = dnavtarget(&doc, dindextopointer(&doc, c->pos), unit, SIGN(arg), &c->col);
+		if (!select) c->anchor = SIZE_MAX;
+		else if (c->anchor == SIZE_MAX) c->anchor = c->pos;
+		c->pos = dpointertoindex(&doc, pos);
+		if (c->anchor == c->pos) c->anchor = SIZE_MAX;
+	}
+	pos = dnavtarget(&doc, doc.curleft, unit, SIGN(arg), &col);
+	dnavigate(&doc, pos, select);
+	if (col >= 0) {
+		doc.col = col;
+		doc.coldirty = false;
+	}
+	if (ncursors) ecursorsmerge();
+}
 
 void
 einsertchar(char *pos, Rune r)
@@ -842,157 +2090,1188 @@ egetline()
 }
 
 void
-ewrite(Rune r)
+eprompt(const char *label, void (*update)(void), void (*accept)(void), void (*cancel)(void))
+{
+	prompt.active = true;
+	message[0] = '\0';
+	prompt.label = label;
+	prompt.status = NULL;
+	prompt.len = 0;
+	prompt.text[0] = '\0';
+	prompt.update = update;
+	prompt.accept = accept;
+	prompt.cancel = cancel;
+}
+
+void
+epromptinsert(const char *str, size_t len)
+{
+	if (job.active) return;
+	prompt.text = grow(prompt.text, &prompt.cap, prompt.len + len + 1, 1);
+	for (size_t i = 0; i < len; i++) {
+		/* the prompt is a single line so drop anything that would break it */
+		if (str[i] != '\n' && str[i] != '\r')
+			prompt.text[prompt.len++] = str[i];
+	}
+	prompt.text[prompt.len] = '\0';
+	if (prompt.update) prompt.update();
+}
+
+bool
+eprompting(void)
+{
+	return prompt.active;
+}
+
+void
+emessage(const char *fmt, ...)
+{
+	va_list ap;
+	va_start(ap, fmt);
+	vsnprintf(message, sizeof(message), fmt, ap);
+	va_end(ap);
+}
+
+bool
+ebusy(void)
+{
+	return job.active && job.work;
+}
+
+void
+ework(void)
+{
+	if (job.active && job.work && !job.work())
+		job.active = false;
+}
+
+void
+ewrite(Rune r)
+{
+	char buf[UTF_SIZ];
+	if (prompt.active) {
+		epromptinsert(buf, utf8encode(r, buf));
+		return;
+	}
+	message[0] = '\0';
+	if (ncursors) {
+		emultiedit(buf, utf8encode(r, buf), DELNONE, 0);
+		return;
+	}
+	if (doc.selanchor) edeletesel(&doc);
+	einsertchar(doc.curleft, r);
+}
+
+void
+ewritestr(uchar *str, size_t size)
+{
+	if (prompt.active) {
+		epromptinsert((char *)str, size);
+		return;
+	}
+	message[0] = '\0';
+	if (ncursors) {
+		emultiedit((char *)str, size, DELNONE, 0);
+		return;
+	}
+	if (doc.selanchor) edeletesel(&doc);
+	einsert(doc.curleft, (char *)str, size);
+}
+
+void
+ejumptoline(long line)
+{
+	char *pos = dwalkrow(&doc, doc.bufstart, line-1);
+	dnavigate(&doc, pos, false);
+}
+
+void
+eupdatecursor(Action a)
+{
+	dnavigate(&doc, dindextopointer(&doc, a.curafter), false);
+}
+
+bool
+ewritefile(const char *path)
+{
+	size_t leftlen = doc.curleft - doc.bufstart;
+	size_t rightlen = doc.bufend - doc.curright;
+	size_t len = leftlen + rightlen;
+	char *buf = umalloc(len);
+	if (!buf) {
+		printsyserror("Could not write to file \"%s\", out of memory", path);
+		return false;
+	}
+	memcpy(buf, doc.bufstart, leftlen);
+	memcpy(buf+leftlen, doc.curright, rightlen);
+	FILE *file = fopen(path, "w");
+	if (!file) {
+		printsyserror("Could not open file \"%s\" for writing", path);
+		free(buf);
+		return false;
+	}
+	if (!fwrite(buf, 1, len, file)) {
+		printsyserror("Could open but not write to file \"%s\"", path);
+		free(buf);
+		fclose(file);
+		return false;
+	}
+	free(buf);
+	fclose(file);
+	return true;
+}
+
+bool
+ereadfromfile(const char *path)
+{
+	struct stat info;
+	if (fstatat(AT_FDCWD, path, &info, 0) == -1) {
+		printsyserror("Could not stat file \"%s\"", path);
+		return false;
+	}
+	if (!S_ISREG(info.st_mode)) {
+		fprintf(stderr, "File \"%s\" is not a regular file.\n", path);
+		return false;
+	}
+	FILE *file = fopen(path, "rw");
+	if (!file) {
+		printsyserror("Could not open file \"%s\" for read-write", path);
+		return false;
+	}
+	if (-1 == fseek(file, 0, SEEK_END)) {
+		printsyserror("Cannot seek file \"%s\"", path);
+		fclose(file);
+		return false;
+	}
+	size_t len = ftell(file);
+	if (!~len) {
+		printsyserror("Cannot get length of file \"%s\"", path);
+		fclose(file);
+		return false;
+	}
+	rewind(file);
+	size_t alloclen = len+UTF_SIZ;
+	char *buf = umalloc(alloclen);
+	if (!buf) {
+		printsyserror("Could not allocate new buffer to read file \"%s\"", path);
+		fclose(file);
+		return false;
+	}
+	if (len > fread(buf+(alloclen-len), 1, len, file)) {
+		printsyserror("Could open, and get length of the file but could not read file \"%s\"", path);
+		free(buf);
+		fclose(file);
+		return false;
+	}
+	fclose(file);
+	if (!dreinit(&doc, buf, alloclen, len)) {
+		fprintf(stderr, "Could open and read document but could not init the document\n");
+		free(buf);
+		return false;
+	}
+	ncursors = 0;
+	return true;
+}
+
+void
+eselect(size_t anchor, size_t cursor)
+{
+	dnavigate(&doc, dindextopointer(&doc, anchor), false);
+	if (cursor != anchor)
+		dnavigate(&doc, dindextopointer(&doc, cursor), true);
+}
+
+bool
+esearching(void)
+{
+	return search.regex ? search.re != NULL : search.len > 0;
+}
+
+/* Find the match nearest to from that lies between from and limit, as indexes. */
+bool
+ematch(size_t from, size_t limit, int dir, size_t *start, size_t *end)
+{
+	char *m, *e;
+	size_t i;
+	Match x;
+	if (eindexed() && dir > 0) {
+		if ((i = mifind(&matches, from)) == micount(&matches)) return false;
+		x = miget(&matches, i);
+		if (x.end > limit) return false;
+		*start = x.start;
+		*end = x.end;
+		return true;
+	}
+	if (eindexed() && !search.re) {
+		/* The index only has the occurrences a forward scan finds, not ones overlapping those,
+		   so the nearest one back may not be in it. It can't start before the last indexed one
+		   ending before from though, and if there isn't one there's none at all. Indexed matches
+		   don't overlap, so that is one of the last two starting before from. A regex match
+		   found going back can start before that one, so regexes are searched for directly. */
+		i = mifind(&matches, from + 1);
+		if (i > 0 && miget(&matches, i-1).end > from) i--;
+		if (i == 0) return false;
+		limit = MAX(limit, miget(&matches, i-1).start);
+	}
+	if (search.re)
+		m = dfindre(&doc, search.re, dindextopointer(&doc, from), dindextopointer(&doc, limit), dir, &e);
+	else
+		m = dfind(&doc, dindextopointer(&doc, from), dindextopointer(&doc, limit),
+			search.needle, search.len, dir);
+	if (!m) return false;
+	*start = dpointertoindex(&doc, m);
+	*end = search.re ? dpointertoindex(&doc, e) : *start + search.len;
+	return true;
+}
+
+/* Same as ematch() but forward only and carried on from at, giving up after about budget bytes.
+   Returns 1 for a match, 0 for none or -1 with *start set to the at to carry on from. */
+int
+ematchsome(size_t from, size_t at, size_t limit, size_t budget, size_t *start, size_t *end)
+{
+	char *m, *e;
+	int r;
+	if (eindexed())
+		return ematch(at, limit, +1, start, end);
+	if (search.re) {
+		r = dfindrefrom(&doc, search.re, dindextopointer(&doc, from), dindextopointer(&doc, at),
+			dindextopointer(&doc, limit), +1, budget, &m, &e);
+		if (r) *start = dpointertoindex(&doc, m);
+		if (r > 0) *end = dpointertoindex(&doc, e);
+		return r;
+	}
+	if (limit - at <= budget + search.len)
+		return ematch(at, limit, +1, start, end);
+	/* the window overlaps the next by len-1 bytes so matches across the boundary are found */
+	m = dfind(&doc, dindextopointer(&doc, at), dindextopointer(&doc, at + budget + search.len - 1),
+		search.needle, search.len, +1);
+	if (!m) {
+		*start = at + budget;
+		return -1;
+	}
+	*start = dpointertoindex(&doc, m);
+	*end = *start + search.len;
+	return 1;
+}
+
+/* Find the next match from the index in the direction dir, wrapping around the end of the document.
+   Returns the index of the start of the match or SIZE_MAX, the end is returned through end. */
+size_t
+efind(size_t from, int dir, size_t *end)
+{
+	size_t len = dgetrangelength(&doc, doc.bufstart, doc.bufend), start, wrap;
+	if (ematch(from, dir > 0 ? len : 0, dir, &start, end))
+		return start;
+	/* overlap the part already searched so matches straddling from are found, regex matches
+	   can be any length so that means searching the whole document again */
+	if (search.re) wrap = dir > 0 ? len : 0;
+	else if (dir > 0) wrap = MIN(from + search.len - 1, len);
+	else wrap = from > search.len - 1 ? from - (search.len - 1) : 0;
+	if (!ematch(dir > 0 ? 0 : len, wrap, dir, &start, end))
+		return SIZE_MAX;
+	prompt.status = "wrapped";
+	return start;
+}
+
+void
+ecountstop(void)
+{
+	countfree(count);
+	count = NULL;
+}
+
+/* counts the matches of the search on other threads, which read the document where it is */
+void
+ecountstart(void)
+{
+	ReText t = { { doc.bufstart, doc.curright }, { doc.curleft, doc.bufend } };
+	count = countstart(&t, dgetrangelength(&doc, doc.bufstart, doc.bufend), search.needle, search.len, search.regex);
+	countversion = doc.version;
+}
+
+/* the count has to stop reading the text while it's moved */
+void
+ebeforemove(void)
+{
+	if (count) countpause(count);
+}
+
+/* and can carry on afterwards unless the text was edited, in which case it's started again later */
+void
+eaftermove(bool edited)
+{
+	ReText t = { { doc.bufstart, doc.curright }, { doc.curleft, doc.bufend } };
+	if (edited) {
+		clock_gettime(CLOCK_MONOTONIC, &edittime);
+		ecountstop();
+	} else if (count) {
+		countresume(count, &t);
+	}
+}
+
+/* milliseconds until the count is started again, or -1 if it isn't waiting to be */
+double
+ecountwait(void)
+{
+	struct timespec now;
+	if (count || !search.highlight || !esearching() || eindexed()) return -1;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return MAX(0, COUNT_QUIET - TIMEDIFF(now, edittime));
+}
+
+void
+ecommandclose(int *fd)
+{
+	if (*fd >= 0) close(*fd);
+	*fd = -1;
+}
+
+void
+ecommandfinish(void)
+{
+	int status;
+	pid_t r;
+	Edit *e;
+	char *data;
+	size_t lo = command.lo, hi = command.hi;
+	/* its output is closed so it's most likely exited already, if not ecommandreap() looks again */
+	while ((r = waitpid(command.pid, &status, WNOHANG)) < 0 && errno == EINTR);
+	if (r == 0) {
+		prompt.status = "waiting for the command to exit";
+		return;
+	}
+	command.pid = 0;
+	prompt.active = false;
+	job.active = false;
+	if (r < 0) {
+		emessage("Could not wait for the command: %s", strerror(errno));
+		free(command.buf);
+		return;
+	}
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		if (WIFEXITED(status)) emessage("The command failed with status %d", WEXITSTATUS(status));
+		else emessage("The command was killed by signal %d", WTERMSIG(status));
+		free(command.buf);
+		return;
+	}
+	/* the old text is put in front of the output as the batch wants */
+	data = urealloc(command.buf, MAX((hi - lo) + command.len, command.cap));
+	memmove(data + (hi - lo), data, command.len);
+	dgetrange(&doc, dindextopointer(&doc, lo), dindextopointer(&doc, hi), data);
+	e = umalloc(sizeof(Edit));
+	*e = (Edit){ lo, hi - lo, command.len };
+	ebatch(e, 1, data, SIZE_MAX);
+	eselect(lo, lo + command.len);
+	emessage("Replaced %zu bytes with %zu", hi - lo, command.len);
+}
+
+/* Writes as much of the text as the command will take, straight from either side of the gap. */
+void
+ecommandwrite(void)
+{
+	char *p = dindextopointer(&doc, command.lo + command.sent);
+	size_t n = command.hi - command.lo - command.sent;
+	ssize_t r;
+	if (p == doc.curleft) p = doc.curright;
+	if (p < doc.curleft) n = MIN(n, (size_t)(doc.curleft - p));
+	if (n && (r = write(command.in, p, n)) > 0) command.sent += r;
+	else if (n && errno != EAGAIN && errno != EINTR) command.sent = command.hi - command.lo; /* EPIPE, it stopped reading */
+	if (command.sent == command.hi - command.lo) ecommandclose(&command.in);
+	snprintf(command.status, sizeof(command.status), "%zu of %zu bytes in, %zu out",
+		command.sent, command.hi - command.lo, command.len);
+	prompt.status = command.status;
+}
+
+void
+ecommandread(void)
+{
+	ssize_t r;
+	command.buf = grow(command.buf, &command.cap, command.len + 65536, 1);
+	r = read(command.out, command.buf + command.len, command.cap - command.len);
+	if (r > 0) command.len += r;
+	else if (r == 0 || (errno != EAGAIN && errno != EINTR)) ecommandclose(&command.out);
+	if (command.out < 0) {
+		/* it may not have read all its input */
+		ecommandclose(&command.in);
+		ecommandfinish();
+		return;
+	}
+	snprintf(command.status, sizeof(command.status), "%zu of %zu bytes in, %zu out",
+		command.sent, command.hi - command.lo, command.len);
+	prompt.status = command.status;
+}
+
+void
+ecommandcancel(void)
+{
+	Killed k = { command.pid, { 0 }, false };
+	/* the whole group, so every command in a pipeline goes */
+	kill(-command.pid, SIGTERM);
+	clock_gettime(CLOCK_MONOTONIC, &k.at);
+	command.killed = grow(command.killed, &command.killedcap, command.nkilled + 1, sizeof(Killed));
+	command.killed[command.nkilled++] = k;
+	command.pid = 0;
+	ecommandclose(&command.in);
+	ecommandclose(&command.out);
+	free(command.buf);
+	job.active = false;
+	emessage("Command cancelled");
+}
+
+/* Reaps the cancelled commands that have exited, killing what's left of them once they've had a
+   while, and finishes the running command if it's exited since it closed its output. */
+void
+ecommandreap(void)
+{
+	struct timespec now;
+	size_t i, j;
+	Killed k;
+	if (command.pid && command.out < 0) ecommandfinish();
+	if (!command.nkilled) return;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	for (i = j = 0; i < command.nkilled; i++) {
+		k = command.killed[i];
+		if (!k.exited) k.exited = waitpid(k.pid, NULL, WNOHANG) != 0;
+		if (TIMEDIFF(now, k.at) >= COMMAND_GRACE) {
+			/* anything still in the group ignored SIGTERM */
+			kill(-k.pid, SIGKILL);
+			if (k.exited) continue;
+		}
+		command.killed[j++] = k;
+	}
+	command.nkilled = j;
+}
+
+/* Milliseconds until the editor has something to do without any input, or -1 if it doesn't. */
+double
+ewait(void)
+{
+	double wait = ecountwait();
+	/* commands exiting are only noticed by looking */
+	if (command.nkilled || (command.pid && command.out < 0))
+		wait = wait < 0 ? COMMAND_POLL : MIN(wait, COMMAND_POLL);
+	return wait;
+}
+
+/* Starts the command in the prompt with the selection, or the whole document, as its input. It runs
+   while the editor carries on, and its output replaces the selection once it exits. */
+void
+ecommandstart(void)
+{
+	int in[2], out[2];
+	size_t i;
+	/* sh -c "" succeeds without any output, which would delete the text */
+	for (i = 0; i < prompt.len && isspace((uchar)prompt.text[i]); i++);
+	if (i == prompt.len) {
+		emessage("No command to run");
+		return;
+	}
+	command.lo = 0;
+	command.hi = dgetrangelength(&doc, doc.bufstart, doc.bufend);
+	if (doc.selanchor) {
+		command.lo = dpointertoindex(&doc, MIN(doc.selanchor, doc.curleft));
+		command.hi = dpointertoindex(&doc, MAX(doc.selanchor, doc.curleft));
+	}
+	if (pipe(in) < 0) {
+		printsyserror("Could not run the command");
+		return;
+	}
+	if (pipe(out) < 0) {
+		printsyserror("Could not run the command");
+		close(in[0]);
+		close(in[1]);
+		return;
+	}
+	switch ((command.pid = fork())) {
+	case -1:
+		printsyserror("Could not run the command");
+		close(in[0]); close(in[1]);
+		close(out[0]); close(out[1]);
+		return;
+	case 0:
+		/* in a process group of its own so cancelling can kill all of it */
+		setpgid(0, 0);
+		dup2(in[0], 0);
+		dup2(out[1], 1);
+		close(in[0]); close(in[1]);
+		close(out[0]); close(out[1]);
+		signal(SIGPIPE, SIG_DFL);
+		execl("/bin/sh", "sh", "-c", prompt.text, (char *)NULL);
+		_exit(127);
+	}
+	setpgid(command.pid, command.pid);
+	close(in[0]);
+	close(out[1]);
+	command.in = in[1];
+	command.out = out[0];
+	fcntl(command.in, F_SETFL, O_NONBLOCK);
+	fcntl(command.out, F_SETFL, O_NONBLOCK);
+	fcntl(command.in, F_SETFD, FD_CLOEXEC);
+	fcntl(command.out, F_SETFD, FD_CLOEXEC);
+	command.sent = command.len = 0;
+	command.cap = 65536;
+	command.buf = umalloc(command.cap);
+	/* the prompt stays open so keys don't edit the document, Escape cancels */
+	eprompt("Running: ", NULL, NULL, ecommandcancel);
+	prompt.status = "starting";
+	job.active = true;
+	job.work = NULL;
+	if (command.hi == command.lo) ecommandclose(&command.in);
+}
+
+/* Add the file descriptors the editor is waiting on to the sets and return the highest, or -1. */
+int
+efds(fd_set *rfd, fd_set *wfd)
+{
+	int fd = -1;
+	if (command.in >= 0) {
+		FD_SET(command.in, wfd);
+		fd = command.in;
+	}
+	if (command.out >= 0) {
+		FD_SET(command.out, rfd);
+		fd = MAX(fd, command.out);
+	}
+	ecommandreap();
+	/* edits stop the count, it's started again once there haven't been any for a while */
+	if (search.highlight && esearching()) {
+		if (ecountwait() == 0) ecountstart();
+	} else {
+		ecountstop();
+		mifree(&matches);
+	}
+	if (!count) return fd;
+	FD_SET(countfd(count), rfd);
+	return MAX(fd, countfd(count));
+}
+
+/* Deal with the file descriptors from efds() that are ready. */
+void
+eio(fd_set *rfd, fd_set *wfd)
+{
+	Match *m;
+	size_t n;
+	if (command.in >= 0 && FD_ISSET(command.in, wfd)) ecommandwrite();
+	if (command.out >= 0 && FD_ISSET(command.out, rfd)) ecommandread();
+	if (!count || !FD_ISSET(countfd(count), rfd)) return;
+	countupdate(count);
+	/* once they've all been found the matches are kept up to date from then on */
+	if (countversion == doc.version && countmatches(count, &m, &n)) {
+		mifree(&matches);
+		miinit(&matches, m, n, dgetrangelength(&doc, doc.bufstart, doc.bufend), doc.version);
+		ecountstop();
+	}
+}
+
+/* spread the matches over n rows by where they are in the document */
+void
+eoverview(size_t *rows, int n)
+{
+	size_t len, i, j = 0;
+	if (!eindexed()) {
+		countoverview(count, rows, n);
+		return;
+	}
+	len = dgetrangelength(&doc, doc.bufstart, doc.bufend);
+	for (int r = 0; r < n; r++) {
+		i = j;
+		j = mifind(&matches, (r + 1) * (len + 1) / n);
+		rows[r] = j - i;
+	}
+}
+
+/* "match i of n" for the selected match, or NULL if there's no count */
+const char *
+ecountstatus(void)
+{
+	static char buf[64];
+	size_t total, i = SIZE_MAX, ms, me, start, end;
+	bool done = true;
+	if (eindexed()) total = micount(&matches);
+	else if (count && countversion == doc.version) total = counttotal(count, &done);
+	else return NULL;
+	if (doc.selanchor) {
+		start = dpointertoindex(&doc, MIN(doc.selanchor, doc.curleft));
+		end = dpointertoindex(&doc, MAX(doc.selanchor, doc.curleft));
+		if (ematch(start, end, +1, &ms, &me) && ms == start && me == end)
+			i = eindexed() ? mifind(&matches, start) : countbefore(count, start);
+	}
+	if (i != SIZE_MAX)
+		snprintf(buf, sizeof(buf), "%zu of %zu%s", i + 1, total, done ? "" : "+");
+	else
+		snprintf(buf, sizeof(buf), "%zu%s match%s", total, done ? "" : "+", total == 1 && done ? "" : "es");
+	return buf;
+}
+
+void
+efindupdate(void)
+{
+	size_t m, end;
+	const char *err;
+	ecountstop();
+	mifree(&matches);
+	free(search.needle);
+	search.needle = ustrdup(prompt.text);
+	search.len = prompt.len;
+	refree(search.re);
+	search.re = NULL;
+	prompt.status = NULL;
+	if (search.regex && search.len && !(search.re = recompile(search.needle, search.len, &err)))
+		prompt.status = err;
+	search.highlight = esearching();
+	/* every keystroke searches again from where the prompt was opened */
+	if (search.originanchor != SIZE_MAX)
+		eselect(search.originanchor, search.origin);
+	else
+		eselect(search.origin, search.origin);
+	if (!esearching()) return;
+	m = efind(search.origin, search.dir, &end);
+	if (m == SIZE_MAX) prompt.status = "not found";
+	else eselect(m, end);
+}
+
+void
+efindcancel(void)
 {
-	if (doc.selanchor) edeletesel(&doc);
-	einsertchar(doc.curleft, r);
+	search.highlight = false;
+	if (search.originanchor != SIZE_MAX)
+		eselect(search.originanchor, search.origin);
+	else
+		eselect(search.origin, search.origin);
+}
+
+/* appends the replacement for the match [ms, me) to the edit data and returns its length */
+size_t
+ereplacement(size_t ms, size_t me)
+{
+	size_t i, start = replace.datalen;
+	if (!search.re) {
+		replace.data = grow(replace.data, &replace.datacap, replace.datalen + replace.withlen, 1);
+		memcpy(replace.data + replace.datalen, replace.with, replace.withlen);
+		replace.datalen += replace.withlen;
+		return replace.withlen;
+	}
+	for (i = 0; i < replace.withlen; i++) {
+		if (replace.with[i] == '\\' && i + 1 < replace.withlen && replace.with[i+1] == '0') {
+			replace.data = grow(replace.data, &replace.datacap, replace.datalen + (me - ms), 1);
+			dgetrange(&doc, dindextopointer(&doc, ms), dindextopointer(&doc, me), replace.data + replace.datalen);
+			replace.datalen += me - ms;
+			i++;
+			continue;
+		}
+		if (replace.with[i] == '\\' && i + 1 < replace.withlen && replace.with[i+1] == '\\')
+			i++;
+		replace.data = grow(replace.data, &replace.datacap, replace.datalen + 1, 1);
+		replace.data[replace.datalen++] = replace.with[i];
+	}
+	return replace.datalen - start;
 }
 
 void
-ewritestr(uchar *str, size_t size)
+ereplacefree(void)
 {
-	if (doc.selanchor) edeletesel(&doc);
-	einsert(doc.curleft, (char *)str, size);
+	free(replace.with);
+	free(replace.edits);
+	free(replace.data);
+	replace.with = NULL;
+	replace.edits = NULL;
+	replace.data = NULL;
+	replace.editcap = replace.datacap = 0;
 }
 
 void
-ejumptoline(long line)
-{
-	char *pos = dwalkrow(&doc, doc.bufstart, line-1);
-	dnavigate(&doc, pos, false);
+ereplacefinish(void)
+{
+	size_t n = replace.nedits;
+	prompt.active = false;
+	if (n) {
+		ebatch(replace.edits, n, replace.data, SIZE_MAX);
+		replace.edits = NULL;
+		replace.data = NULL;
+		replace.editcap = replace.datacap = 0;
+	}
+	ereplacefree();
+	emessage(n == 1 ? "Replaced 1 match" : "Replaced %zu matches", n);
+}
+
+/* Finds the next few matches, the edits are only applied once the whole document has been searched */
+bool
+ereplacework(void)
+{
+	size_t ms, me, n, first = replace.at;
+	int r;
+	for (n = 0; n < REPLACE_BATCH && replace.at - first < SEARCH_CHUNK; n++) {
+		r = ematchsome(replace.from, replace.at, replace.len, SEARCH_CHUNK, &ms, &me);
+		if (r < 0) {
+			replace.at = ms;
+			break;
+		}
+		if (r == 0) {
+			ereplacefinish();
+			return false;
+		}
+		replace.edits = grow(replace.edits, &replace.editcap, replace.nedits + 1, sizeof(Edit));
+		replace.data = grow(replace.data, &replace.datacap, replace.datalen + (me - ms), 1);
+		dgetrange(&doc, dindextopointer(&doc, ms), dindextopointer(&doc, me), replace.data + replace.datalen);
+		replace.datalen += me - ms;
+		replace.edits[replace.nedits++] = (Edit){ ms, me - ms, ereplacement(ms, me) };
+		if (me > ms) {
+			replace.from = replace.at = me;
+		} else if (me < replace.len) {
+			/* step over an empty match so it isn't found again */
+			replace.from = replace.at = dpointertoindex(&doc, dwalkrune(&doc, dindextopointer(&doc, me), +1));
+		} else {
+			ereplacefinish();
+			return false;
+		}
+	}
+	snprintf(replace.status, sizeof(replace.status), "%zu found", replace.nedits);
+	prompt.status = replace.status;
+	return true;
 }
 
 void
-eupdatecursor(Action a)
+ereplacecancel(void)
 {
-	dnavigate(&doc, dindextopointer(&doc, a.curafter), false);
+	job.active = false;
+	ereplacefree();
+	emessage(replace.filter ? "Filter cancelled" : "Replace cancelled");
 }
 
-bool
-ewritefile(const char *path)
+void
+ereplacestart(void)
+{
+	replace.with = umalloc(prompt.len + 1);
+	memcpy(replace.with, prompt.text, prompt.len + 1);
+	replace.withlen = prompt.len;
+	replace.filter = 0;
+	replace.from = replace.at = 0;
+	replace.len = dgetrangelength(&doc, doc.bufstart, doc.bufend);
+	replace.nedits = replace.datalen = 0;
+	replace.editcap = 64;
+	replace.edits = umalloc(replace.editcap * sizeof(Edit));
+	replace.datacap = 4096;
+	replace.data = umalloc(replace.datacap);
+	eprompt("Replacing", NULL, NULL, ereplacecancel);
+	job.active = true;
+	job.work = ereplacework;
+}
+
+/* Keep or delete the line [start, next) depending on whether it has a match. Deleted lines next to
+   each other are one edit. */
+void
+efilterline(size_t start, size_t next, bool match)
 {
-	size_t leftlen = doc.curleft - doc.bufstart;
-	size_t rightlen = doc.bufend - doc.curright;
-	size_t len = leftlen + rightlen;
-	char *buf = umalloc(len);
-	if (!buf) {
-		printsyserror("Could not write to file \"%s\", out of memory", path);
-		return false;
+	Edit *last = replace.nedits ? &replace.edits[replace.nedits-1] : NULL;
+	if (match == (replace.filter > 0)) {
+		replace.kept++;
+		return;
 	}
-	memcpy(buf, doc.bufstart, leftlen);
-	memcpy(buf+leftlen, doc.curright, rightlen);
-	FILE *file = fopen(path, "w");
-	if (!file) {
-		printsyserror("Could not open file \"%s\" for writing", path);
-		free(buf);
-		return false;
+	replace.removed++;
+	replace.data = grow(replace.data, &replace.datacap, replace.datalen + (next - start), 1);
+	dgetrange(&doc, dindextopointer(&doc, start), dindextopointer(&doc, next), replace.data + replace.datalen);
+	replace.datalen += next - start;
+	if (last && last->position + last->len == start) {
+		last->len += next - start;
+	} else {
+		replace.edits = grow(replace.edits, &replace.editcap, replace.nedits + 1, sizeof(Edit));
+		replace.edits[replace.nedits++] = (Edit){ start, next - start, 0 };
 	}
-	if (!fwrite(buf, 1, len, file)) {
-		printsyserror("Could open but not write to file \"%s\"", path);
-		free(buf);
-		fclose(file);
-		return false;
+}
+
+void
+efilterfinish(void)
+{
+	prompt.active = false;
+	if (replace.nedits) {
+		ebatch(replace.edits, replace.nedits, replace.data, SIZE_MAX);
+		replace.edits = NULL;
+		replace.data = NULL;
+		replace.editcap = replace.datacap = 0;
 	}
-	free(buf);
-	fclose(file);
-	return true;
+	ereplacefree();
+	emessage("Kept %zu line%s, deleted %zu", replace.kept, replace.kept == 1 ? "" : "s", replace.removed);
 }
 
+/* Finds the next few lines with a match, like replacing the edits are applied once they're all found */
 bool
-ereadfromfile(const char *path)
-{
-	struct stat info;
-	if (fstatat(AT_FDCWD, path, &info, 0) == -1) {
-		printsyserror("Could not stat file \"%s\"", path);
-		return false;
-	}
-	if (!S_ISREG(info.st_mode)) {
-		fprintf(stderr, "File \"%s\" is not a regular file.\n", path);
-		return false;
+efilterwork(void)
+{
+	size_t ms = 0, me, n, upto, first = replace.at;
+	int r;
+	for (n = 0; n < REPLACE_BATCH && replace.at - first < SEARCH_CHUNK; n++) {
+		r = replace.line < replace.len ?
+			ematchsome(replace.from, replace.at, replace.len, SEARCH_CHUNK, &ms, &me) : 0;
+		/* the lines that end before the match, or before where the search got to, have no match */
+		upto = r ? ms : replace.len;
+		while (replace.line < replace.len) {
+			if (!replace.next)
+				replace.next = dpointertoindex(&doc, dwalkrow(&doc, dindextopointer(&doc, replace.line), +1));
+			if (replace.next > upto) break;
+			efilterline(replace.line, replace.next, false);
+			replace.line = replace.next;
+			replace.next = 0;
+		}
+		if (r < 0) {
+			replace.at = ms;
+			break;
+		}
+		if (r == 0 || replace.line >= replace.len) {
+			efilterfinish();
+			return false;
+		}
+		/* the rest of the line with the match doesn't need searching */
+		efilterline(replace.line, replace.next, true);
+		replace.from = replace.at = replace.line = replace.next;
+		replace.next = 0;
 	}
-	FILE *file = fopen(path, "rw");
-	if (!file) {
-		printsyserror("Could not open file \"%s\" for read-write", path);
-		return false;
+	snprintf(replace.status, sizeof(replace.status), "%zu lines", replace.kept + replace.removed);
+	prompt.status = replace.status;
+	return true;
+}
+
+void
+efilterstart(int filter)
+{
+	replace.with = NULL;
+	replace.filter = filter;
+	replace.from = replace.at = replace.line = replace.next = 0;
+	replace.kept = replace.removed = 0;
+	replace.len = dgetrangelength(&doc, doc.bufstart, doc.bufend);
+	replace.nedits = replace.datalen = 0;
+	replace.editcap = 64;
+	replace.edits = umalloc(replace.editcap * sizeof(Edit));
+	replace.datacap = 4096;
+	replace.data = umalloc(replace.datacap);
+	eprompt(filter > 0 ? "Keeping lines" : "Deleting lines", NULL, NULL, ereplacecancel);
+	job.active = true;
+	job.work = efilterwork;
+}
+
+/* Select the whole lines the selection is on, or the whole document without one, and split them into
+   spans. The newline after the last line isn't selected so every span is followed by one but that. */
+Span *
+eselectlines(size_t *n)
+{
+	size_t l = 0, r = dgetrangelength(&doc, doc.bufstart, doc.bufend), lo, hi;
+	char *p, *end;
+	Span *s;
+	int col;
+	if (doc.selanchor) {
+		l = dpointertoindex(&doc, MIN(doc.selanchor, doc.curleft));
+		r = dpointertoindex(&doc, MAX(doc.selanchor, doc.curleft));
 	}
-	if (-1 == fseek(file, 0, SEEK_END)) {
-		printsyserror("Cannot seek file \"%s\"", path);
-		fclose(file);
-		return false;
+	lo = dpointertoindex(&doc, dwalkrow(&doc, dindextopointer(&doc, l), 0));
+	p = dindextopointer(&doc, r);
+	if (r > lo && 0 == POSCMP(&doc, p, dwalkrow(&doc, p, 0)))
+		hi = r - 1;
+	else
+		hi = dpointertoindex(&doc, dnavtarget(&doc, p, NAVLINE, +1, &col));
+	/* with the gap at the end the lines are all in one piece */
+	eselect(lo, hi);
+	p = doc.bufstart + lo;
+	end = doc.bufstart + hi;
+	for (*n = 1; (p = memchr(p, '\n', end - p)); p++) (*n)++;
+	s = umalloc(*n * sizeof(Span));
+	p = doc.bufstart + lo;
+	for (size_t i = 0; i < *n; i++) {
+		s[i].s = p;
+		s[i].len = i + 1 < *n ? (size_t)((char *)memchr(p, '\n', end - p) - p) : (size_t)(end - p);
+		p += s[i].len + 1;
 	}
-	size_t len = ftell(file);
-	if (!~len) {
-		printsyserror("Cannot get length of file \"%s\"", path);
-		fclose(file);
-		return false;
+	return s;
+}
+
+/* Replace the selected lines with the n lines s, in one pass and as one action, and select them. */
+void
+ereplacelines(Span *s, size_t n)
+{
+	/* the selection is empty if the document is */
+	size_t hi = dpointertoindex(&doc, doc.curleft), len = n - 1, o;
+	size_t lo = doc.selanchor ? dpointertoindex(&doc, doc.selanchor) : hi;
+	Edit *e;
+	char *data;
+	for (size_t i = 0; i < n; i++) len += s[i].len;
+	data = umalloc(hi - lo + len);
+	dgetrange(&doc, doc.bufstart + lo, doc.bufstart + hi, data);
+	o = hi - lo;
+	for (size_t i = 0; i < n; i++) {
+		memcpy(data + o, s[i].s, s[i].len);
+		o += s[i].len;
+		if (i + 1 < n) data[o++] = '\n';
 	}
-	rewind(file);
-	size_t alloclen = len+UTF_SIZ;
-	char *buf = umalloc(alloclen);
-	if (!buf) {
-		printsyserror("Could not allocate new buffer to read file \"%s\"", path);
-		fclose(file);
-		return false;
+	if (len == hi - lo && !memcmp(data, data + len, len)) {
+		free(data);
+		return;
 	}
-	if (len > fread(buf+(alloclen-len), 1, len, file)) {
-		printsyserror("Could open, and get length of the file but could not read file \"%s\"", path);
-		free(buf);
-		fclose(file);
-		return false;
+	e = umalloc(sizeof(Edit));
+	*e = (Edit){ lo, hi - lo, len };
+	o = lo + len;
+	ebatch(e, 1, data, o);
+	eselect(lo, o);
+}
+
+void
+esortaccept(void)
+{
+	int field = 0;
+	bool numeric = false;
+	size_t n, before;
+	Span *s;
+	for (size_t i = 0; i < prompt.len; i++) {
+		if (BETWEEN(prompt.text[i], '0', '9')) field = field * 10 + (prompt.text[i] - '0');
+		else if (prompt.text[i] == 'n') numeric = true;
+		else if (prompt.text[i] != ' ') {
+			emessage("Sort by a field number, and n to compare numbers");
+			return;
+		}
 	}
-	fclose(file);
-	if (!dreinit(&doc, buf, alloclen, len)) {
-		fprintf(stderr, "Could open and read document but could not init the document\n");
-		free(buf);
-		return false;
+	s = eselectlines(&n);
+	before = n;
+	sortspans(s, &n, field, numeric, sortunique);
+	ereplacelines(s, n);
+	free(s);
+	if (before > n) emessage("Sorted %zu lines, %zu repeated", before, before - n);
+	else emessage(n == 1 ? "Sorted 1 line" : "Sorted %zu lines", n);
+}
+
+int
+edrawstr(Grid *grid, int r, int colc, int c, const char *s, uchar style)
+{
+	size_t len = strlen(s), n;
+	Rune u;
+	while (len > 0 && c < colc) {
+		n = utf8decode(s, &u, len);
+		if (!n) break;
+		GRIDSET(grid, r, c, u, style);
+		c++;
+		s += n;
+		len -= n;
 	}
-	return true;
+	return c;
 }
 
 void
-edraw(Line *line, int colc, int rowc, int *curcol, int *currow)
-{
-	dscroll(&doc, colc, rowc);
-	const char *p = doc.renderstart;
+edraw(Grid *grid, int colc, int rowc, int *curcol, int *currow)
+{
+	/* the bottom row is taken by the prompt while it's open, or else by a message or the match count */
+	const char *countstatus = ecountstatus();
+	int docrows = (prompt.active || message[0] || countstatus) && rowc > 1 ? rowc - 1 : rowc;
+	/* the last column shows where the matches are while they're being counted */
+	int textc = (count || eindexed()) && colc > 1 ? colc - 1 : colc;
+	dscroll(&doc, textc, docrows, !nowrap);
+	const char *p = doc.renderstart, *renderend, *rowstart = NULL, *q;
+	const char *selleft = doc.selanchor && POSCMP(&doc, doc.selanchor, doc.curleft) < 0 ? doc.selanchor : doc.curleft;
+	const char *selright = doc.selanchor && POSCMP(&doc, doc.selanchor, doc.curleft) > 0 ? doc.selanchor : doc.curleft;
 	Glyph g;
+	uchar style, fg = tstyle(0, COLOR_FG, COLOR_BG), inverse = tstyle(0, COLOR_BG, COLOR_FG);
 	int r = 0, c = 0;
+	size_t overview[docrows];
 	bool insel = doc.selanchor && doc.selanchor < doc.renderstart;
-	for (r = 0; r < rowc; r++) {
-		memset(line[r], 0, colc * sizeof(Glyph));
+	bool highlight = search.highlight && esearching(), searching = highlight, inextra;
+	bool linestart = true;
+	size_t i = 0, doclen, limit = 0, next = 0, ms = SIZE_MAX, me = 0; /* [ms, me) is the next match to highlight */
+	size_t rowlimit = 0; /* matches are only looked for as far as the end of what the row shows */
+	size_t lo = 0, hi = ncursors, mid; /* the first extra cursor that's on screen */
+	memset(grid->u, 0, rowc * grid->stride * sizeof(Rune));
+	memset(grid->style, 0, rowc * grid->stride);
+	if (searching) {
+		/* only look for matches that are at least partly visible */
+		doclen = dgetrangelength(&doc, doc.bufstart, doc.bufend);
+		renderend = nowrap ?
+			dwalklines(&doc, doc.renderstart, docrows) :
+			dwalkrenderline(&doc, doc.renderstart, textc, docrows);
+		if (search.re) {
+			/* regex matches can be any length, those crossing lines off screen aren't shown */
+			next = dpointertoindex(&doc, dwalkrow(&doc, doc.renderstart, 0));
+			limit = renderend ? dpointertoindex(&doc, dwalkrow(&doc, renderend, +1)) : doclen;
+		} else {
+			limit = renderend ? MIN(dpointertoindex(&doc, renderend) + search.len - 1, doclen) : doclen;
+			next = dpointertoindex(&doc, doc.renderstart);
+			/* a match may start above the top row */
+			next = next > search.len - 1 ? next - (search.len - 1) : 0;
+		}
+		rowlimit = limit;
+	}
+	if (ncursors) {
+		i = dpointertoindex(&doc, doc.renderstart);
+		while (lo < hi) {
+			mid = lo + (hi - lo) / 2;
+			if (ecursorbefore(&cursors[mid], i)) lo = mid + 1;
+			else hi = mid;
+		}
 	}
 	r = 0;
-	while (r < rowc) {
+	while (r < docrows) {
+		if (nowrap && linestart) {
+			/* jump straight to the first column shown, the text left of it isn't read */
+			linestart = false;
+			rowstart = p;
+			p = dgetposnearcol(&doc, p, doc.scrollcol);
+			c = 0;
+			/* a tab straddling the left edge is drawn from the edge */
+			if (p != rowstart && dreadchar(&doc, p, &q, -1) == '\t' && dgetcol(&doc, p) > doc.scrollcol)
+				p = q;
+			insel = doc.selanchor && POSCMP(&doc, selleft, p) < 0 && POSCMP(&doc, p, selright) <= 0;
+			if (highlight) {
+				i = dpointertoindex(&doc, p);
+				next = MAX(next, search.re ? i : i > search.len - 1 ? i - (search.len - 1) : 0);
+				rowlimit = MIN(limit, i + textc * UTF_SIZ + (search.re ? 0 : search.len - 1));
+				searching = next <= rowlimit;
+			}
+		}
 		if (0 == POSCMP(&doc, p, doc.selanchor)) insel ^= 1;
 		if (0 == POSCMP(&doc, p, doc.curleft)) {
 			*currow = r;
 			*curcol = c;
 			if (doc.selanchor) insel ^= 1;
 		}
+		if (searching || ncursors) i = dpointertoindex(&doc, p);
+		if (searching && i >= next) {
+			if (!ematch(next, rowlimit, +1, &ms, &me))
+				ms = SIZE_MAX;
+			/* step over empty matches so they aren't found again */
+			next = me > ms ? me : me + 1;
+			searching = ms != SIZE_MAX && next <= rowlimit;
+		}
+		/* extra cursors are drawn like the selection, those without one as a block */
+		while (lo < ncursors && ecursorbefore(&cursors[lo], i)) lo++;
+		inextra = lo < ncursors && (cursors[lo].anchor == SIZE_MAX ?
+			cursors[lo].pos == i : ecursorstart(&cursors[lo]) <= i);
 		g.u = dreadchar(&doc, p, &p, +1);
-		g.fg = insel ? 0 : 1;
-		g.bg = insel ? 1 : 0;
+		g.fg = insel || inextra ? COLOR_BG : COLOR_FG;
+		g.bg = insel || inextra ? COLOR_FG : ms != SIZE_MAX && ms <= i && i < me ? COLOR_MATCH : COLOR_BG;
 		g.mode = 0;
 		if (g.u == RUNE_EOF) break;
+		style = tstyle(g.mode, g.fg, g.bg);
 		if (g.u == '\n') {
-			g.u = ' ';
-			line[r][c] = g;
+			GRIDSET(grid, r, c, ' ', style);
 			c = 0; r++;
+			linestart = true;
 		} else if (g.u == '\t') {
-			g.u = ' ';
 			do {
-				line[r][c] = g;
+				GRIDSET(grid, r, c, ' ', style);
 				c++;
-			} while (c < colc && (c & 7) != 0);
+			} while (c < textc && ((c + doc.scrollcol) & 7) != 0);
+		} else {
+			GRIDSET(grid, r, c, g.u, style);
+			c++;
+		}
+		if (c >= textc) {
+			c = 0;
+			r++;
+			if (r >= docrows) break;
+			/* the rest of the line is off the side of the screen */
+			if (nowrap) {
+				if (!(p = dnextline(&doc, rowstart))) break;
+				linestart = true;
+			}
+		}
+	}
+	if (textc < colc) {
+		eoverview(overview, docrows);
+		for (r = 0; r < docrows; r++)
+			GRIDSET(grid, r, textc, ' ', overview[r] ? tstyle(0, COLOR_FG, COLOR_MATCH) : fg);
+	}
+	if (docrows < rowc && !prompt.active) {
+		edrawstr(grid, docrows, colc, 0, message[0] ? message : countstatus, fg);
+	} else if (docrows < rowc) {
+		c = edrawstr(grid, docrows, colc, 0, prompt.label, inverse);
+		c = edrawstr(grid, docrows, colc, c, prompt.text, fg);
+		*currow = docrows;
+		*curcol = MIN(c, colc-1);
+		if (prompt.status) {
+			c = edrawstr(grid, docrows, colc, c, " [", fg);
+			c = edrawstr(grid, docrows, colc, c, prompt.status, fg);
+			c = edrawstr(grid, docrows, colc, c, "]", fg);
+		}
+		if (countstatus) {
+			c = edrawstr(grid, docrows, colc, c, " [", fg);
+			c = edrawstr(grid, docrows, colc, c, countstatus, fg);
+			edrawstr(grid, docrows, colc, c, "]", fg);
+		}
+	}
+	/* the selection, extra cursors, prompt and count all change with the cursor or on their own */
+	drawn.valid = !prompt.active && !doc.selanchor && !ncursors && !count;
+	drawn.version = doc.version;
+	drawn.top = dpointertoindex(&doc, doc.renderstart);
+	drawn.scrollcol = doc.scrollcol;
+	drawn.textc = textc;
+	drawn.docrows = docrows;
+	drawn.nowrap = nowrap;
+	drawn.highlight = highlight;
+	snprintf(drawn.status, sizeof(drawn.status), "%s", message[0] ? message : countstatus ? countstatus : "");
+}
+
+/* Where edraw() would put the cursor, walking the rows from the top left the same way it does.
+   Returns false if it's not on screen. */
+bool
+ecursorcell(int textc, int docrows, int *curcol, int *currow)
+{
+	const char *p = doc.renderstart, *rowstart = NULL, *q;
+	bool linestart = true;
+	int r = 0, c = 0;
+	Rune u;
+	while (r < docrows) {
+		if (nowrap && linestart) {
+			linestart = false;
+			rowstart = p;
+			p = dgetposnearcol(&doc, p, doc.scrollcol);
+			c = 0;
+			if (p != rowstart && dreadchar(&doc, p, &q, -1) == '\t' && dgetcol(&doc, p) > doc.scrollcol)
+				p = q;
+		}
+		if (0 == POSCMP(&doc, p, doc.curleft)) {
+			*currow = r;
+			*curcol = c;
+			return true;
+		}
+		u = dreadchar(&doc, p, &p, +1);
+		if (u == RUNE_EOF) break;
+		if (u == '\n') {
+			c = 0; r++;
+			linestart = true;
+		} else if (u == '\t') {
+			do c++;
+			while (c < textc && ((c + doc.scrollcol) & 7) != 0);
 		} else {
-			line[r][c] = g;
 			c++;
 		}
-		if (c >= colc) {
+		if (c >= textc) {
 			c = 0;
 			r++;
-			if (r >= rowc) break;
+			if (r >= docrows) break;
+			if (nowrap) {
+				if (!(p = dnextline(&doc, rowstart))) break;
+				linestart = true;
+			}
 		}
 	}
+	return false;
+}
+
+/* If nothing but the cursor has moved since the last edraw() this sets where it is now and returns
+   true, so the grid drawn then can be shown again without calling edraw(). */
+bool
+ecursoronly(int colc, int rowc, int *curcol, int *currow)
+{
+	const char *countstatus, *status;
+	int docrows, textc;
+	if (!drawn.valid || prompt.active || doc.selanchor || ncursors || count) return false;
+	if (drawn.version != doc.version || drawn.nowrap != nowrap ||
+			drawn.highlight != (search.highlight && esearching()))
+		return false;
+	countstatus = ecountstatus();
+	status = message[0] ? message : countstatus ? countstatus : "";
+	if (strcmp(status, drawn.status)) return false;
+	docrows = *status && rowc > 1 ? rowc - 1 : rowc;
+	textc = eindexed() && colc > 1 ? colc - 1 : colc;
+	if (docrows != drawn.docrows || textc != drawn.textc) return false;
+	/* the view follows the cursor, if it's had to move the whole grid has */
+	dscroll(&doc, textc, docrows, !nowrap);
+	if (dpointertoindex(&doc, doc.renderstart) != drawn.top || doc.scrollcol != drawn.scrollcol)
+		return false;
+	return ecursorcell(textc, docrows, curcol, currow);
 }
 
 void
@@ -1007,7 +3286,19 @@ einit()
 	if (!dinit(&doc, buf, 10, 0)) {
 		exit(1);
 	}
+	doc.beforemove = ebeforemove;
+	doc.aftermove = eaftermove;
 	hinit(&history, 16);
+	/* writing to a command that's exited fails with EPIPE instead */
+	signal(SIGPIPE, SIG_IGN);
+	command.in = command.out = -1;
+	command.killedcap = 4;
+	command.killed = umalloc(command.killedcap * sizeof(*command.killed));
+	prompt.cap = 64;
+	prompt.text = umalloc(prompt.cap);
+	wraps.cap = 64;
+	wraps.l = umalloc(wraps.cap * sizeof(*wraps.l));
+	cols.x = umalloc(COL_LINES * sizeof(*cols.x));
 }
 
 void
@@ -1034,7 +3325,9 @@ changeindent(const Arg *arg)
 void
 deletechar(const Arg *arg)
 {
-	if (doc.selanchor) {
+	if (ncursors) {
+		emultiedit("", 0, DELCHAR, SIGN(arg->i));
+	} else if (doc.selanchor) {
 		edeletesel();
 	} else if (arg->i > 0) {
 		edeleterange(doc.curright, dwalkrune(&doc, doc.curright, arg->i));
@@ -1046,7 +3339,9 @@ deletechar(const Arg *arg)
 void
 deleteword(const Arg *arg)
 {
-	if (doc.selanchor) {
+	if (ncursors) {
+		emultiedit("", 0, DELWORD, SIGN(arg->i));
+	} else if (doc.selanchor) {
 		edeletesel();
 	} else if (arg->i > 0) {
 		edeleterange(doc.curright, dwalkword(&doc, doc.curright, arg->i));
@@ -1059,7 +3354,9 @@ void
 deleterow(const Arg *arg)
 {
 	(void)arg;
-	if (doc.selanchor) {
+	if (ncursors) {
+		emultiedit("", 0, DELROW, 0);
+	} else if (doc.selanchor) {
 		edeletesel();
 	} else {
 		edeleterange(dwalkrow(&doc, doc.curleft, 0), dwalkrow(&doc, doc.curleft, +1));
@@ -1077,64 +3374,104 @@ selectdocument(const Arg *dummy)
 void
 navchar(const Arg *arg)
 {
-	char *pos = dwalkrune(&doc, doc.curleft, SIGN(arg->i));
-	dnavigate(&doc, pos, ISSELECT(arg->i));
+	enavigate(NAVCHAR, arg->i);
 }
 void
 navdocument(const Arg *arg)
 {
-	char *pos = arg->i > 0 ? doc.bufend : doc.bufstart;
-	dnavigate(&doc, pos, ISSELECT(arg->i));
+	enavigate(NAVDOCUMENT, arg->i);
 }
 void
 navline(const Arg *arg)
 {
-	char *pos = arg->i > 0 ?
-		memchr(doc.curright, '\n', doc.bufend - doc.curright) :
-		memrchr(doc.bufstart, '\n', doc.curleft - doc.bufstart);
-	if (pos == NULL) pos = arg->i > 0 ? doc.bufend : doc.bufstart;
-	else if (arg->i < 0) pos++;
-	dnavigate(&doc, pos, ISSELECT(arg->i));
+	enavigate(NAVLINE, arg->i);
 }
 void
 navpage(const Arg *arg)
 {
-	if (doc.coldirty) doc.col = dgetcol(&doc, doc.curleft);
-	char *pos = dwalkrow(&doc, doc.curleft, SIGN(arg->i)*20);
-	dnavigate(&doc, dgetposnearcol(&doc, pos, doc.col), ISSELECT(arg->i));
-	doc.coldirty = false;
+	enavigate(NAVPAGE, arg->i);
 }
 
 void
 navparagraph(const Arg *arg)
 {
-	char *pos = doc.curleft;
-	do {
-		pos = dwalkrow(&doc, pos, SIGN(arg->i));
-		if (0 == POSCMP(&doc, pos, doc.bufstart) && arg->i < 0) break;
-		if (0 == POSCMP(&doc, pos, doc.bufend) && arg->i > 0) break;
-	} while (!disparagraphboundry(&doc, pos));
-	dnavigate(&doc, pos, ISSELECT(arg->i));
+	enavigate(NAVPARAGRAPH, arg->i);
 }
 void
 navrow(const Arg *arg)
 {
-	if (doc.coldirty) doc.col = dgetcol(&doc, doc.curleft);
-	char *pos = dwalkrow(&doc, doc.curleft, SIGN(arg->i));
-	dnavigate(&doc, dgetposnearcol(&doc, pos, doc.col), ISSELECT(arg->i));
-	doc.coldirty = false;
+	enavigate(NAVROW, arg->i);
 }
 void
 navword(const Arg *arg)
 {
-	char *pos = dwalkword(&doc, doc.curleft, SIGN(arg->i));
-	dnavigate(&doc, pos, ISSELECT(arg->i));
+	enavigate(NAVWORD, arg->i);
 }
 void
 newline(const Arg *arg)
 {
 	(void)arg;
-	einsertchar(doc.curleft, '\n');
+	if (ncursors) emultiedit("\n", 1, DELNONE, 0);
+	else einsertchar(doc.curleft, '\n');
+}
+
+void
+addcursor(const Arg *arg)
+{
+	size_t cur = dpointertoindex(&doc, doc.curleft);
+	char *pos;
+	ecursoradd(doc.selanchor ? dpointertoindex(&doc, doc.selanchor) : cur, cur);
+	/* only the main cursor moves, leaving the new one behind */
+	if (doc.coldirty) doc.col = dgetcol(&doc, doc.curleft);
+	pos = dwalkrow(&doc, doc.curleft, SIGN(arg->i));
+	dnavigate(&doc, dgetposnearcol(&doc, pos, doc.col), false);
+	doc.coldirty = false;
+	ecursorsmerge();
+}
+
+void
+splitselection(const Arg *arg)
+{
+	char *p, *end, *target;
+	size_t left, right;
+	int col;
+	if (!doc.selanchor) return;
+	left = dpointertoindex(&doc, MIN(doc.selanchor, doc.curleft));
+	right = dpointertoindex(&doc, MAX(doc.selanchor, doc.curleft));
+	/* a cursor at the end of, or start of, each line in the selection, the main one on the last */
+	ncursors = 0;
+	end = dindextopointer(&doc, right);
+	target = p = dwalkrow(&doc, dindextopointer(&doc, left), 0);
+	for (;;) {
+		target = arg->i > 0 ? dnavtarget(&doc, p, NAVLINE, +1, &col) : p;
+		p = dwalkrow(&doc, p, +1);
+		if (POSCMP(&doc, p, end) >= 0 || 0 == POSCMP(&doc, p, doc.bufend)) break;
+		ecursoradd(SIZE_MAX, dpointertoindex(&doc, target));
+	}
+	dnavigate(&doc, target, false);
+	ecursorsmerge();
+}
+
+void
+selectmatches(const Arg *dummy)
+{
+	size_t at = 0, doclen, start, end, last = SIZE_MAX, lastend = 0;
+	(void)dummy;
+	if (job.active || !esearching()) return;
+	if (prompt.active) prompt.active = false;
+	/* a selection on every match, the main cursor on the last */
+	ncursors = 0;
+	doclen = dgetrangelength(&doc, doc.bufstart, doc.bufend);
+	while (at <= doclen && ematch(at, doclen, +1, &start, &end)) {
+		if (last != SIZE_MAX) ecursoradd(last, lastend);
+		last = start;
+		lastend = end;
+		at = end > start ? end : end + 1;
+	}
+	search.highlight = true;
+	if (last != SIZE_MAX) eselect(last, lastend);
+	ecursorsmerge();
+	emessage(ncursors + (last != SIZE_MAX) == 1 ? "1 cursor" : "%zu cursors", ncursors + (last != SIZE_MAX));
 }
 
 void
@@ -1152,11 +3489,21 @@ load(const Arg *arg)
 	ereadfromfile(filename);
 }
 
+void
+togglewrap(const Arg *arg)
+{
+	(void)arg;
+	nowrap = !nowrap;
+	emessage(nowrap ? "Lines run off the side of the screen" : "Lines wrap");
+}
+
 void
 undo(const Arg *dummy)
 {
 	(void)dummy;
+	bool indexed = eindexed();
 	Action a = hundo(&history, &doc);
+	eafteraction(a, indexed);
 	eupdatecursor(a);
 }
 
@@ -1164,6 +3511,147 @@ void
 redo(const Arg *dummy)
 {
 	(void)dummy;
+	bool indexed = eindexed();
 	Action a = hredo(&history, &doc);
+	eafteraction(a, indexed);
 	eupdatecursor(a);
 }
+
+void
+efindopen(int dir, bool regex)
+{
+	search.dir = dir;
+	search.regex = regex;
+	search.origin = dpointertoindex(&doc, doc.curleft);
+	search.originanchor = doc.selanchor ? dpointertoindex(&doc, doc.selanchor) : SIZE_MAX;
+	if (regex) eprompt(dir > 0 ? "Regex: " : "Regex backward: ", efindupdate, NULL, efindcancel);
+	else eprompt(dir > 0 ? "Find: " : "Find backward: ", efindupdate, NULL, efindcancel);
+}
+
+void
+find(const Arg *arg)
+{
+	efindopen(SIGN(arg->i), false);
+}
+
+void
+findre(const Arg *arg)
+{
+	efindopen(SIGN(arg->i), true);
+}
+
+void
+findnext(const Arg *arg)
+{
+	char *from;
+	size_t i, m, end;
+	int dir = SIGN(arg->i);
+	if (!esearching()) return;
+	/* backward searches start before the current match so they don't find it again */
+	from = dir < 0 && doc.selanchor ? MIN(doc.selanchor, doc.curleft) : doc.curleft;
+	i = dpointertoindex(&doc, from);
+	m = efind(i, dir, &end);
+	/* an empty match at the cursor would be found every time */
+	if (m == i && end == i) {
+		i = dpointertoindex(&doc, dwalkrune(&doc, from, dir));
+		m = efind(i, dir, &end);
+	}
+	search.highlight = true;
+	if (m != SIZE_MAX) eselect(m, end);
+	else if (prompt.active) prompt.status = "not found";
+}
+
+void
+promptaccept(const Arg *dummy)
+{
+	(void)dummy;
+	if (job.active) return;
+	/* closed first so accept can open another prompt */
+	prompt.active = false;
+	if (prompt.accept) prompt.accept();
+}
+
+void
+promptcancel(const Arg *dummy)
+{
+	(void)dummy;
+	prompt.active = false;
+	if (prompt.cancel) prompt.cancel();
+}
+
+void
+promptdelete(const Arg *dummy)
+{
+	(void)dummy;
+	if (job.active || !prompt.len) return;
+	do prompt.len--;
+	while (prompt.len > 0 && ((uchar)prompt.text[prompt.len] >> 6) == 2);
+	prompt.text[prompt.len] = '\0';
+	if (prompt.update) prompt.update();
+}
+
+void
+cancel(const Arg *dummy)
+{
+	(void)dummy;
+	search.highlight = false;
+	message[0] = '\0';
+	ncursors = 0;
+}
+
+void
+filterlines(const Arg *arg)
+{
+	if (job.active) return;
+	/* filters by the search that's open, which is closed first */
+	if (prompt.active) prompt.active = false;
+	if (!esearching()) return;
+	efilterstart(SIGN(arg->i));
+}
+
+void
+sortlines(const Arg *arg)
+{
+	if (job.active) return;
+	if (prompt.active) prompt.active = false;
+	sortunique = arg->i > 0;
+	eprompt(sortunique ? "Sort unique lines by: " : "Sort lines by: ", NULL, esortaccept, NULL);
+}
+
+void
+reverselines(const Arg *dummy)
+{
+	size_t n, i;
+	Span *s, x;
+	(void)dummy;
+	if (job.active) return;
+	s = eselectlines(&n);
+	for (i = 0; i < n / 2; i++) {
+		x = s[i];
+		s[i] = s[n-1-i];
+		s[n-1-i] = x;
+	}
+	ereplacelines(s, n);
+	free(s);
+	emessage(n == 1 ? "Reversed 1 line" : "Reversed %zu lines", n);
+}
+
+void
+pipeselection(const Arg *dummy)
+{
+	(void)dummy;
+	if (job.active) return;
+	if (prompt.active) prompt.active = false;
+	eprompt(doc.selanchor ? "Pipe selection through: " : "Pipe document through: ", NULL, ecommandstart, NULL);
+}
+
+void
+replaceall(const Arg *dummy)
+{
+	(void)dummy;
+	if (job.active) return;
+	/* replaces the matches of the search that's open, which is closed first */
+	if (prompt.active) prompt.active = false;
+	if (!esearching()) return;
+	eprompt("Replace all with: ", NULL, ereplacestart, NULL);
+}
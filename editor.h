@@ -1,5 +1,7 @@
 /* See LICENSE for license details. */
 
+#include <sys/select.h>
+
 #include "cdoedit.h"
 
 void einit();
@@ -7,14 +9,31 @@ char *egetsel();
 char *egetline();
 void ewrite(Rune r);
 void ewritestr(uchar *str, size_t size);
-void edraw(Line *line, int colc, int rowc, int *curcol, int *currow);
+void edraw(Grid *grid, int colc, int rowc, int *curcol, int *currow);
+bool ecursoronly(int colc, int rowc, int *curcol, int *currow);
 void ejumptoline(long line);
 bool ereadfromfile(const char *filename);
+bool eprompting(void);
+void emessage(const char *fmt, ...);
+bool ebusy(void);
+void ework(void);
+double ewait(void);
+int efds(fd_set *rfd, fd_set *wfd);
+void eio(fd_set *rfd, fd_set *wfd);
+void addcursor(const Arg *);
+void cancel(const Arg *);
 void changeindent(const Arg *);
 void deletechar(const Arg *);
 void deleteword(const Arg *);
 void deleterow(const Arg *);
+void find(const Arg *);
+void findnext(const Arg *);
+void findre(const Arg *);
+void filterlines(const Arg *);
 void selectdocument(const Arg *);
+void selectmatches(const Arg *);
+void splitselection(const Arg *);
+void togglewrap(const Arg *);
 void navchar(const Arg *);
 void navdocument(const Arg *);
 void navline(const Arg *);
@@ -24,8 +43,15 @@ void navrow(const Arg *);
 void navword(const Arg *);
 void newline(const Arg *);
 void new(const Arg *);
+void pipeselection(const Arg *);
 void load(const Arg *);
 void save(const Arg *);
 void saveas(const Arg *);
 void undo(const Arg *);
 void redo(const Arg *);
+void replaceall(const Arg *);
+void reverselines(const Arg *);
+void sortlines(const Arg *);
+void promptaccept(const Arg *);
+void promptcancel(const Arg *);
+void promptdelete(const Arg *);
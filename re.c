@@ -0,0 +1,994 @@
+/* See LICENSE for license details. */
+#define _GNU_SOURCE
+#include <assert.h>
+#include <ctype.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "util.h"
+#include "re.h"
+
+/*
+ * A pattern is parsed into a tree and compiled twice into a Thompson NFA, once for scanning forward
+ * and once for scanning backward. Those are run as DFAs whose states (sets of NFA instructions) are
+ * only built the first time a transition is taken, so each byte of text costs one table lookup once
+ * the cache is warm. The DFA never backtracks so a search is linear in the length of the text no
+ * matter what the pattern is, and when the state cache fills up it's thrown away and rebuilt from
+ * the current state rather than allowed to grow.
+ *
+ * Matching is on bytes. '.' and negated classes match a whole UTF-8 sequence, but ranges of
+ * multibyte characters are expanded into alternations and can't be negated one by one.
+ */
+
+#define RE_MAXSTATES 1024          /* DFA states cached per direction, about 1KB each */
+#define RE_TABLESIZE (2*RE_MAXSTATES)
+#define RE_MAXINST 32768           /* counted repetition is expanded so it needs a limit */
+#define RE_MAXREP 1000
+#define RE_CHECK 65536             /* bytes scanned between asking whether to stop */
+
+#define BSADD(s, c) ((s)[(uchar)(c) >> 5] |= 1u << ((uchar)(c) & 31))
+#define BSHAS(s, c) ((s)[(uchar)(c) >> 5] & (1u << ((uchar)(c) & 31)))
+
+typedef uint32_t ByteSet[8];
+
+enum {
+	N_EMPTY,
+	N_SET,
+	N_CAT,
+	N_ALT,
+	N_REP,
+	N_BOL,
+	N_EOL,
+};
+
+typedef struct {
+	int type;
+	int l, r;               /* children, l is the set index of an N_SET */
+	int min, max;           /* bounds of an N_REP, max < 0 is unbounded */
+} Node;
+
+/* PREVNL and NEXTNL are ^ and $ in terms of the direction of the scan */
+enum {
+	OP_SET,
+	OP_SPLIT,
+	OP_JMP,
+	OP_PREVNL,
+	OP_NEXTNL,
+	OP_MATCH,
+};
+
+typedef struct {
+	int op;
+	int x;                  /* next instruction */
+	int y;                  /* second branch of a split, or the set to match */
+} Inst;
+
+#define SEP (-1)
+
+enum {
+	S_PREVNL = 1,           /* the last byte scanned was a newline (or there wasn't one) */
+	S_INJECT = 2,           /* unanchored: a new thread starts at every position */
+};
+
+enum {
+	ACC_NOW = 1,            /* a match ends here */
+	ACC_NL = 2,             /* a match ends here if the next byte is a newline or the edge of the text */
+};
+
+typedef struct {
+	int off, len;           /* instructions in the state in Prog.pool, in groups split by SEP */
+	unsigned hash;
+	uchar flags;
+	uchar acc;
+	bool special;           /* accepts, is dead or is where the literal prefix is searched for */
+} DState;
+
+typedef struct {
+	Inst *inst;
+	size_t ninst, instcap;
+	int start;
+	const ByteSet *sets;    /* owned by the Regex */
+	char *lit;              /* bytes every match must begin with in the scan direction, in text order */
+	size_t litlen;
+	/* the lazily built DFA */
+	DState *states;
+	size_t nstates, statecap;
+	int *delta;             /* 256 transitions per state, see trans() */
+	int *pool;
+	size_t poollen, poolcap;
+	int *table;             /* open addressing on DState.hash, state index + 1 */
+	int startstate[4];      /* indexed by flags, -1 until built */
+	unsigned flushes;
+	/* scratch space for building states */
+	unsigned *mark;
+	unsigned gen;
+	int *stack, *cur, *list, *acc;
+} Prog;
+
+struct Regex {
+	ByteSet *sets;
+	size_t nsets, setcap;
+	Prog fwd, rev;
+	bool (*stop)(void *arg);  /* see restop() */
+	void *stoparg;
+	bool stopped;             /* the last search gave up because stop() said to */
+};
+
+typedef struct {
+	const char *p, *end;
+	const char *err;
+	Node *nodes;
+	size_t nnodes, nodecap;
+	Regex *re;
+} Parser;
+
+static int parsealt(Parser *);
+
+static int
+node(Parser *ps, int type, int l, int r)
+{
+	ps->nodes = grow(ps->nodes, &ps->nodecap, ps->nnodes + 1, sizeof(Node));
+	ps->nodes[ps->nnodes] = (Node){ .type = type, .l = l, .r = r };
+	return ps->nnodes++;
+}
+
+static int
+setnode(Parser *ps, const ByteSet s)
+{
+	Regex *re = ps->re;
+	re->sets = grow(re->sets, &re->setcap, re->nsets + 1, sizeof(ByteSet));
+	memcpy(re->sets[re->nsets], s, sizeof(ByteSet));
+	return node(ps, N_SET, re->nsets++, 0);
+}
+
+static int
+bytenode(Parser *ps, uchar c)
+{
+	ByteSet s = {0};
+	BSADD(s, c);
+	return setnode(ps, s);
+}
+
+static int
+repnode(Parser *ps, int body, int min, int max)
+{
+	int n = node(ps, N_REP, body, 0);
+	ps->nodes[n].min = min;
+	ps->nodes[n].max = max;
+	return n;
+}
+
+static int
+altnode(Parser *ps, int a, int b)
+{
+	return a < 0 ? b : node(ps, N_ALT, a, b);
+}
+
+static int
+seqnode(Parser *ps, const char *s, size_t len)
+{
+	int n = bytenode(ps, s[0]);
+	for (size_t i = 1; i < len; i++)
+		n = node(ps, N_CAT, n, bytenode(ps, s[i]));
+	return n;
+}
+
+/* one character: an ascii byte in the set or, if multibyte, any whole UTF-8 sequence */
+static int
+charnode(Parser *ps, const ByteSet ascii, bool multibyte)
+{
+	ByteSet lead = {0}, cont = {0};
+	int c, n = setnode(ps, ascii);
+	if (!multibyte) return n;
+	for (c = 0xc0; c <= 0xff; c++) BSADD(lead, c);
+	for (c = 0x80; c <= 0xbf; c++) BSADD(cont, c);
+	return node(ps, N_ALT, n,
+		node(ps, N_CAT, setnode(ps, lead), repnode(ps, setnode(ps, cont), 0, -1)));
+}
+
+/* \d, \w, \s and their negations, ascii part only */
+static bool
+classescape(int c, ByteSet s, bool *negated)
+{
+	int i;
+	memset(s, 0, sizeof(ByteSet));
+	switch (c) {
+	case 'd': case 'D':
+		for (i = '0'; i <= '9'; i++) BSADD(s, i);
+		break;
+	case 'w': case 'W':
+		for (i = 0; i < 128; i++) if (isalnum(i) || i == '_') BSADD(s, i);
+		break;
+	case 's': case 'S':
+		for (i = 0; i < 128; i++) if (isspace(i)) BSADD(s, i);
+		break;
+	default:
+		return false;
+	}
+	*negated = isupper(c);
+	if (*negated)
+		for (i = 0; i < 128; i++) s[i >> 5] ^= 1u << (i & 31);
+	return true;
+}
+
+/* a single (possibly escaped) character, returns false on a bad escape */
+static bool
+parsechar(Parser *ps, Rune *r)
+{
+	size_t n;
+	if (*ps->p == '\\') {
+		if (++ps->p == ps->end) {
+			ps->err = "trailing backslash";
+			return false;
+		}
+		switch (*ps->p) {
+		case 'n': *r = '\n'; ps->p++; return true;
+		case 't': *r = '\t'; ps->p++; return true;
+		case 'r': *r = '\r'; ps->p++; return true;
+		}
+		if (isalnum((uchar)*ps->p)) {
+			ps->err = "unsupported escape";
+			return false;
+		}
+	}
+	if ((uchar)*ps->p < 0x80) {
+		*r = (uchar)*ps->p++;
+		return true;
+	}
+	n = utf8decode(ps->p, r, ps->end - ps->p);
+	ps->p += n ? n : 1;
+	return true;
+}
+
+static int
+parseclass(Parser *ps)
+{
+	ByteSet set = {0}, s;
+	bool negate = false, negated, multibyte = false;
+	int alts = -1;
+	Rune lo, hi, r;
+	char buf[UTF_SIZ];
+	if (ps->p < ps->end && *ps->p == '^') {
+		negate = true;
+		ps->p++;
+	}
+	/* a ']' straight after the '[' is part of the class */
+	for (bool first = true; ps->p < ps->end && (*ps->p != ']' || first); first = false) {
+		if (*ps->p == '\\' && ps->p + 1 < ps->end && classescape(ps->p[1], s, &negated)) {
+			for (int i = 0; i < 8; i++) set[i] |= s[i];
+			multibyte |= negated;
+			ps->p += 2;
+			continue;
+		}
+		if (!parsechar(ps, &lo)) return -1;
+		hi = lo;
+		if (ps->p + 1 < ps->end && *ps->p == '-' && ps->p[1] != ']') {
+			ps->p++;
+			if (!parsechar(ps, &hi)) return -1;
+		}
+		if (hi < lo) {
+			ps->err = "bad range";
+			return -1;
+		}
+		if (hi >= 0x80 && hi - MAX(lo, 0x80) > 256) {
+			ps->err = "range too large";
+			return -1;
+		}
+		for (r = lo; r <= hi; r++) {
+			if (r < 0x80) BSADD(set, r);
+			else alts = altnode(ps, alts, seqnode(ps, buf, utf8encode(r, buf)));
+		}
+	}
+	if (ps->p == ps->end) {
+		ps->err = "missing ]";
+		return -1;
+	}
+	ps->p++;
+	if (negate) {
+		/* only the ascii members can be excluded, any multibyte character matches */
+		for (int i = 0; i < 128; i++) set[i >> 5] ^= 1u << (i & 31);
+		return charnode(ps, set, true);
+	}
+	return altnode(ps, alts, charnode(ps, set, multibyte));
+}
+
+static int
+parseatom(Parser *ps)
+{
+	ByteSet s = {0};
+	bool negated;
+	const char *start;
+	Rune r;
+	int n, i;
+	switch (*ps->p) {
+	case '(':
+		ps->p++;
+		n = parsealt(ps);
+		if (ps->p == ps->end || *ps->p != ')') {
+			ps->err = "missing )";
+			return -1;
+		}
+		ps->p++;
+		return n;
+	case '[':
+		ps->p++;
+		return parseclass(ps);
+	case '.':
+		ps->p++;
+		for (i = 0; i < 128; i++) if (i != '\n') BSADD(s, i);
+		return charnode(ps, s, true);
+	case '^':
+		ps->p++;
+		return node(ps, N_BOL, 0, 0);
+	case '$':
+		ps->p++;
+		return node(ps, N_EOL, 0, 0);
+	case '*': case '+': case '?':
+		ps->err = "nothing to repeat";
+		return -1;
+	case '\\':
+		if (ps->p + 1 < ps->end && classescape(ps->p[1], s, &negated)) {
+			ps->p += 2;
+			return charnode(ps, s, negated);
+		}
+		break;
+	}
+	start = ps->p;
+	if (!parsechar(ps, &r)) return -1;
+	if (r < 0x80) return bytenode(ps, r);
+	/* keep multibyte characters as they were written rather than re-encoding them */
+	return seqnode(ps, start, ps->p - start);
+}
+
+/* parses {m}, {m,} or {m,n}, leaving p alone if it isn't one */
+static bool
+parsebounds(Parser *ps, int *min, int *max)
+{
+	const char *p = ps->p + 1;
+	int *v = min;
+	*min = 0;
+	*max = -1;
+	if (p == ps->end || !isdigit((uchar)*p)) return false;
+	for (;;) {
+		if (p == ps->end) return false;
+		if (isdigit((uchar)*p)) {
+			*v = *v * 10 + (*p - '0');
+			if (*v > RE_MAXREP) {
+				ps->err = "repetition count too large";
+				return false;
+			}
+		} else if (*p == ',' && v == min) {
+			v = max;
+			if (p + 1 < ps->end && isdigit((uchar)p[1])) *max = 0;
+		} else if (*p == '}') {
+			break;
+		} else return false;
+		p++;
+	}
+	if (v == min) *max = *min;
+	if (*max >= 0 && *max < *min) {
+		ps->err = "bad repetition count";
+		return false;
+	}
+	ps->p = p + 1;
+	return true;
+}
+
+static int
+parserep(Parser *ps)
+{
+	int n = parseatom(ps), min, max;
+	while (!ps->err && ps->p < ps->end) {
+		switch (*ps->p) {
+		case '*': min = 0; max = -1; ps->p++; break;
+		case '+': min = 1; max = -1; ps->p++; break;
+		case '?': min = 0; max = 1; ps->p++; break;
+		case '{':
+			if (parsebounds(ps, &min, &max)) break;
+			return n;
+		default:
+			return n;
+		}
+		n = repnode(ps, n, min, max);
+	}
+	return n;
+}
+
+static int
+parsecat(Parser *ps)
+{
+	int n = node(ps, N_EMPTY, 0, 0);
+	while (!ps->err && ps->p < ps->end && *ps->p != '|' && *ps->p != ')')
+		n = node(ps, N_CAT, n, parserep(ps));
+	return n;
+}
+
+static int
+parsealt(Parser *ps)
+{
+	int n = parsecat(ps);
+	while (!ps->err && ps->p < ps->end && *ps->p == '|') {
+		ps->p++;
+		n = node(ps, N_ALT, n, parsecat(ps));
+	}
+	return n;
+}
+
+static int
+emit(Parser *ps, Prog *pg, int op, int x, int y)
+{
+	if (pg->ninst >= RE_MAXINST) {
+		ps->err = "pattern too large";
+		return 0;
+	}
+	pg->inst = grow(pg->inst, &pg->instcap, pg->ninst + 1, sizeof(Inst));
+	pg->inst[pg->ninst] = (Inst){ .op = op, .x = x, .y = y };
+	return pg->ninst++;
+}
+
+/* emits the instructions for n, falling through to whatever comes next */
+static void
+compile(Parser *ps, Prog *pg, int n, bool reverse)
+{
+	Node nd = ps->nodes[n];
+	int i, k, *splits;
+	if (ps->err) return;
+	switch (nd.type) {
+	case N_EMPTY:
+		break;
+	case N_SET:
+		emit(ps, pg, OP_SET, pg->ninst + 1, nd.l);
+		break;
+	case N_CAT:
+		compile(ps, pg, reverse ? nd.r : nd.l, reverse);
+		compile(ps, pg, reverse ? nd.l : nd.r, reverse);
+		break;
+	case N_ALT:
+		i = emit(ps, pg, OP_SPLIT, pg->ninst + 1, 0);
+		compile(ps, pg, nd.l, reverse);
+		k = emit(ps, pg, OP_JMP, 0, 0);
+		pg->inst[i].y = pg->ninst;
+		compile(ps, pg, nd.r, reverse);
+		pg->inst[k].x = pg->ninst;
+		break;
+	case N_BOL:
+		emit(ps, pg, reverse ? OP_NEXTNL : OP_PREVNL, pg->ninst + 1, 0);
+		break;
+	case N_EOL:
+		emit(ps, pg, reverse ? OP_PREVNL : OP_NEXTNL, pg->ninst + 1, 0);
+		break;
+	case N_REP:
+		for (k = 0; k < nd.min; k++)
+			compile(ps, pg, nd.l, reverse);
+		if (nd.max < 0) {
+			i = emit(ps, pg, OP_SPLIT, pg->ninst + 1, 0);
+			compile(ps, pg, nd.l, reverse);
+			emit(ps, pg, OP_JMP, i, 0);
+			pg->inst[i].y = pg->ninst;
+		} else if (nd.max > nd.min) {
+			splits = umalloc((nd.max - nd.min) * sizeof(int));
+			for (k = 0; k < nd.max - nd.min; k++) {
+				splits[k] = emit(ps, pg, OP_SPLIT, pg->ninst + 1, 0);
+				compile(ps, pg, nd.l, reverse);
+			}
+			for (k = 0; k < nd.max - nd.min; k++)
+				pg->inst[splits[k]].y = pg->ninst;
+			free(splits);
+		}
+		break;
+	}
+}
+
+/* appends the bytes every match has to start with, returns false once something else is reached */
+static bool
+literal(Parser *ps, int n, bool reverse, char *buf, size_t *len)
+{
+	Node nd = ps->nodes[n];
+	int c, found = -1;
+	switch (nd.type) {
+	case N_EMPTY:
+		return true;
+	case N_CAT:
+		return literal(ps, reverse ? nd.r : nd.l, reverse, buf, len) &&
+			literal(ps, reverse ? nd.l : nd.r, reverse, buf, len);
+	case N_SET:
+		for (c = 0; c < 256; c++) {
+			if (!BSHAS(ps->re->sets[nd.l], c)) continue;
+			if (found >= 0) return false;
+			found = c;
+		}
+		if (found < 0) return false;
+		buf[(*len)++] = found;
+		return true;
+	}
+	return false;
+}
+
+static bool
+progcompile(Parser *ps, Prog *pg, int root, bool reverse, size_t patlen)
+{
+	size_t i;
+	pg->instcap = 64;
+	pg->inst = umalloc(pg->instcap * sizeof(Inst));
+	pg->start = 0;
+	pg->sets = ps->re->sets;
+	compile(ps, pg, root, reverse);
+	emit(ps, pg, OP_MATCH, 0, 0);
+	if (ps->err) return false;
+
+	pg->lit = umalloc(patlen + 1);
+	pg->litlen = 0;
+	literal(ps, root, reverse, pg->lit, &pg->litlen);
+	if (reverse) {
+		for (i = 0; i < pg->litlen / 2; i++) {
+			char c = pg->lit[i];
+			pg->lit[i] = pg->lit[pg->litlen - 1 - i];
+			pg->lit[pg->litlen - 1 - i] = c;
+		}
+	}
+
+	pg->statecap = 16;
+	pg->states = umalloc(pg->statecap * sizeof(DState));
+	pg->delta = umalloc(pg->statecap * 256 * sizeof(int));
+	pg->poolcap = 256;
+	pg->pool = umalloc(pg->poolcap * sizeof(int));
+	pg->table = calloc(RE_TABLESIZE, sizeof(int));
+	pg->mark = calloc(pg->ninst, sizeof(unsigned));
+	if (!pg->table || !pg->mark)
+		udie("calloc: out of memory\n");
+	pg->stack = umalloc((2 * pg->ninst + 1) * sizeof(int));
+	/* room for every instruction and a separator between each of them */
+	pg->cur = umalloc((2 * pg->ninst + 2) * sizeof(int));
+	pg->list = umalloc((2 * pg->ninst + 2) * sizeof(int));
+	pg->acc = umalloc(pg->ninst * sizeof(int));
+	for (i = 0; i < LEN(pg->startstate); i++)
+		pg->startstate[i] = -1;
+	return true;
+}
+
+static void
+progfree(Prog *pg)
+{
+	free(pg->inst);
+	free(pg->lit);
+	free(pg->states);
+	free(pg->delta);
+	free(pg->pool);
+	free(pg->table);
+	free(pg->mark);
+	free(pg->stack);
+	free(pg->cur);
+	free(pg->list);
+	free(pg->acc);
+}
+
+Regex *
+recompile(const char *pattern, size_t len, const char **err)
+{
+	Regex *re = umalloc(sizeof(Regex));
+	Parser ps = { .p = pattern, .end = pattern + len, .re = re };
+	int root;
+	memset(re, 0, sizeof(Regex));
+	re->setcap = 16;
+	re->sets = umalloc(re->setcap * sizeof(ByteSet));
+	ps.nodecap = 64;
+	ps.nodes = umalloc(ps.nodecap * sizeof(Node));
+	root = parsealt(&ps);
+	if (!ps.err && ps.p != ps.end) ps.err = "unmatched )";
+	if (!ps.err) progcompile(&ps, &re->fwd, root, false, len);
+	if (!ps.err) progcompile(&ps, &re->rev, root, true, len);
+	free(ps.nodes);
+	if (ps.err) {
+		*err = ps.err;
+		refree(re);
+		return NULL;
+	}
+	return re;
+}
+
+/* Has searches ask stop(arg) every RE_CHECK bytes they scan, and give up if it returns true. */
+void
+restop(Regex *re, bool (*stop)(void *arg), void *arg)
+{
+	re->stop = stop;
+	re->stoparg = arg;
+}
+
+void
+refree(Regex *re)
+{
+	if (!re) return;
+	progfree(&re->fwd);
+	progfree(&re->rev);
+	free(re->sets);
+	free(re);
+}
+
+static void
+newgen(Prog *pg)
+{
+	if (++pg->gen == 0) {
+		memset(pg->mark, 0, pg->ninst * sizeof(unsigned));
+		pg->gen = 1;
+	}
+}
+
+/* adds i and everything reachable from it without consuming a byte to out */
+static void
+addinst(Prog *pg, int i, bool prevnl, bool nextnl, int *out, int *n)
+{
+	int sp = 0;
+	pg->stack[sp++] = i;
+	while (sp > 0) {
+		i = pg->stack[--sp];
+		if (pg->mark[i] == pg->gen) continue;
+		pg->mark[i] = pg->gen;
+		switch (pg->inst[i].op) {
+		case OP_SPLIT:
+			pg->stack[sp++] = pg->inst[i].y;
+			pg->stack[sp++] = pg->inst[i].x;
+			break;
+		case OP_JMP:
+			pg->stack[sp++] = pg->inst[i].x;
+			break;
+		case OP_PREVNL:
+			if (prevnl) pg->stack[sp++] = pg->inst[i].x;
+			break;
+		case OP_NEXTNL:
+			/* can't be decided until the next byte is seen so it stays in the state */
+			if (nextnl) pg->stack[sp++] = pg->inst[i].x;
+			else out[(*n)++] = i;
+			break;
+		default:
+			out[(*n)++] = i;
+		}
+	}
+}
+
+static int
+intcmp(const void *a, const void *b)
+{
+	return *(const int *)a - *(const int *)b;
+}
+
+static bool
+memintchr(const int *list, int v, int n)
+{
+	for (int i = 0; i < n; i++)
+		if (list[i] == v) return true;
+	return false;
+}
+
+/* drops empty groups and sorts each one so equivalent states compare equal, returns the new length */
+static int
+canon(int *list, int n)
+{
+	int i = 0, j = 0, g;
+	while (i < n) {
+		if (list[i] < 0) {
+			i++;
+			continue;
+		}
+		for (g = i; i < n && list[i] >= 0; i++)
+			;
+		if (j > 0) list[j++] = SEP;
+		memmove(list + j, list + g, (i - g) * sizeof(int));
+		qsort(list + j, i - g, sizeof(int), intcmp);
+		j += i - g;
+	}
+	return j;
+}
+
+static uchar
+accepts(Prog *pg, const int *list, int n, int flags)
+{
+	uchar acc = 0;
+	int i, m = 0;
+	newgen(pg);
+	for (i = 0; i < n; i++) {
+		if (list[i] == SEP) continue;
+		if (pg->inst[list[i]].op == OP_MATCH) acc |= ACC_NOW;
+		pg->mark[list[i]] = pg->gen;
+	}
+	for (i = 0; i < n; i++)
+		if (list[i] != SEP && pg->inst[list[i]].op == OP_NEXTNL)
+			addinst(pg, pg->inst[list[i]].x, flags & S_PREVNL, true, pg->acc, &m);
+	for (i = 0; i < m; i++)
+		if (pg->inst[pg->acc[i]].op == OP_MATCH) acc |= ACC_NL;
+	return acc;
+}
+
+/* returns the index of the state for the canonical list, building it if needed */
+static int
+dstate(Prog *pg, const int *list, int n, int flags)
+{
+	unsigned h = 2166136261u ^ flags;
+	size_t i, mask = RE_TABLESIZE - 1;
+	DState *st;
+	int k;
+	for (k = 0; k < n; k++)
+		h = (h ^ list[k]) * 16777619u;
+	for (i = h & mask; pg->table[i]; i = (i + 1) & mask) {
+		st = &pg->states[pg->table[i] - 1];
+		if (st->hash == h && st->flags == flags && st->len == n &&
+				!memcmp(pg->pool + st->off, list, n * sizeof(int)))
+			return pg->table[i] - 1;
+	}
+	if (pg->nstates == RE_MAXSTATES) {
+		pg->nstates = 0;
+		pg->poollen = 0;
+		memset(pg->table, 0, RE_TABLESIZE * sizeof(int));
+		for (k = 0; k < (int)LEN(pg->startstate); k++)
+			pg->startstate[k] = -1;
+		pg->flushes++;
+		i = h & mask;
+	}
+	if (pg->nstates == pg->statecap) {
+		pg->states = urealloc(pg->states, 2 * pg->statecap * sizeof(DState));
+		pg->delta = urealloc(pg->delta, 2 * pg->statecap * 256 * sizeof(int));
+		pg->statecap *= 2;
+	}
+	pg->pool = grow(pg->pool, &pg->poolcap, pg->poollen + n + 1, sizeof(int));
+	st = &pg->states[pg->nstates];
+	memset(pg->delta + pg->nstates * 256, 0xff, 256 * sizeof(int));
+	st->off = pg->poollen;
+	st->len = n;
+	st->hash = h;
+	st->flags = flags;
+	memcpy(pg->pool + pg->poollen, list, n * sizeof(int));
+	pg->poollen += n;
+	st->acc = accepts(pg, list, n, flags);
+	/* which states are start states isn't known until startstate() returns them so anything
+	   that might be one has to be special */
+	st->special = st->acc || (!n && !(flags & S_INJECT)) ||
+		(pg->litlen && (flags & S_INJECT) && !memintchr(list, SEP, n));
+	pg->table[i] = pg->nstates + 1;
+	return pg->nstates++;
+}
+
+static int
+startstate(Prog *pg, bool prevnl, bool inject)
+{
+	int flags = (prevnl ? S_PREVNL : 0) | (inject ? S_INJECT : 0), n = 0;
+	if (pg->startstate[flags] < 0) {
+		newgen(pg);
+		addinst(pg, pg->start, prevnl, false, pg->list, &n);
+		n = dstate(pg, pg->list, canon(pg->list, n), flags);
+		pg->startstate[flags] = n;
+	}
+	return pg->startstate[flags];
+}
+
+/*
+ * Threads are kept in groups by where they started, earliest first. When a thread in some group
+ * matches, the groups after it can only produce matches starting further away so they're dropped
+ * and no more threads are started, while the group itself and those before it carry on in case
+ * they produce a longer or an earlier starting match.
+ */
+static int
+step(Prog *pg, int s, uchar c)
+{
+	DState *st = &pg->states[s];
+	int i, k, n = 0, m = 0, flags = (c == '\n' ? S_PREVNL : 0) | (st->flags & S_INJECT), ns;
+	unsigned flushes = pg->flushes;
+	newgen(pg);
+	for (i = 0; i < st->len; i++) {
+		k = pg->pool[st->off + i];
+		if (k == SEP) {
+			pg->cur[n++] = SEP;
+			continue;
+		}
+		if (pg->mark[k] == pg->gen) continue;
+		pg->mark[k] = pg->gen;
+		pg->cur[n++] = k;
+		if (c == '\n' && pg->inst[k].op == OP_NEXTNL)
+			addinst(pg, pg->inst[k].x, st->flags & S_PREVNL, true, pg->cur, &n);
+	}
+	for (i = 0; i < n; i++) {
+		if (pg->cur[i] != SEP && pg->inst[pg->cur[i]].op == OP_MATCH) {
+			while (i < n && pg->cur[i] != SEP) i++;
+			n = i;
+			flags &= ~S_INJECT;
+			break;
+		}
+	}
+	newgen(pg);
+	for (i = 0; i < n; i++) {
+		k = pg->cur[i];
+		if (k == SEP)
+			pg->list[m++] = SEP;
+		else if (pg->inst[k].op == OP_SET && BSHAS(pg->sets[pg->inst[k].y], c))
+			addinst(pg, pg->inst[k].x, c == '\n', false, pg->list, &m);
+	}
+	if (flags & S_INJECT) {
+		pg->list[m++] = SEP;
+		addinst(pg, pg->start, c == '\n', false, pg->list, &m);
+	}
+	ns = dstate(pg, pg->list, canon(pg->list, m), flags);
+	/* the source state is gone if the cache was flushed to make room */
+	if (flushes == pg->flushes)
+		pg->delta[s * 256 + c] = pg->states[ns].special ? -2 - ns : ns * 256;
+	return ns;
+}
+
+/* the byte just before p in the direction of the scan, or -1 at the edge of the text */
+static int
+behind(const ReText *t, const char *p, int dir)
+{
+	if (dir > 0) {
+		if (p == t->s[0]) return -1;
+		if (p == t->s[1]) return t->e[0] > t->s[0] ? (uchar)t->e[0][-1] : -1;
+		return (uchar)p[-1];
+	} else {
+		if (p == t->e[1]) return -1;
+		if (p == t->e[0]) return t->s[1] < t->e[1] ? (uchar)*t->s[1] : -1;
+		return (uchar)*p;
+	}
+}
+
+/* positions at the join belong to the span the scan is moving into */
+static const char *
+norm(const ReText *t, const char *p, int dir)
+{
+	if (dir > 0 && p == t->e[0]) return t->s[1];
+	if (dir < 0 && p == t->s[1]) return t->e[0];
+	return p;
+}
+
+static size_t
+offset(const ReText *t, const char *p)
+{
+	return p <= t->e[0] ? (size_t)(p - t->s[0]) : (size_t)(t->e[0] - t->s[0]) + (p - t->s[1]);
+}
+
+/* how far the scan can go from p towards limit without crossing the join */
+static const char *
+runend(const ReText *t, const char *p, const char *limit, int dir)
+{
+	if (dir > 0)
+		return p >= t->s[1] || limit <= t->e[0] ? limit : t->e[0];
+	else
+		return p <= t->e[0] || limit >= t->s[1] ? limit : t->s[1];
+}
+
+/*
+ * Runs the DFA from p towards limit and returns the furthest position at which a match ended, or
+ * NULL. Once something has matched an unanchored scan stops starting new threads and carries on
+ * until the ones it has die, so the longest of the earliest matches wins.
+ *
+ * If resume isn't NULL the scan gives up once it has gone budget bytes and reached somewhere it
+ * could start again from without losing anything (nothing matched and no threads but the start
+ * state's), returning NULL with that position in *resume.
+ *
+ * The scan also gives up, returning NULL with re->stopped set, if re->stop() says to.
+ */
+static const char *
+rescan(Regex *re, Prog *pg, const ReText *t, const char *p, const char *limit, int dir, bool unanchored,
+	size_t budget, const char **resume)
+{
+	const char *last = NULL, *end, *stop, *start, *f, *skipped = NULL;
+	int s, c, v, row;
+	size_t n, check = RE_CHECK;
+	uchar acc;
+	limit = norm(t, limit, dir);
+	c = behind(t, p, dir);
+	s = startstate(pg, c == '\n' || c < 0, unanchored);
+	for (;;) {
+		p = norm(t, p, dir);
+		end = runend(t, p, limit, dir);
+		while (p != end) {
+			n = dir > 0 ? (size_t)(end - p) : (size_t)(p - end);
+			stop = MIN(budget, check) < n ? p + dir * (ptrdiff_t)MIN(budget, check) : end;
+			start = p;
+			/* the hot loop, following cached transitions between ordinary states */
+			if (!pg->states[s].special) {
+				row = s * 256;
+				if (dir > 0)
+					for (; p != stop && (v = pg->delta[row + (uchar)p[0]]) >= 0; p++)
+						row = v;
+				else
+					for (; p != stop && (v = pg->delta[row + (uchar)p[-1]]) >= 0; p--)
+						row = v;
+				s = row / 256;
+			}
+			if (p != stop) {
+				c = dir > 0 ? (uchar)p[0] : (uchar)p[-1];
+				acc = pg->states[s].acc;
+				if ((acc & ACC_NOW) || ((acc & ACC_NL) && c == '\n'))
+					last = p;
+				if (!pg->states[s].len && !(pg->states[s].flags & S_INJECT))
+					return last;
+				if (pg->states[s].special && pg->litlen && !last && p != skipped &&
+						(s == pg->startstate[S_INJECT] || s == pg->startstate[S_INJECT|S_PREVNL])) {
+					/* nothing in progress so skip straight to where the literal prefix appears,
+					   stopping short of the end so the DFA sees any occurrence straddling it */
+					if (dir > 0) {
+						f = memfind(p, stop - p, pg->lit, pg->litlen);
+						if (!f) f = (size_t)(stop - p) > pg->litlen - 1 ? stop - (pg->litlen - 1) : p;
+					} else {
+						f = memrfind(stop, p - stop, pg->lit, pg->litlen);
+						if (f) f += pg->litlen;
+						else f = (size_t)(p - stop) > pg->litlen - 1 ? stop + (pg->litlen - 1) : p;
+					}
+					p = skipped = f;
+					c = behind(t, p, dir);
+					s = startstate(pg, c == '\n' || c < 0, true);
+				} else {
+					v = pg->delta[s * 256 + c];
+					s = v >= 0 ? v / 256 : v == -1 ? step(pg, s, c) : -2 - v;
+					p += dir;
+				}
+			}
+			n = dir > 0 ? (size_t)(p - start) : (size_t)(start - p);
+			budget -= n;
+			check -= MIN(n, check);
+			if (!check) {
+				if (re->stop && re->stop(re->stoparg)) {
+					re->stopped = true;
+					return NULL;
+				}
+				check = RE_CHECK;
+			}
+			if (resume && !budget) {
+				if (!last && (s == pg->startstate[S_INJECT] || s == pg->startstate[S_INJECT|S_PREVNL])) {
+					*resume = p;
+					return NULL;
+				}
+				/* somewhere in the middle of a possible match, try again a little further on */
+				budget = 256;
+			}
+		}
+		if (end == limit) break;
+		p = end;
+	}
+	c = behind(t, limit, -dir);
+	acc = pg->states[s].acc;
+	if ((acc & ACC_NOW) || ((acc & ACC_NL) && (c == '\n' || c < 0)))
+		last = limit;
+	return last;
+}
+
+/*
+ * Finds the match nearest to from, in direction dir, lying entirely between from and limit.
+ * The first pass finds the end of the match nearest from and the second runs the pattern the
+ * other way, anchored at that end, to find where it started.
+ *
+ * The scan starts at at, which is from unless the search is being carried on. It gives up after
+ * about budget bytes and returns -1 with *start set to the at to carry on from, otherwise it
+ * returns 1 for a match or 0 if there isn't one. If it's stopped by restop()'s function it returns
+ * -1 with *start set to at, so the search is done again from the same place.
+ */
+int
+refindfrom(Regex *re, const ReText *t, const char *from, const char *at, const char *limit, int dir,
+	size_t budget, const char **start, const char **end)
+{
+	const char *a, *b, *resume = NULL;
+	if (dir > 0 ? offset(t, limit) < offset(t, at) : offset(t, at) < offset(t, limit))
+		return 0;
+	re->stopped = false;
+	if (dir > 0) {
+		if (!(b = rescan(re, &re->fwd, t, at, limit, +1, true, budget, &resume))) goto fail;
+		if (!(a = rescan(re, &re->rev, t, b, from, -1, false, SIZE_MAX, NULL))) goto fail;
+	} else {
+		if (!(a = rescan(re, &re->rev, t, at, limit, -1, true, budget, &resume))) goto fail;
+		if (!(b = rescan(re, &re->fwd, t, a, from, +1, false, SIZE_MAX, NULL))) goto fail;
+	}
+	*start = a;
+	*end = b;
+	return 1;
+fail:
+	if (re->stopped) resume = at;
+	if (!resume) return 0;
+	*start = resume;
+	return -1;
+}
+
+bool
+refind(Regex *re, const ReText *t, const char *from, const char *limit, int dir,
+	const char **start, const char **end)
+{
+	return refindfrom(re, t, from, from, limit, dir, SIZE_MAX, start, end) > 0;
+}
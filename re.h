@@ -0,0 +1,22 @@
+/* See LICENSE for license details. */
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Text made of two contiguous spans, for example either side of the gap in the document.
+   Positions are pointers into either span, s[1] must be above e[0] in memory and e[0] is the
+   same position as s[1]. */
+typedef struct {
+	const char *s[2];
+	const char *e[2];
+} ReText;
+
+typedef struct Regex Regex;
+
+Regex *recompile(const char *pattern, size_t len, const char **err);
+void restop(Regex *re, bool (*stop)(void *arg), void *arg);
+void refree(Regex *re);
+bool refind(Regex *re, const ReText *t, const char *from, const char *limit, int dir,
+	const char **start, const char **end);
+int refindfrom(Regex *re, const ReText *t, const char *from, const char *at, const char *limit, int dir,
+	size_t budget, const char **start, const char **end);
@@ -0,0 +1,186 @@
+/* See LICENSE for license details. */
+#include <ctype.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "util.h"
+#include "sort.h"
+
+/*
+ * Sorts lines with a merge sort spread over one thread per core. The lines are split into a run per
+ * thread, a power of two of them, and each thread works out the keys of its run and sorts it. Then
+ * the runs are merged in pairs, each pair on its own thread, until there's one run left. The sort is
+ * stable so lines that compare the same stay in the order they were in.
+ */
+
+#define SORT_MAXTHREADS 16
+#define SORT_MINRUN 16384         /* lines it's worth starting a thread for */
+#define SORT_INSERTION 16         /* runs this short are sorted by insertion */
+
+typedef struct {
+	Span *s, *tmp;
+	size_t lo, mid, hi;
+	int field;
+	bool numeric;
+} Task;
+
+/* Fields are separated by blanks, field 0 is the whole line. */
+static void
+spankey(Span *s, int field, bool numeric)
+{
+	size_t i = 0;
+	double frac = 1, sign = 1;
+	if (field > 0) {
+		while (i < s->len && isblank((uchar)s->s[i])) i++;
+		for (int f = 1; f < field; f++) {
+			while (i < s->len && !isblank((uchar)s->s[i])) i++;
+			while (i < s->len && isblank((uchar)s->s[i])) i++;
+		}
+	}
+	s->key = i;
+	s->prefix = 0;
+	for (int k = 0; k < 8; k++)
+		s->prefix = s->prefix << 8 | (i + k < s->len ? (uchar)s->s[i+k] : 0);
+	s->num = 0;
+	if (!numeric) return;
+	/* like sort -n, a field that doesn't start with a number counts as 0 */
+	while (i < s->len && isblank((uchar)s->s[i])) i++;
+	if (i < s->len && (s->s[i] == '-' || s->s[i] == '+'))
+		sign = s->s[i++] == '-' ? -1 : 1;
+	for (; i < s->len && BETWEEN(s->s[i], '0', '9'); i++)
+		s->num = s->num * 10 + (s->s[i] - '0');
+	if (i < s->len && s->s[i] == '.') {
+		for (i++; i < s->len && BETWEEN(s->s[i], '0', '9'); i++)
+			s->num += (s->s[i] - '0') * (frac /= 10);
+	}
+	s->num *= sign;
+}
+
+/* numbers first if they're being compared, then the bytes of the field to the end of the line */
+static int
+spancmp(const Span *a, const Span *b, bool numeric)
+{
+	size_t al = a->len - a->key, bl = b->len - b->key;
+	int r;
+	if (numeric && a->num != b->num) return a->num < b->num ? -1 : 1;
+	if (a->prefix != b->prefix) return a->prefix < b->prefix ? -1 : 1;
+	if ((r = memcmp(a->s + a->key, b->s + b->key, MIN(al, bl)))) return r;
+	return (al > bl) - (al < bl);
+}
+
+/* Merges src[lo, mid) and src[mid, hi) into dst[lo, hi), taking from the left on a tie. */
+static void
+spanmerge(Span *dst, const Span *src, size_t lo, size_t mid, size_t hi, bool numeric)
+{
+	size_t i = lo, j = mid, o = lo;
+	while (i < mid && j < hi)
+		dst[o++] = spancmp(&src[j], &src[i], numeric) < 0 ? src[j++] : src[i++];
+	memcpy(dst + o, src + i, (mid - i) * sizeof(Span));
+	o += mid - i;
+	memcpy(dst + o, src + j, (hi - j) * sizeof(Span));
+}
+
+static void
+spansort(Span *s, Span *tmp, size_t lo, size_t hi, bool numeric)
+{
+	size_t i, j, mid;
+	Span x;
+	if (hi - lo <= SORT_INSERTION) {
+		for (i = lo + 1; i < hi; i++) {
+			x = s[i];
+			for (j = i; j > lo && spancmp(&x, &s[j-1], numeric) < 0; j--)
+				s[j] = s[j-1];
+			s[j] = x;
+		}
+		return;
+	}
+	mid = lo + (hi - lo) / 2;
+	spansort(s, tmp, lo, mid, numeric);
+	spansort(s, tmp, mid, hi, numeric);
+	/* lines that are mostly in order already don't need merging */
+	if (spancmp(&s[mid-1], &s[mid], numeric) <= 0) return;
+	memcpy(tmp + lo, s + lo, (hi - lo) * sizeof(Span));
+	spanmerge(s, tmp, lo, mid, hi, numeric);
+}
+
+static void *
+sortrun(void *arg)
+{
+	Task *t = arg;
+	for (size_t i = t->lo; i < t->hi; i++)
+		spankey(&t->s[i], t->field, t->numeric);
+	spansort(t->s, t->tmp, t->lo, t->hi, t->numeric);
+	return NULL;
+}
+
+static void *
+mergerun(void *arg)
+{
+	Task *t = arg;
+	if (spancmp(&t->s[t->mid-1], &t->s[t->mid], t->numeric) <= 0) return NULL;
+	memcpy(t->tmp + t->lo, t->s + t->lo, (t->hi - t->lo) * sizeof(Span));
+	spanmerge(t->s, t->tmp, t->lo, t->mid, t->hi, t->numeric);
+	return NULL;
+}
+
+/* Runs the tasks on a thread each, the first on this one. A task whose thread can't be started is
+   run here too. */
+static void
+runtasks(Task *t, int n, void *(*fn)(void *))
+{
+	pthread_t threads[SORT_MAXTHREADS];
+	bool started[SORT_MAXTHREADS];
+	int i, r;
+	for (i = 1; i < n; i++) {
+		if ((r = pthread_create(&threads[i], NULL, fn, &t[i]))) {
+			errno = r;
+			printsyserror("Could not start a thread to sort lines");
+		}
+		started[i] = !r;
+	}
+	fn(&t[0]);
+	for (i = 1; i < n; i++) {
+		if (started[i]) pthread_join(threads[i], NULL);
+		else fn(&t[i]);
+	}
+}
+
+/* Sorts the *n lines s by field (0 for the whole line), comparing the numbers they start with first
+   if numeric, and drops lines the same as the one before if unique. */
+void
+sortspans(Span *s, size_t *n, int field, bool numeric, bool unique)
+{
+	Task t[SORT_MAXTHREADS];
+	size_t bound[SORT_MAXTHREADS + 1], i, j;
+	long runs = sysconf(_SC_NPROCESSORS_ONLN);
+	int k, m, width;
+	Span *tmp;
+	if (*n == 0) return;
+	tmp = umalloc(*n * sizeof(Span));
+	LIMIT(runs, 1, SORT_MAXTHREADS);
+	runs = MIN(runs, (long)DIVCEIL(*n, SORT_MINRUN));
+	/* a power of two so the runs can be merged in pairs */
+	while (runs & (runs - 1)) runs--;
+	for (k = 0; k <= runs; k++)
+		bound[k] = *n * k / runs;
+	for (k = 0; k < runs; k++)
+		t[k] = (Task){ s, tmp, bound[k], 0, bound[k+1], field, numeric };
+	runtasks(t, runs, sortrun);
+	for (width = 1; width < runs; width *= 2) {
+		for (k = m = 0; k < runs; k += 2 * width)
+			t[m++] = (Task){ s, tmp, bound[k], bound[k+width], bound[k+2*width], field, numeric };
+		runtasks(t, m, mergerun);
+	}
+	free(tmp);
+	if (!unique) return;
+	for (i = j = 0; i < *n; i++) {
+		if (j == 0 || spancmp(&s[j-1], &s[i], numeric) != 0)
+			s[j++] = s[i];
+	}
+	*n = j;
+}
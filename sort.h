@@ -0,0 +1,16 @@
+/* See LICENSE for license details. */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* A line to be sorted, pointing into the text rather than copied out of it. */
+typedef struct {
+	const char *s;          /* without its newline */
+	size_t len;
+	size_t key;             /* where the field being compared starts */
+	uint64_t prefix;        /* its first 8 bytes, so most comparisons don't have to look at the text */
+	double num;             /* the number at the start of the field, when comparing numbers */
+} Span;
+
+void sortspans(Span *s, size_t *n, int field, bool numeric, bool unique);
@@ -8,6 +8,9 @@
 #include <ctype.h>
 #include <assert.h>
 #include <errno.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "util.h"
 
@@ -35,6 +38,100 @@ memctchr(const char *s, int c, size_t n)
 	return count;
 }
 
+/* Needles at least this long are searched with Horspool's skip table rather than the
+   first/last byte filter, since long needles let it skip most of the haystack. */
+#define MEMFIND_SKIP_MIN 32
+
+static const char *
+memfindskip(const char *h, size_t hlen, const char *n, size_t nlen, int dir)
+{
+	size_t skip[256], i, j;
+	for (i = 0; i < 256; i++)
+		skip[i] = nlen;
+	if (dir > 0) {
+		for (i = 0; i < nlen-1; i++)
+			skip[(uchar)n[i]] = nlen-1 - i;
+		for (i = 0; i + nlen <= hlen; i += skip[(uchar)h[i+nlen-1]])
+			if (h[i+nlen-1] == n[nlen-1] && !memcmp(h+i, n, nlen-1))
+				return h + i;
+	} else {
+		for (i = nlen-1; i > 0; i--)
+			skip[(uchar)n[i]] = i;
+		/* j is one past the end of the window */
+		for (j = hlen; j >= nlen; j -= skip[(uchar)h[j-nlen]])
+			if (h[j-nlen] == n[0] && !memcmp(h+j-nlen+1, n+1, nlen-1))
+				return h + j - nlen;
+	}
+	return NULL;
+}
+
+/* Compare the first and last bytes of the needle against 16 candidate positions at once and
+   only memcmp() the positions where both match. This is what makes it competitive with memmem()
+   on ordinary text where the first byte alone is very common. */
+const char *
+memfind(const char *h, size_t hlen, const char *n, size_t nlen)
+{
+	assert2(!STUPIDLY_BIG(hlen), !STUPIDLY_BIG(nlen));
+	size_t i = 0;
+	if (nlen == 0) return h;
+	if (nlen > hlen) return NULL;
+	if (nlen == 1) return memchr(h, n[0], hlen);
+	if (nlen >= MEMFIND_SKIP_MIN) return memfindskip(h, hlen, n, nlen, +1);
+#ifdef __SSE2__
+	const __m128i first = _mm_set1_epi8(n[0]);
+	const __m128i last = _mm_set1_epi8(n[nlen-1]);
+	for (; i + nlen-1 + 16 <= hlen; i += 16) {
+		__m128i a = _mm_loadu_si128((const __m128i *)(h + i));
+		__m128i b = _mm_loadu_si128((const __m128i *)(h + i + nlen-1));
+		unsigned mask = _mm_movemask_epi8(_mm_and_si128(
+			_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+		while (mask) {
+			unsigned bit = __builtin_ctz(mask);
+			if (!memcmp(h + i + bit + 1, n + 1, nlen-2))
+				return h + i + bit;
+			mask &= mask - 1;
+		}
+	}
+#endif
+	for (; i + nlen <= hlen; i++)
+		if (h[i] == n[0] && h[i+nlen-1] == n[nlen-1] && !memcmp(h+i+1, n+1, nlen-2))
+			return h + i;
+	return NULL;
+}
+
+/* same as memfind() but returns the last occurrence */
+const char *
+memrfind(const char *h, size_t hlen, const char *n, size_t nlen)
+{
+	assert2(!STUPIDLY_BIG(hlen), !STUPIDLY_BIG(nlen));
+	size_t j = hlen; /* one past the last candidate start */
+	if (nlen == 0) return h + hlen;
+	if (nlen > hlen) return NULL;
+	if (nlen == 1) return memrchr(h, n[0], hlen);
+	if (nlen >= MEMFIND_SKIP_MIN) return memfindskip(h, hlen, n, nlen, -1);
+	j = hlen - nlen + 1;
+#ifdef __SSE2__
+	const __m128i first = _mm_set1_epi8(n[0]);
+	const __m128i last = _mm_set1_epi8(n[nlen-1]);
+	for (; j >= 16; j -= 16) {
+		__m128i a = _mm_loadu_si128((const __m128i *)(h + j - 16));
+		__m128i b = _mm_loadu_si128((const __m128i *)(h + j - 16 + nlen-1));
+		unsigned mask = _mm_movemask_epi8(_mm_and_si128(
+			_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+		while (mask) {
+			unsigned bit = 31 - __builtin_clz(mask);
+			if (!memcmp(h + j - 16 + bit + 1, n + 1, nlen-2))
+				return h + j - 16 + bit;
+			mask &= ~(1u << bit);
+		}
+	}
+#endif
+	for (; j > 0; j--)
+		if (h[j-1] == n[0] && h[j-1+nlen-1] == n[nlen-1] && !memcmp(h+j, n+1, nlen-2))
+			return h + j - 1;
+	return NULL;
+}
+
 void *
 grow(void *buf, size_t *len, size_t newlen, size_t entrysize)
 {
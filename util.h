@@ -71,6 +71,8 @@ char *ustrdup(char *);
 #endif
 
 size_t memctchr(const char *s, int c, size_t n);
+const char *memfind(const char *h, size_t hlen, const char *n, size_t nlen);
+const char *memrfind(const char *h, size_t hlen, const char *n, size_t nlen);
 void *grow(void *buf, size_t *len, size_t newlen, size_t entrysize);
 void userwarning(const char *s, ...);
 void printsyserror(const char *str, ...);
@@ -25,14 +25,20 @@ enum win_mode {
 
 void xbell(void);
 void xclipcopy(void);
+void xcopyarea(int, int, int, int);
 void xdrawcursor(int, int, Glyph);
-void xdrawline(Line, int, int, int);
+void xdrawline(const Rune *, const uchar *, int, int, int);
 void xfinishdraw(void);
+size_t xlatency(double *, double *);
 void xloadcols(void);
+unsigned long xrequests(double *, const char **);
+void xscroll(int, int, int);
 int xsetcolorname(int, const char *);
 void xsettitle(char *);
 int xsetcursor(int);
 void xsetmode(int, unsigned int);
 void xsetpointermotion(int);
+double xspectime(void);
+int xstartup(double *, double *, int *);
 int xstartdraw(void);
 void xximspot(int, int);
@@ -1,11 +1,16 @@
 /* See LICENSE for license details. */
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <math.h>
 #include <limits.h>
 #include <locale.h>
+#include <pthread.h>
 #include <signal.h>
+#include <sys/ipc.h>
 #include <sys/select.h>
+#include <sys/shm.h>
+#include <sys/stat.h>
 #include <time.h>
 #include <unistd.h>
 #include <libgen.h>
@@ -15,6 +20,7 @@
 #include <X11/keysym.h>
 #include <X11/Xft/Xft.h>
 #include <X11/XKBlib.h>
+#include <X11/extensions/XShm.h>
 
 static char *argv0;
 #include "arg.h"
@@ -105,6 +111,15 @@ typedef struct {
 	int isfixed; /* is fixed geometry? */
 	int l, t; /* left and top offset */
 	int gm; /* geometry mask */
+	XImage *img; /* the buffer in shared memory, NULL when drawing with Xft */
+	XShmSegmentInfo shminfo;
+	int shmcompletion; /* event type of a finished XShmPutImage() */
+	int shmpending; /* puts the server may still be reading the image for */
+	int rshift, gshift, bshift; /* of the 8 bit channels in a pixel */
+	Picture pict; /* of buf, when drawing with XRender rather than Xft */
+	GlyphSet glyphset; /* the atlas's coverage glyphs, uploaded to the server */
+	XRenderPictFormat *a8;
+	int bufw, bufh; /* the size buf or img was made at */
 } XWindow;
 
 typedef struct {
@@ -116,6 +131,11 @@ typedef struct {
 
 /* Font structure */
 #define Font Font_
+typedef struct {
+	Rune u;
+	FT_UInt glyph;
+} GlyphSlot;
+
 typedef struct {
 	int height;
 	int width;
@@ -128,18 +148,152 @@ typedef struct {
 	XftFont *match;
 	FcFontSet *set;
 	FcPattern *pattern;
+	FT_UInt latin1[256]; /* glyph index + 1, or 0 if not looked up yet */
+	GlyphSlot glyphs[256]; /* direct-mapped by rune, u is 0 if empty */
 } Font;
 
+/* Font Ring Cache */
+enum {
+	FRC_NORMAL,
+	FRC_ITALIC,
+	FRC_BOLD,
+	FRC_ITALICBOLD
+};
+
+typedef struct {
+	XftFont *font;
+	int flags;
+	Rune unicodep;
+	unsigned long used; /* frcclock when it was last drawn */
+} Fontcache;
+
+/* The font cache entry and glyph that draw a rune in a style */
+typedef struct {
+	Rune u;
+	int flags;
+	int f; /* index into frc + 1, 0 if the slot is empty, -1 while matching */
+	FT_UInt glyph;
+} Fallback;
+
+/* A rune for the worker thread to find a fallback font for */
+typedef struct {
+	Rune u;
+	int flags;
+	unsigned long gen; /* of the FontSize it's for */
+	FcPattern *pattern; /* the configured pattern of the style */
+	FcPattern *match; /* what fontconfig found, once done */
+	int done;
+} FallbackJob;
+
+/* The fonts of one size and everything found out about them */
+typedef struct {
+	Font font, bfont, ifont, ibfont; /* the styles are opened when drawn */
+	FcPattern *pattern; /* what the styles are loaded from */
+	double size; /* the size asked of xloadfonts() */
+	double pixelsize;
+	Fontcache *frc; /* a new fallback font is appended to the array */
+	int frclen, frccap;
+	Fallback fallback[4096];
+	size_t fallbacklen;
+	unsigned long gen; /* tells it apart from a size loaded later */
+	unsigned long used; /* fontclock when it was last zoomed to */
+} FontSize;
+
 /* Drawing Context */
 typedef struct {
 	Color *col;
 	size_t collen;
-	Font font, bfont, ifont, ibfont;
+	FontSize *fs; /* the fonts of the current size */
 	GC gc;
 } DC;
 
+/* A glyph rasterized for drawing into shared memory */
+typedef struct {
+	XftFont *font; /* NULL if the slot is empty */
+	FT_UInt glyph;
+	short x, y; /* of the bitmap's top left from the pen */
+	ushort w, h;
+	int color; /* premultiplied BGRA pixels rather than coverage */
+	size_t off; /* into atlas.data */
+	unsigned int gid; /* in xw.glyphset, when drawing with XRender */
+} AtlasGlyph;
+
+/* The layers a frame is drawn in with XRender, bottom to top */
+enum {
+	BATCH_UNDER, /* backgrounds */
+	BATCH_TEXT,
+	BATCH_OVER /* lines and the cursor */
+};
+
+/* What a frame draws in one colour and layer with XRender */
+typedef struct {
+	int layer;
+	XRenderColor color;
+	Picture src; /* a solid fill of the colour, for the text */
+	XRectangle *r; /* filled, in BATCH_UNDER and BATCH_OVER */
+	XGlyphElt32 *elt; /* a glyph each, at absolute positions until sent */
+	unsigned int *gid;
+	int n, cap;
+} Batch;
+
+/* A colour glyph, left to Xft as the glyph set only has coverage */
+typedef struct {
+	XftGlyphFontSpec spec;
+	Color fg;
+	XRectangle clip;
+} XftGlyph;
+
+/* A font found by fontconfig in an earlier run */
+typedef struct {
+	char kind; /* 'S' for the font of a style, 'F' for a fallback */
+	double size; /* the size asked of xloadfonts(), or the pixel size for 'F' */
+	int flags; /* the style, FRC_* */
+	Rune u; /* the rune a fallback was found for */
+	int width; /* the average width of a style's ascii */
+	int pat; /* index into fontcache.pat */
+} CacheEntry;
+
 static inline ushort sixd_to_16bit(int);
-static int xmakeglyphfontspecs(XftGlyphFontSpec *, const Glyph *, int, int, int);
+static FT_UInt xcharindex(Font *, Rune);
+static void xclearfallbacks(FontSize *);
+static Fallback *xfallbackslot(FontSize *, Rune, int);
+static void xfallbackset(FontSize *, Rune, int, int, FT_UInt);
+static int xfallbackfind(FontSize *, int, Rune, FT_UInt *);
+static FcPattern *xfallbackmatch(FcPattern *, FcFontSet **, Rune);
+static int xfallbackopen(FontSize *, FcPattern *, int, Rune, FT_UInt *);
+static void *xfallbackwork(void *);
+static void xfallbackstart(void);
+static int xfallbackqueue(Font *, int, Rune);
+static int xfallbackdone(void);
+static void xfallbackprefetch(void);
+static XftFont *xfallback(Font *, int, Rune, FT_UInt *);
+static long long xcachestamp(void);
+static void xcacheload(void);
+static void xcachesave(void);
+static CacheEntry *xcachefind(char, double, int, Rune);
+static void xcacheadd(char, double, int, Rune, int, FcPattern *);
+static int xmaskshift(unsigned long);
+static int xshmerror(Display *, XErrorEvent *);
+static Bool xshmdone(Display *, XEvent *, XPointer);
+static int xshminit(void);
+static void xshmfree(void);
+static void xshmwait(void);
+static void xnewbuf(void);
+static void xatlasclear(void);
+static void xatlasraster(AtlasGlyph *, XftFont *, FT_UInt);
+static AtlasGlyph *xatlasslot(XftFont *, FT_UInt);
+static AtlasGlyph *xatlasglyph(XftFont *, FT_UInt);
+static uint32_t xblend(uint32_t, uint32_t, uint32_t, uint32_t, uint32_t);
+static void xrenderinit(void);
+static void xrenderupload(AtlasGlyph *);
+static Batch *xbatch(int, Color *);
+static void xbatchrect(int, Color *, int, int, int, int);
+static void xbatchclip(int, int, int, int);
+static void xflushbatch(void);
+static void xfillrect(Color *, int, int, int, int);
+static void xdrawrect(Color *, int, int, int, int);
+static void xdrawspecs(Color *, const XftGlyphFontSpec *, int, int, int, int, int);
+static int xmakeglyphfontspecs(XftGlyphFontSpec *, const Rune *, const uchar *, int, int, int);
 static void xdrawglyphfontspecs(const XftGlyphFontSpec *, Glyph, int, int, int);
 static void xdrawglyph(Glyph, int, int);
 static void xclear(int, int, int, int);
@@ -152,13 +306,18 @@ static void cresize(int, int);
 static void xresize(int, int);
 static void xhints(void);
 static int xloadcolor(int, const char *, Color *);
-static int xloadfont(Font *, FcPattern *);
+static int xloadfont(Font *, FcPattern *, double, int);
 static void xloadfonts(char *, double);
+static Font *xstylefont(int);
 static void xunloadfont(Font *);
-static void xunloadfonts(void);
+static void xunloadfonts(FontSize *);
+static void xsetfontsize(FontSize *);
 static void xsetenv(void);
 static void xseturgency(int);
-static void xdodraw(void);
+static void xdodraw(int, int);
+static void xaddlatency(double);
+static int cmpdouble(const void *, const void *);
+static int xcursorblinks(void);
 
 static void expose(XEvent *);
 static void visibility(XEvent *);
@@ -205,28 +364,85 @@ static XSelection xsel;
 static TermWindow win;
 extern char *filename;
 
-/* Font Ring Cache */
-enum {
-	FRC_NORMAL,
-	FRC_ITALIC,
-	FRC_BOLD,
-	FRC_ITALICBOLD
-};
-
-typedef struct {
-	XftFont *font;
-	int flags;
-	Rune unicodep;
-} Fontcache;
-
-/* Fontcache is an array now. A new font will be appended to the array. */
-static Fontcache *frc = NULL;
-static int frclen = 0;
-static int frccap = 0;
+#define FRC_MAX 64 /* fallback fonts open for each size */
+static unsigned long frcclock = 0;
+
+/* the sizes zoomed to recently, so zooming back to one doesn't load it */
+static FontSize *sizes[4];
+static unsigned long fontclock = 0;
+static unsigned long fontgen = 0;
+
+/* fallback fonts are matched on a worker thread, done jobs write to the pipe */
+static struct {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int pipe[2];
+	FallbackJob job[256];
+	size_t head, next, tail; /* done, being matched and queued jobs */
+} fcq;
 static char *usedfont = NULL;
 static double usedfontsize = 0;
 static double defaultfontsize = 0;
 
+/* fonts found in earlier runs, see xcacheload() */
+static struct {
+	char *path;
+	long long stamp;
+	char **pat; /* unparsed match patterns */
+	size_t npat;
+	CacheEntry *e;
+	size_t n, cap;
+	int dirty;
+	int hits, misses; /* style fonts loaded from it or matched this run */
+} fontcache;
+
+/* when main() started and how long until the fonts and the first frame */
+static struct {
+	struct timespec start;
+	double fonts, frame;
+	int loaded, cached; /* styles opened by then, and found in the font cache */
+} startup;
+
+/* input latency of the last frames that had a key press, in ms */
+static struct {
+	double ms[1024];
+	size_t n;
+} latency;
+
+/* set by xshmerror() if the server can't attach the shared memory */
+static int shmfailed;
+
+/* glyphs rasterized for the shared memory buffer, see xatlasglyph() */
+#define ATLAS_MAX (16 << 20) /* bytes of bitmaps kept before starting over */
+static struct {
+	AtlasGlyph *g;
+	size_t n, cap; /* cap is a power of two */
+	uchar *data;
+	size_t len, size;
+} atlas;
+
+/* the frame being drawn with XRender, sent by xflushbatch() */
+static struct {
+	Batch *b;
+	int n, cap;
+	XRectangle *clip; /* where the text is drawn, it isn't drawn outside */
+	int nclip, clipcap;
+	XftGlyph *xft;
+	int nxft, xftcap;
+} batch;
+
+/* X requests sent for each frame, for drawstats */
+static struct {
+	unsigned long last, total, frames;
+} reqstat;
+
+/* time spent building glyph specs, for drawstats */
+static struct {
+	double ns;
+	unsigned long cells;
+} specstat;
+
 static char *opt_line  = NULL;
 static char *opt_embed = NULL;
 static char *title = NULL;
@@ -297,8 +513,17 @@ zoom(const Arg *arg)
 void
 zoomabs(const Arg *arg)
 {
-	xunloadfonts();
-	xloadfonts(usedfont, arg->f);
+	size_t i;
+
+	for (i = 0; i < LEN(sizes); i++) {
+		if (sizes[i] && (sizes[i]->size == arg->f ||
+		    sizes[i]->pixelsize == arg->f))
+			break;
+	}
+	if (i < LEN(sizes))
+		xsetfontsize(sizes[i]);
+	else
+		xloadfonts(usedfont, arg->f);
 	cresize(0, 0);
 	redraw();
 	xhints();
@@ -492,16 +717,343 @@ xresize(int col, int row)
 	win.tw = col * win.cw;
 	win.th = row * win.ch;
 
-	XFreePixmap(xw.dpy, xw.buf);
-	xw.buf = XCreatePixmap(xw.dpy, xw.win, win.w, win.h,
-			DefaultDepth(xw.dpy, xw.scr));
-	XftDrawChange(xw.draw, xw.buf);
+	xnewbuf();
 	xclear(0, 0, win.w, win.h);
 
 	/* resize to new width */
 	xw.specbuf = urealloc(xw.specbuf, col * sizeof(GlyphFontSpec));
 }
 
+int
+xmaskshift(unsigned long mask)
+{
+	int shift = 0;
+
+	if (!mask)
+		return -1;
+	for (; !(mask & 1); mask >>= 1)
+		shift++;
+	return mask == 0xff ? shift : -1;
+}
+
+int
+xshmerror(Display *dpy, XErrorEvent *ev)
+{
+	(void)dpy;
+	(void)ev;
+	shmfailed = 1;
+	return 0;
+}
+
+Bool
+xshmdone(Display *dpy, XEvent *ev, XPointer arg)
+{
+	(void)dpy;
+	(void)arg;
+	return ev->type == xw.shmcompletion;
+}
+
+/*
+ * Put the buffer in shared memory with the server, for drawing into
+ * client-side. Returns 0 if the server can't, such as over the network, or
+ * the visual's pixels aren't 32 bit with 8 bit channels.
+ */
+int
+xshminit(void)
+{
+	XImage *img;
+	XErrorHandler old;
+	int one = 1;
+
+	if (!XShmQueryExtension(xw.dpy) || xw.vis->class != TrueColor)
+		return 0;
+	xw.rshift = xmaskshift(xw.vis->red_mask);
+	xw.gshift = xmaskshift(xw.vis->green_mask);
+	xw.bshift = xmaskshift(xw.vis->blue_mask);
+	if (xw.rshift < 0 || xw.gshift < 0 || xw.bshift < 0)
+		return 0;
+
+	img = XShmCreateImage(xw.dpy, xw.vis, DefaultDepth(xw.dpy, xw.scr),
+			ZPixmap, NULL, &xw.shminfo, win.w, win.h);
+	if (!img)
+		return 0;
+	if (img->bits_per_pixel != 32 ||
+	    img->byte_order != (*(char *)&one ? LSBFirst : MSBFirst)) {
+		XDestroyImage(img);
+		return 0;
+	}
+	xw.shminfo.shmid = shmget(IPC_PRIVATE,
+			(size_t)img->bytes_per_line * img->height, IPC_CREAT | 0600);
+	if (xw.shminfo.shmid < 0) {
+		XDestroyImage(img);
+		return 0;
+	}
+	xw.shminfo.shmaddr = img->data = shmat(xw.shminfo.shmid, NULL, 0);
+	xw.shminfo.readOnly = False;
+	if (img->data == (char *)-1) {
+		shmctl(xw.shminfo.shmid, IPC_RMID, NULL);
+		XDestroyImage(img);
+		return 0;
+	}
+
+	/* attaching fails with an error rather than a reply */
+	XSync(xw.dpy, False);
+	shmfailed = 0;
+	old = XSetErrorHandler(xshmerror);
+	XShmAttach(xw.dpy, &xw.shminfo);
+	XSync(xw.dpy, False);
+	XSetErrorHandler(old);
+	/* the segment goes away once both sides have detached */
+	shmctl(xw.shminfo.shmid, IPC_RMID, NULL);
+	if (shmfailed) {
+		shmdt(xw.shminfo.shmaddr);
+		XDestroyImage(img);
+		return 0;
+	}
+
+	xw.img = img;
+	xw.shmcompletion = XShmGetEventBase(xw.dpy) + ShmCompletion;
+	return 1;
+}
+
+void
+xshmfree(void)
+{
+	if (!xw.img)
+		return;
+	xshmwait();
+	XShmDetach(xw.dpy, &xw.shminfo);
+	XSync(xw.dpy, False);
+	shmdt(xw.shminfo.shmaddr);
+	XDestroyImage(xw.img);
+	xw.img = NULL;
+}
+
+/*
+ * Wait for the server to be done reading the image before drawing into it
+ * again. The completion events run() reads count too.
+ */
+void
+xshmwait(void)
+{
+	XEvent ev;
+
+	for (; xw.shmpending > 0; xw.shmpending--)
+		XIfEvent(xw.dpy, &ev, xshmdone, NULL);
+}
+
+/* make the buffer the size of the window */
+void
+xnewbuf(void)
+{
+	xflushbatch();
+
+	/* zooming keeps the window the same size, and so the buffer;
+	 * the caller clears it, so let the server finish reading it */
+	if ((xw.img || xw.buf) && xw.bufw == win.w && xw.bufh == win.h) {
+		xshmwait();
+		return;
+	}
+	xw.bufw = win.w;
+	xw.bufh = win.h;
+
+	/* in shared memory if it worked before, or is to be tried first */
+	if (xw.img || (!xw.buf && xshm)) {
+		xshmfree();
+		if (xshminit())
+			return;
+	}
+
+	/* the glyphs drawn into shared memory weren't uploaded */
+	if (xw.buf)
+		XFreePixmap(xw.dpy, xw.buf);
+	else
+		xatlasclear();
+	xw.buf = XCreatePixmap(xw.dpy, xw.win, win.w, win.h,
+			DefaultDepth(xw.dpy, xw.scr));
+	if (xw.draw)
+		XftDrawChange(xw.draw, xw.buf);
+	else
+		xw.draw = XftDrawCreate(xw.dpy, xw.buf, xw.vis, xw.cmap);
+	xrenderinit();
+}
+
+/* draw into the pixmap with XRender if the server has it, see xflushbatch() */
+void
+xrenderinit(void)
+{
+	XRenderPictFormat *fmt;
+	int event, error;
+
+	if (xw.pict) {
+		XRenderFreePicture(xw.dpy, xw.pict);
+		xw.pict = 0;
+	}
+	if (!XRenderQueryExtension(xw.dpy, &event, &error) ||
+	    !(fmt = XRenderFindVisualFormat(xw.dpy, xw.vis)) ||
+	    !(xw.a8 = XRenderFindStandardFormat(xw.dpy, PictStandardA8)))
+		return;
+	xw.pict = XRenderCreatePicture(xw.dpy, xw.buf, fmt, 0, NULL);
+	if (!xw.glyphset)
+		xw.glyphset = XRenderCreateGlyphSet(xw.dpy, xw.a8);
+}
+
+void
+xrenderupload(AtlasGlyph *g)
+{
+	XGlyphInfo info = {
+		.width = g->w, .height = g->h, .x = -g->x, .y = -g->y
+	};
+	XID gid = g->gid;
+	int stride = (g->w + 3) & ~3, r;
+	char *buf = umalloc(stride * g->h);
+
+	/* the rows of A8 glyphs are padded to 32 bits */
+	memset(buf, 0, stride * g->h);
+	for (r = 0; r < g->h; r++)
+		memcpy(buf + r * stride, atlas.data + g->off + r * g->w, g->w);
+	XRenderAddGlyphs(xw.dpy, xw.glyphset, &gid, &info, 1, buf, stride * g->h);
+	free(buf);
+}
+
+/* the batch of a colour in a layer, made the first time it's drawn in */
+Batch *
+xbatch(int layer, Color *c)
+{
+	Batch *b;
+	int i;
+
+	for (i = 0; i < batch.n; i++) {
+		b = &batch.b[i];
+		if (b->layer == layer &&
+		    !memcmp(&b->color, &c->color, sizeof(b->color)))
+			return b;
+	}
+	if (batch.n == batch.cap) {
+		batch.cap = MAX(16, 2 * batch.cap);
+		batch.b = urealloc(batch.b, batch.cap * sizeof(Batch));
+	}
+	b = &batch.b[batch.n++];
+	memset(b, 0, sizeof(*b));
+	b->layer = layer;
+	b->color = c->color;
+	if (layer == BATCH_TEXT)
+		b->src = XRenderCreateSolidFill(xw.dpy, &b->color);
+	return b;
+}
+
+void
+xbatchrect(int layer, Color *c, int x, int y, int w, int h)
+{
+	Batch *b;
+
+	if (w <= 0 || h <= 0)
+		return;
+	b = xbatch(layer, c);
+	if (b->n == b->cap) {
+		b->cap = MAX(64, 2 * b->cap);
+		b->r = urealloc(b->r, b->cap * sizeof(XRectangle));
+	}
+	b->r[b->n++] = (XRectangle){ x, y, w, h };
+}
+
+void
+xbatchclip(int x, int y, int w, int h)
+{
+	XRectangle *r = batch.nclip ? &batch.clip[batch.nclip - 1] : NULL;
+
+	/* the runs of a row are drawn left to right, they make one rectangle */
+	if (r && r->y == y && r->height == h && r->x + r->width == x) {
+		r->width += w;
+		return;
+	}
+	if (batch.nclip == batch.clipcap) {
+		batch.clipcap = MAX(64, 2 * batch.clipcap);
+		batch.clip = urealloc(batch.clip, batch.clipcap * sizeof(XRectangle));
+	}
+	batch.clip[batch.nclip++] = (XRectangle){ x, y, w, h };
+}
+
+/*
+ * Send what was drawn since the last flush: the backgrounds of each colour
+ * in a request, the text of each colour clipped to the runs it was drawn in,
+ * then the lines and cursor over it. Cells drawn over in the same frame need
+ * a flush in between, as the layers of different colours aren't in order.
+ */
+void
+xflushbatch(void)
+{
+	XRenderPictureAttributes noclip = { .clip_mask = None };
+	XRectangle r;
+	XftGlyph *xg;
+	Batch *b;
+	int layer, i, j, x, y, px, py;
+
+	if (!xw.pict)
+		return;
+
+	for (layer = BATCH_UNDER; layer <= BATCH_OVER; layer++) {
+		if (layer == BATCH_TEXT && batch.nclip) {
+			XRenderSetPictureClipRectangles(xw.dpy, xw.pict, 0, 0,
+					batch.clip, batch.nclip);
+		}
+		for (i = 0; i < batch.n; i++) {
+			b = &batch.b[i];
+			if (b->layer != layer || !b->n)
+				continue;
+			if (layer != BATCH_TEXT) {
+				XRenderFillRectangles(xw.dpy, PictOpSrc, xw.pict,
+						&b->color, b->r, b->n);
+				b->n = 0;
+				continue;
+			}
+			/* the glyphs don't advance, each is offset from the last */
+			for (j = px = py = 0; j < b->n; j++) {
+				x = b->elt[j].xOff;
+				y = b->elt[j].yOff;
+				b->elt[j].glyphset = xw.glyphset;
+				b->elt[j].chars = &b->gid[j];
+				b->elt[j].nchars = 1;
+				b->elt[j].xOff = x - px;
+				b->elt[j].yOff = y - py;
+				px = x;
+				py = y;
+			}
+			XRenderCompositeText32(xw.dpy, PictOpOver, b->src, xw.pict,
+					NULL, 0, 0, 0, 0, b->elt, b->n);
+			b->n = 0;
+		}
+		if (layer != BATCH_TEXT)
+			continue;
+		if (batch.nclip)
+			XRenderChangePicture(xw.dpy, xw.pict, CPClipMask, &noclip);
+
+		for (i = 0; i < batch.nxft; i++) {
+			xg = &batch.xft[i];
+			r = (XRectangle){ 0, 0, xg->clip.width, xg->clip.height };
+			XftDrawSetClipRectangles(xw.draw, xg->clip.x, xg->clip.y, &r, 1);
+			XftDrawGlyphFontSpec(xw.draw, &xg->fg, &xg->spec, 1);
+		}
+		if (batch.nxft)
+			XftDrawSetClip(xw.draw, 0);
+	}
+	batch.nclip = 0;
+	batch.nxft = 0;
+
+	/* truecolour text can leave many colours behind */
+	if (batch.n > 64) {
+		for (i = 0; i < batch.n; i++) {
+			b = &batch.b[i];
+			if (b->src)
+				XRenderFreePicture(xw.dpy, b->src);
+			free(b->r);
+			free(b->elt);
+			free(b->gid);
+		}
+		batch.n = 0;
+	}
+}
+
 ushort
 sixd_to_16bit(int x)
 {
@@ -533,13 +1085,16 @@ xloadcols(void)
 		for (cp = dc.col; cp < &dc.col[dc.collen]; ++cp)
 			XftColorFree(xw.dpy, xw.vis, xw.cmap, cp);
 	} else {
-		dc.collen = 2;
+		dc.collen = LEN(colorname);
 		dc.col = umalloc(dc.collen * sizeof(Color));
 	}
 
 	for (i = 0; i < (int)dc.collen; i++)
-		if (!xloadcolor(i, NULL, &dc.col[i])) {
-			udie("could not allocate color %d\n", i);
+		if (!xloadcolor(i, colorname[i], &dc.col[i])) {
+			if (colorname[i])
+				udie("could not allocate color '%s'\n", colorname[i]);
+			else
+				udie("could not allocate color %d\n", i);
 		}
 	loaded = 1;
 }
@@ -567,8 +1122,7 @@ xsetcolorname(int x, const char *name)
 void
 xclear(int x1, int y1, int x2, int y2)
 {
-	XftDrawRect(xw.draw,
-			&dc.col[IS_SET(MODE_REVERSE)? defaultfg : defaultbg],
+	xfillrect(&dc.col[IS_SET(MODE_REVERSE)? defaultfg : defaultbg],
 			x1, y1, x2-x1, y2-y1);
 }
 
@@ -624,12 +1178,13 @@ xgeommasktogravity(int mask)
 }
 
 int
-xloadfont(Font *f, FcPattern *pattern)
+xloadfont(Font *f, FcPattern *pattern, double size, int style)
 {
 	FcPattern *configured;
 	FcPattern *match;
 	FcResult result;
 	XGlyphInfo extents;
+	CacheEntry *e;
 	int wantattr, haveattr;
 
 	/*
@@ -644,16 +1199,30 @@ xloadfont(Font *f, FcPattern *pattern)
 	FcConfigSubstitute(NULL, configured, FcMatchPattern);
 	XftDefaultSubstitute(xw.dpy, xw.scr, configured);
 
-	match = FcFontMatch(NULL, configured, &result);
-	if (!match) {
-		FcPatternDestroy(configured);
-		return 1;
+	/* a font from the cache may have been removed since */
+	f->match = NULL;
+	f->badslant = f->badweight = 0;
+	if ((e = xcachefind('S', size, style, 0)) &&
+	    (match = FcNameParse((FcChar8 *)fontcache.pat[e->pat]))) {
+		if (!(f->match = XftFontOpenPattern(xw.dpy, match)))
+			FcPatternDestroy(match);
 	}
+	if (f->match) {
+		fontcache.hits++;
+	} else {
+		e = NULL;
+		match = FcFontMatch(NULL, configured, &result);
+		if (!match) {
+			FcPatternDestroy(configured);
+			return 1;
+		}
 
-	if (!(f->match = XftFontOpenPattern(xw.dpy, match))) {
-		FcPatternDestroy(configured);
-		FcPatternDestroy(match);
-		return 1;
+		if (!(f->match = XftFontOpenPattern(xw.dpy, match))) {
+			FcPatternDestroy(configured);
+			FcPatternDestroy(match);
+			return 1;
+		}
+		fontcache.misses++;
 	}
 
 	if ((XftPatternGetInteger(pattern, "slant", 0, &wantattr) ==
@@ -678,12 +1247,19 @@ xloadfont(Font *f, FcPattern *pattern)
 		}
 	}
 
-	XftTextExtentsUtf8(xw.dpy, f->match,
-		(const FcChar8 *) ascii_printable,
-		strlen(ascii_printable), &extents);
+	if (e) {
+		extents.xOff = e->width;
+	} else {
+		XftTextExtentsUtf8(xw.dpy, f->match,
+			(const FcChar8 *) ascii_printable,
+			strlen(ascii_printable), &extents);
+		xcacheadd('S', size, style, 0, extents.xOff, f->match->pattern);
+	}
 
 	f->set = NULL;
 	f->pattern = configured;
+	memset(f->latin1, 0, sizeof(f->latin1));
+	memset(f->glyphs, 0, sizeof(f->glyphs));
 
 	f->ascent = f->match->ascent;
 	f->descent = f->match->descent;
@@ -700,7 +1276,9 @@ void
 xloadfonts(char *fontstr, double fontsize)
 {
 	FcPattern *pattern;
+	FontSize *fs;
 	double fontval;
+	size_t i, lru = 0;
 
 	if (fontstr[0] == '-')
 		pattern = XftXlfdParse(fontstr, False, False);
@@ -733,112 +1311,376 @@ xloadfonts(char *fontstr, double fontsize)
 		defaultfontsize = usedfontsize;
 	}
 
-	if (xloadfont(&dc.font, pattern))
+	fs = umalloc(sizeof(*fs));
+	memset(fs, 0, sizeof(*fs));
+	if (xloadfont(&fs->font, pattern, fontsize, FRC_NORMAL))
 		udie("can't open font %s\n", fontstr);
 
 	if (usedfontsize < 0) {
-		FcPatternGetDouble(dc.font.match->pattern,
+		FcPatternGetDouble(fs->font.match->pattern,
 		                   FC_PIXEL_SIZE, 0, &fontval);
 		usedfontsize = fontval;
 		if (fontsize == 0)
 			defaultfontsize = fontval;
 	}
 
-	/* Setting character width and height. */
-	win.cw = ceilf(dc.font.width * cwscale);
-	win.ch = ceilf(dc.font.height * chscale);
+	fs->pattern = pattern;
+	fs->size = fontsize;
+	fs->pixelsize = usedfontsize;
+	fs->gen = ++fontgen;
 
-	FcPatternDel(pattern, FC_SLANT);
-	FcPatternAddInteger(pattern, FC_SLANT, FC_SLANT_ITALIC);
-	if (xloadfont(&dc.ifont, pattern))
-		udie("can't open font %s\n", fontstr);
+	/* make room by unloading the size zoomed to longest ago */
+	for (i = 0; i < LEN(sizes) && sizes[i]; i++) {
+		if (sizes[i]->used < sizes[lru]->used)
+			lru = i;
+	}
+	if (i == LEN(sizes)) {
+		xunloadfonts(sizes[lru]);
+		i = lru;
+	}
+	sizes[i] = fs;
 
-	FcPatternDel(pattern, FC_WEIGHT);
-	FcPatternAddInteger(pattern, FC_WEIGHT, FC_WEIGHT_BOLD);
-	if (xloadfont(&dc.ibfont, pattern))
-		udie("can't open font %s\n", fontstr);
+	xsetfontsize(fs);
+	xcachesave();
+	xfallbackprefetch();
+}
 
-	FcPatternDel(pattern, FC_SLANT);
-	FcPatternAddInteger(pattern, FC_SLANT, FC_SLANT_ROMAN);
-	if (xloadfont(&dc.bfont, pattern))
-		udie("can't open font %s\n", fontstr);
+void
+xsetfontsize(FontSize *fs)
+{
+	dc.fs = fs;
+	fs->used = ++fontclock;
+	usedfontsize = fs->pixelsize;
+
+	/* Setting character width and height. */
+	win.cw = ceilf(fs->font.width * cwscale);
+	win.ch = ceilf(fs->font.height * chscale);
+}
 
+Font *
+xstylefont(int flags)
+{
+	FontSize *fs = dc.fs;
+	Font *f = flags == FRC_ITALICBOLD ? &fs->ibfont : flags == FRC_ITALIC ?
+		&fs->ifont : flags == FRC_BOLD ? &fs->bfont : &fs->font;
+	FcPattern *pattern;
+
+	if (f->match)
+		return f;
+	if (!(pattern = FcPatternDuplicate(fs->pattern)))
+		udie("can't open font %s\n", usedfont);
+	FcPatternDel(pattern, FC_SLANT);
+	FcPatternAddInteger(pattern, FC_SLANT, flags == FRC_ITALIC ||
+			flags == FRC_ITALICBOLD ? FC_SLANT_ITALIC : FC_SLANT_ROMAN);
+	if (flags == FRC_BOLD || flags == FRC_ITALICBOLD) {
+		FcPatternDel(pattern, FC_WEIGHT);
+		FcPatternAddInteger(pattern, FC_WEIGHT, FC_WEIGHT_BOLD);
+	}
+	if (xloadfont(f, pattern, fs->size, flags))
+		udie("can't open font %s\n", usedfont);
 	FcPatternDestroy(pattern);
+	xcachesave();
+	return f;
 }
 
 void
 xunloadfont(Font *f)
 {
+	/* a style that was never drawn was never opened */
+	if (!f->match)
+		return;
 	XftFontClose(xw.dpy, f->match);
+	f->match = NULL;
+	xatlasclear();
 	FcPatternDestroy(f->pattern);
 	if (f->set)
 		FcFontSetDestroy(f->set);
 }
 
 void
-xunloadfonts(void)
+xunloadfonts(FontSize *fs)
 {
 	/* Free the loaded fonts in the font cache.  */
-	while (frclen > 0)
-		XftFontClose(xw.dpy, frc[--frclen].font);
-
-	xunloadfont(&dc.font);
-	xunloadfont(&dc.bfont);
-	xunloadfont(&dc.ifont);
-	xunloadfont(&dc.ibfont);
+	while (fs->frclen > 0)
+		XftFontClose(xw.dpy, fs->frc[--fs->frclen].font);
+	free(fs->frc);
+	xatlasclear();
+
+	xunloadfont(&fs->font);
+	xunloadfont(&fs->bfont);
+	xunloadfont(&fs->ifont);
+	xunloadfont(&fs->ibfont);
+	FcPatternDestroy(fs->pattern);
+	free(fs);
 }
 
-void
-ximopen(Display *dpy)
+long long
+xcachestamp(void)
 {
-	(void)dpy;
-	XIMCallback destroy = { .client_data = NULL, .callback = ximdestroy };
+	FcStrList *l;
+	FcChar8 *path;
+	struct stat st;
+	long long stamp = 0;
+	int i;
 
-	if ((xw.xim = XOpenIM(xw.dpy, NULL, NULL, NULL)) == NULL) {
-		XSetLocaleModifiers("@im=local");
-		if ((xw.xim = XOpenIM(xw.dpy, NULL, NULL, NULL)) == NULL) {
-			XSetLocaleModifiers("@im=");
-			if ((xw.xim = XOpenIM(xw.dpy, NULL, NULL, NULL)) == NULL)
-				udie("XOpenIM failed. Could not open input device.\n");
+	/* the newest of fontconfig's configuration files and font directories */
+	for (i = 0; i < 2; i++) {
+		l = i ? FcConfigGetFontDirs(NULL) : FcConfigGetConfigFiles(NULL);
+		if (!l)
+			continue;
+		while ((path = FcStrListNext(l))) {
+			if (!stat((char *)path, &st))
+				stamp = MAX(stamp, (long long)st.st_mtime);
 		}
+		FcStrListDone(l);
 	}
-	if (XSetIMValues(xw.xim, XNDestroyCallback, &destroy, NULL) != NULL)
-		udie("XSetIMValues failed. Could not set input method value.\n");
-	xw.xic = XCreateIC(xw.xim, XNInputStyle, XIMPreeditNothing | XIMStatusNothing,
-				XNClientWindow, xw.win, XNFocusWindow, xw.win, NULL);
-	if (xw.xic == NULL)
-		udie("XCreateIC failed. Could not obtain input method.\n");
+	return stamp;
 }
 
+/*
+ * The fonts fontconfig finds are written to a file, so that the next run with
+ * the same font and fontconfig setup opens them straight away:
+ *
+ *	cdoedit font cache
+ *	<font>
+ *	<stamp>
+ *	P <unparsed pattern>
+ *	S <size> <style> <width> <pattern number>
+ *	F <pixel size> <style> <rune> <pattern number>
+ */
 void
-ximinstantiate(Display *dpy, XPointer client, XPointer call)
+xcacheload(void)
 {
-	(void)client;
-	(void)call;
-	ximopen(dpy);
-	XUnregisterIMInstantiateCallback(xw.dpy, NULL, NULL, NULL,
-					ximinstantiate, NULL);
-}
+	char buf[4096], *home, *dir;
+	size_t len;
+	CacheEntry e;
+	FILE *file;
+	uint u;
+	int line;
+
+	if (!fontcachename)
+		return;
+	if ((dir = getenv("XDG_CACHE_HOME")) && dir[0]) {
+		len = strlen(dir) + strlen(fontcachename) + 2;
+		fontcache.path = umalloc(len);
+		snprintf(fontcache.path, len, "%s/%s", dir, fontcachename);
+	} else if ((home = getenv("HOME"))) {
+		len = strlen(home) + strlen(fontcachename) + 9;
+		fontcache.path = umalloc(len);
+		snprintf(fontcache.path, len, "%s/.cache/%s", home, fontcachename);
+	} else {
+		return;
+	}
+	fontcache.stamp = xcachestamp();
 
-void
-ximdestroy(XIM xim, XPointer client, XPointer call)
-{
-	(void)xim;
-	(void)client;
-	(void)call;
-	xw.xim = NULL;
-	XRegisterIMInstantiateCallback(xw.dpy, NULL, NULL, NULL,
-					ximinstantiate, NULL);
+	if (!(file = fopen(fontcache.path, "r")))
+		return;
+	for (line = 0; fgets(buf, sizeof(buf), file); line++) {
+		len = strlen(buf);
+		if (!len || buf[len - 1] != '\n')
+			break;
+		buf[--len] = '\0';
+		if ((line == 0 && strcmp(buf, "cdoedit font cache")) ||
+		    (line == 1 && strcmp(buf, usedfont)) ||
+		    (line == 2 && strtoll(buf, NULL, 10) != fontcache.stamp))
+			break;
+		if (line < 3)
+			continue;
+
+		memset(&e, 0, sizeof(e));
+		e.kind = buf[0];
+		if (buf[0] == 'P' && buf[1] == ' ') {
+			fontcache.pat = urealloc(fontcache.pat,
+					(fontcache.npat + 1) * sizeof(char *));
+			fontcache.pat[fontcache.npat++] = ustrdup(buf + 2);
+			continue;
+		} else if (buf[0] == 'S' && sscanf(buf + 1, "%lf %d %d %d",
+				&e.size, &e.flags, &e.width, &e.pat) == 4) {
+		} else if (buf[0] == 'F' && sscanf(buf + 1, "%lf %d %x %d",
+				&e.size, &e.flags, &u, &e.pat) == 4) {
+			e.u = u;
+		} else {
+			continue;
+		}
+		if (e.pat < 0 || (size_t)e.pat >= fontcache.npat)
+			continue;
+		if (fontcache.n >= fontcache.cap) {
+			fontcache.cap = MAX(16, 2 * fontcache.cap);
+			fontcache.e = urealloc(fontcache.e,
+					fontcache.cap * sizeof(CacheEntry));
+		}
+		fontcache.e[fontcache.n++] = e;
+	}
+	fclose(file);
+
+	/* a cache for another font or setup is replaced on the next save */
+	if (line < 3) {
+		while (fontcache.npat > 0)
+			free(fontcache.pat[--fontcache.npat]);
+		fontcache.n = 0;
+	}
 }
 
 void
-xinit(int cols, int rows)
+xcachesave(void)
 {
-	XGCValues gcvalues;
-	Cursor cursor;
+	char *tmp, *p;
+	size_t i, len;
+	FILE *file;
+
+	if (!fontcache.path || !fontcache.dirty)
+		return;
+	fontcache.dirty = 0;
+
+	/* make the directories it goes in, the rest of the path exists */
+	for (p = strchr(fontcache.path + 1, '/'); p; p = strchr(p + 1, '/')) {
+		*p = '\0';
+		mkdir(fontcache.path, 0755);
+		*p = '/';
+	}
+
+	/* write it beside the old one and move it over so it's never half written */
+	len = strlen(fontcache.path) + 5;
+	tmp = umalloc(len);
+	snprintf(tmp, len, "%s.tmp", fontcache.path);
+	if (!(file = fopen(tmp, "w"))) {
+		free(tmp);
+		return;
+	}
+	fprintf(file, "cdoedit font cache\n%s\n%lld\n", usedfont, fontcache.stamp);
+	for (i = 0; i < fontcache.npat; i++)
+		fprintf(file, "P %s\n", fontcache.pat[i]);
+	for (i = 0; i < fontcache.n; i++) {
+		if (fontcache.e[i].kind == 'S') {
+			fprintf(file, "S %.17g %d %d %d\n", fontcache.e[i].size,
+					fontcache.e[i].flags, fontcache.e[i].width,
+					fontcache.e[i].pat);
+		} else {
+			fprintf(file, "F %.17g %d %x %d\n", fontcache.e[i].size,
+					fontcache.e[i].flags, (uint)fontcache.e[i].u,
+					fontcache.e[i].pat);
+		}
+	}
+	if (fclose(file) || rename(tmp, fontcache.path))
+		unlink(tmp);
+	free(tmp);
+}
+
+CacheEntry *
+xcachefind(char kind, double size, int flags, Rune u)
+{
+	size_t i;
+
+	for (i = 0; i < fontcache.n; i++) {
+		if (fontcache.e[i].kind == kind && fontcache.e[i].size == size &&
+		    fontcache.e[i].flags == flags && fontcache.e[i].u == u)
+			return &fontcache.e[i];
+	}
+	return NULL;
+}
+
+void
+xcacheadd(char kind, double size, int flags, Rune u, int width, FcPattern *match)
+{
+	FcPattern *p;
+	FcChar8 *name;
+	CacheEntry *e;
+	size_t i;
+
+	if (!fontcache.path || xcachefind(kind, size, flags, u))
+		return;
+
+	/* Xft works the character set out from the file when it's missing */
+	if (!(p = FcPatternDuplicate(match)))
+		return;
+	FcPatternDel(p, FC_CHARSET);
+	FcPatternDel(p, FC_LANG);
+	name = FcNameUnparse(p);
+	FcPatternDestroy(p);
+	if (!name)
+		return;
+	if (strchr((char *)name, '\n') || strlen((char *)name) > 4000) {
+		free(name);
+		return;
+	}
+
+	for (i = 0; i < fontcache.npat; i++) {
+		if (!strcmp(fontcache.pat[i], (char *)name))
+			break;
+	}
+	if (i == fontcache.npat) {
+		fontcache.pat = urealloc(fontcache.pat,
+				(fontcache.npat + 1) * sizeof(char *));
+		fontcache.pat[fontcache.npat++] = ustrdup((char *)name);
+	}
+	free(name);
+
+	if (fontcache.n >= fontcache.cap) {
+		fontcache.cap = MAX(16, 2 * fontcache.cap);
+		fontcache.e = urealloc(fontcache.e, fontcache.cap * sizeof(CacheEntry));
+	}
+	e = &fontcache.e[fontcache.n++];
+	e->kind = kind;
+	e->size = size;
+	e->flags = flags;
+	e->u = u;
+	e->width = width;
+	e->pat = i;
+	fontcache.dirty = 1;
+}
+
+void
+ximopen(Display *dpy)
+{
+	(void)dpy;
+	XIMCallback destroy = { .client_data = NULL, .callback = ximdestroy };
+
+	if ((xw.xim = XOpenIM(xw.dpy, NULL, NULL, NULL)) == NULL) {
+		XSetLocaleModifiers("@im=local");
+		if ((xw.xim = XOpenIM(xw.dpy, NULL, NULL, NULL)) == NULL) {
+			XSetLocaleModifiers("@im=");
+			if ((xw.xim = XOpenIM(xw.dpy, NULL, NULL, NULL)) == NULL)
+				udie("XOpenIM failed. Could not open input device.\n");
+		}
+	}
+	if (XSetIMValues(xw.xim, XNDestroyCallback, &destroy, NULL) != NULL)
+		udie("XSetIMValues failed. Could not set input method value.\n");
+	xw.xic = XCreateIC(xw.xim, XNInputStyle, XIMPreeditNothing | XIMStatusNothing,
+				XNClientWindow, xw.win, XNFocusWindow, xw.win, NULL);
+	if (xw.xic == NULL)
+		udie("XCreateIC failed. Could not obtain input method.\n");
+}
+
+void
+ximinstantiate(Display *dpy, XPointer client, XPointer call)
+{
+	(void)client;
+	(void)call;
+	ximopen(dpy);
+	XUnregisterIMInstantiateCallback(xw.dpy, NULL, NULL, NULL,
+					ximinstantiate, NULL);
+}
+
+void
+ximdestroy(XIM xim, XPointer client, XPointer call)
+{
+	(void)xim;
+	(void)client;
+	(void)call;
+	xw.xim = NULL;
+	XRegisterIMInstantiateCallback(xw.dpy, NULL, NULL, NULL,
+					ximinstantiate, NULL);
+}
+
+void
+xinit(int cols, int rows)
+{
+	XGCValues gcvalues;
+	Cursor cursor;
 	Window parent;
 	pid_t thispid = getpid();
 	XColor xmousefg, xmousebg;
+	struct timespec now;
 
 	if (!(xw.dpy = XOpenDisplay(NULL)))
 		udie("can't open display\n");
@@ -850,7 +1692,13 @@ xinit(int cols, int rows)
 		udie("could not init fontconfig.\n");
 
 	usedfont = font;
+	xcacheload();
+	xfallbackstart();
 	xloadfonts(usedfont, 0);
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	startup.fonts = TIMEDIFF(now, startup.start);
+	startup.loaded = fontcache.hits + fontcache.misses;
+	startup.cached = fontcache.hits;
 
 	/* colors */
 	xw.cmap = XDefaultColormap(xw.dpy, xw.scr);
@@ -883,17 +1731,15 @@ xinit(int cols, int rows)
 	gcvalues.graphics_exposures = False;
 	dc.gc = XCreateGC(xw.dpy, parent, GCGraphicsExposures,
 			&gcvalues);
-	xw.buf = XCreatePixmap(xw.dpy, xw.win, win.w, win.h,
-			DefaultDepth(xw.dpy, xw.scr));
 	XSetForeground(xw.dpy, dc.gc, dc.col[defaultbg].pixel);
-	XFillRectangle(xw.dpy, xw.buf, dc.gc, 0, 0, win.w, win.h);
+
+	/* the buffer, and the Xft rendering context if it's not shared */
+	xnewbuf();
+	xclear(0, 0, win.w, win.h);
 
 	/* font spec buffer */
 	xw.specbuf = umalloc(cols * sizeof(GlyphFontSpec));
 
-	/* Xft rendering context */
-	xw.draw = XftDrawCreate(xw.dpy, xw.buf, xw.vis, xw.cmap);
-
 	/* input methods */
 	ximopen(xw.dpy);
 
@@ -933,48 +1779,689 @@ xinit(int cols, int rows)
 		xsel.xtarget = XA_STRING;
 }
 
+FT_UInt
+xcharindex(Font *f, Rune u)
+{
+	GlyphSlot *s;
+
+	if (u < LEN(f->latin1)) {
+		if (!f->latin1[u])
+			f->latin1[u] = XftCharIndex(xw.dpy, f->match, u) + 1;
+		return f->latin1[u] - 1;
+	}
+	/* runes below 256 never land here, so u is 0 only in empty slots */
+	s = &f->glyphs[u % LEN(f->glyphs)];
+	if (s->u != u) {
+		s->u = u;
+		s->glyph = XftCharIndex(xw.dpy, f->match, u);
+	}
+	return s->glyph;
+}
+
+void
+xclearfallbacks(FontSize *fs)
+{
+	memset(fs->fallback, 0, sizeof(fs->fallback));
+	fs->fallbacklen = 0;
+}
+
+Fallback *
+xfallbackslot(FontSize *fs, Rune u, int flags)
+{
+	Fallback *t = fs->fallback;
+	size_t h = ((uint32_t)u * 2654435761u ^ flags) % LEN(fs->fallback);
+
+	/* the slot for (u, flags), or the empty slot it would go in */
+	while (t[h].f && (t[h].u != u || t[h].flags != flags))
+		h = (h + 1) % LEN(fs->fallback);
+	return &t[h];
+}
+
+void
+xfallbackset(FontSize *fs, Rune u, int flags, int f, FT_UInt glyph)
+{
+	Fallback *s;
+
+	/* Keep the table sparse enough for probing to stay short. */
+	if (fs->fallbacklen >= LEN(fs->fallback) * 3 / 4)
+		xclearfallbacks(fs);
+	s = xfallbackslot(fs, u, flags);
+	if (!s->f)
+		fs->fallbacklen++;
+	s->u = u;
+	s->flags = flags;
+	s->f = f;
+	s->glyph = glyph;
+}
+
 int
-xmakeglyphfontspecs(XftGlyphFontSpec *specs, const Glyph *glyphs, int len, int x, int y)
+xfallbackfind(FontSize *fs, int flags, Rune u, FT_UInt *glyph)
+{
+	Fontcache *frc = fs->frc;
+	int f;
+
+	for (f = 0; f < fs->frclen; f++) {
+		if (frc[f].flags != flags)
+			continue;
+		*glyph = XftCharIndex(xw.dpy, frc[f].font, u);
+		/* Either it has the glyph or it's the font we got for it. */
+		if (*glyph || frc[f].unicodep == u)
+			return f;
+	}
+	return -1;
+}
+
+FcPattern *
+xfallbackmatch(FcPattern *pattern, FcFontSet **set, Rune u)
+{
+	FcResult fcres;
+	FcPattern *fcpattern, *fontpattern;
+	FcFontSet *fcsets[] = { NULL };
+	FcCharSet *fccharset;
+
+	if (!*set)
+		*set = FcFontSort(0, pattern, 1, 0, &fcres);
+	fcsets[0] = *set;
+
+	/*
+	 * Nothing was found in the cache. Now use
+	 * some dozen of Fontconfig calls to get the
+	 * font for one single character.
+	 *
+	 * Xft and fontconfig are design failures.
+	 */
+	fcpattern = FcPatternDuplicate(pattern);
+	fccharset = FcCharSetCreate();
+
+	FcCharSetAddChar(fccharset, u);
+	FcPatternAddCharSet(fcpattern, FC_CHARSET,
+			fccharset);
+	FcPatternAddBool(fcpattern, FC_SCALABLE, 1);
+
+	FcConfigSubstitute(0, fcpattern,
+			FcMatchPattern);
+	FcDefaultSubstitute(fcpattern);
+
+	fontpattern = FcFontSetMatch(0, fcsets, 1,
+			fcpattern, &fcres);
+
+	FcPatternDestroy(fcpattern);
+	FcCharSetDestroy(fccharset);
+
+	return fontpattern;
+}
+
+int
+xfallbackopen(FontSize *fs, FcPattern *match, int flags, Rune u, FT_UInt *glyph)
+{
+	XftFont *font;
+	int f, lru = -1;
+
+	if (!(font = XftFontOpenPattern(xw.dpy, match)))
+		return -1;
+
+	/*
+	 * Past FRC_MAX fonts close the one drawn longest ago. Fonts
+	 * the row being built uses are kept, its specs point at them.
+	 */
+	for (f = 0; fs->frclen >= FRC_MAX && f < fs->frclen; f++) {
+		if (fs->frc[f].used != frcclock &&
+		    (lru < 0 || fs->frc[f].used < fs->frc[lru].used))
+			lru = f;
+	}
+	if (lru >= 0) {
+		f = lru;
+		/* the atlas and the queued colour glyphs point at it */
+		xclearfallbacks(fs);
+		xatlasclear();
+		XftFontClose(xw.dpy, fs->frc[f].font);
+	} else {
+		/* Allocate memory for the new cache entry. */
+		if (fs->frclen >= fs->frccap) {
+			fs->frccap += 16;
+			fs->frc = urealloc(fs->frc, fs->frccap * sizeof(Fontcache));
+		}
+		f = fs->frclen++;
+	}
+
+	fs->frc[f].font = font;
+	fs->frc[f].flags = flags;
+	fs->frc[f].unicodep = u;
+	fs->frc[f].used = frcclock;
+
+	*glyph = XftCharIndex(xw.dpy, font, u);
+	return f;
+}
+
+void *
+xfallbackwork(void *arg)
+{
+	FcPattern *sorted[4] = { NULL };
+	FcFontSet *sets[4] = { NULL };
+	FallbackJob j;
+	FcPattern *match;
+
+	(void)arg;
+	pthread_mutex_lock(&fcq.lock);
+	for (;;) {
+		while (fcq.next == fcq.tail)
+			pthread_cond_wait(&fcq.cond, &fcq.lock);
+		j = fcq.job[fcq.next++ % LEN(fcq.job)];
+		pthread_mutex_unlock(&fcq.lock);
+
+		/* keep the sorted fonts of each style until it's reloaded */
+		if (sorted[j.flags] != j.pattern) {
+			if (sets[j.flags])
+				FcFontSetDestroy(sets[j.flags]);
+			if (sorted[j.flags])
+				FcPatternDestroy(sorted[j.flags]);
+			FcPatternReference(j.pattern);
+			sorted[j.flags] = j.pattern;
+			sets[j.flags] = NULL;
+		}
+		match = xfallbackmatch(j.pattern, &sets[j.flags], j.u);
+		FcPatternDestroy(j.pattern);
+
+		pthread_mutex_lock(&fcq.lock);
+		j.match = match;
+		j.done = 1;
+		fcq.job[(fcq.next - 1) % LEN(fcq.job)] = j;
+		/* the pipe only wakes the run loop up so if it's full that's fine */
+		while (write(fcq.pipe[1], "", 1) < 0 && errno == EINTR);
+	}
+	return NULL;
+}
+
+void
+xfallbackstart(void)
+{
+	int r;
+
+	fcq.pipe[0] = fcq.pipe[1] = -1;
+	pthread_mutex_init(&fcq.lock, NULL);
+	pthread_cond_init(&fcq.cond, NULL);
+	if (pipe(fcq.pipe) < 0) {
+		fprintf(stderr, "pipe failed, matching fallback fonts while drawing: %s\n",
+				strerror(errno));
+		return;
+	}
+	fcntl(fcq.pipe[0], F_SETFL, O_NONBLOCK);
+	fcntl(fcq.pipe[1], F_SETFL, O_NONBLOCK);
+	if ((r = pthread_create(&fcq.thread, NULL, xfallbackwork, NULL))) {
+		fprintf(stderr, "pthread_create failed, matching fallback fonts while drawing: %s\n",
+				strerror(r));
+		close(fcq.pipe[0]);
+		close(fcq.pipe[1]);
+		fcq.pipe[0] = fcq.pipe[1] = -1;
+	}
+}
+
+int
+xfallbackqueue(Font *font, int flags, Rune u)
+{
+	FallbackJob *j;
+	int queued = 0;
+
+	if (fcq.pipe[0] < 0)
+		return 0;
+	pthread_mutex_lock(&fcq.lock);
+	if (fcq.tail - fcq.head < LEN(fcq.job)) {
+		j = &fcq.job[fcq.tail++ % LEN(fcq.job)];
+		j->u = u;
+		j->flags = flags;
+		j->gen = dc.fs->gen;
+		FcPatternReference(font->pattern);
+		j->pattern = font->pattern;
+		j->match = NULL;
+		j->done = 0;
+		pthread_cond_signal(&fcq.cond);
+		queued = 1;
+	}
+	pthread_mutex_unlock(&fcq.lock);
+	return queued;
+}
+
+int
+xfallbackdone(void)
+{
+	char buf[256];
+	FallbackJob j;
+	FontSize *fs;
+	FT_UInt glyph;
+	size_t i;
+	int f, added = 0;
+
+	while (read(fcq.pipe[0], buf, sizeof(buf)) > 0);
+	pthread_mutex_lock(&fcq.lock);
+	while (fcq.head != fcq.next && fcq.job[fcq.head % LEN(fcq.job)].done) {
+		j = fcq.job[fcq.head++ % LEN(fcq.job)];
+		pthread_mutex_unlock(&fcq.lock);
+
+		/* it goes to the size it was asked for, if that's still loaded */
+		for (i = 0, fs = NULL; i < LEN(sizes) && !fs; i++) {
+			if (sizes[i] && sizes[i]->gen == j.gen)
+				fs = sizes[i];
+		}
+		if (!fs) {
+			if (j.match)
+				FcPatternDestroy(j.match);
+		/* another job may have opened a font that has it */
+		} else if ((f = xfallbackfind(fs, j.flags, j.u, &glyph)) >= 0) {
+			if (j.match)
+				FcPatternDestroy(j.match);
+			xfallbackset(fs, j.u, j.flags, f + 1, glyph);
+			xcacheadd('F', fs->pixelsize, j.flags, j.u, 0,
+					fs->frc[f].font->pattern);
+			added |= fs == dc.fs;
+		} else if (j.match) {
+			if ((f = xfallbackopen(fs, j.match, j.flags, j.u, &glyph)) < 0)
+				udie("XftFontOpenPattern failed seeking fallback font: %s\n",
+					strerror(errno));
+			xfallbackset(fs, j.u, j.flags, f + 1, glyph);
+			xcacheadd('F', fs->pixelsize, j.flags, j.u, 0,
+					fs->frc[f].font->pattern);
+			added |= fs == dc.fs;
+		}
+
+		pthread_mutex_lock(&fcq.lock);
+	}
+	pthread_mutex_unlock(&fcq.lock);
+	xcachesave();
+	return added;
+}
+
+void
+xfallbackprefetch(void)
+{
+	FontSize *fs = dc.fs;
+	size_t i;
+
+	/* the ones in the font cache are opened when they're drawn */
+	for (i = 0; i < LEN(prefetchrunes); i++) {
+		if (!xcharindex(&fs->font, prefetchrunes[i]) &&
+		    xfallbackslot(fs, prefetchrunes[i], FRC_NORMAL)->f == 0 &&
+		    !xcachefind('F', fs->pixelsize, FRC_NORMAL, prefetchrunes[i]) &&
+		    xfallbackqueue(&fs->font, FRC_NORMAL, prefetchrunes[i]))
+			xfallbackset(fs, prefetchrunes[i], FRC_NORMAL, -1, 0);
+	}
+}
+
+XftFont *
+xfallback(Font *font, int flags, Rune u, FT_UInt *glyph)
+{
+	FontSize *fs = dc.fs;
+	Fallback *s = xfallbackslot(fs, u, flags);
+	FcPattern *match;
+	CacheEntry *e;
+	int f;
+
+	if (s->f > 0) {
+		fs->frc[s->f - 1].used = frcclock;
+		*glyph = s->glyph;
+		return fs->frc[s->f - 1].font;
+	}
+
+	/* Not in the table since it was last cleared, try the open fonts. */
+	if (!s->f && (f = xfallbackfind(fs, flags, u, glyph)) >= 0) {
+		fs->frc[f].used = frcclock;
+		xfallbackset(fs, u, flags, f + 1, *glyph);
+		return fs->frc[f].font;
+	}
+
+	/* Found in an earlier run. */
+	if (!s->f && (e = xcachefind('F', fs->pixelsize, flags, u)) &&
+	    (match = FcNameParse((FcChar8 *)fontcache.pat[e->pat]))) {
+		if ((f = xfallbackopen(fs, match, flags, u, glyph)) >= 0) {
+			xfallbackset(fs, u, flags, f + 1, *glyph);
+			return fs->frc[f].font;
+		}
+		FcPatternDestroy(match);
+	}
+
+	/*
+	 * Nothing was found. Draw the font's missing glyph until the worker
+	 * has asked fontconfig, or ask it here if there's no worker.
+	 */
+	if (s->f < 0 || xfallbackqueue(font, flags, u)) {
+		if (!s->f)
+			xfallbackset(fs, u, flags, -1, 0);
+		*glyph = 0;
+		return font->match;
+	}
+	match = xfallbackmatch(font->pattern, &font->set, u);
+	if ((f = xfallbackopen(fs, match, flags, u, glyph)) < 0)
+		udie("XftFontOpenPattern failed seeking fallback font: %s\n",
+			strerror(errno));
+	xfallbackset(fs, u, flags, f + 1, *glyph);
+	xcacheadd('F', fs->pixelsize, flags, u, 0, fs->frc[f].font->pattern);
+	xcachesave();
+	return fs->frc[f].font;
+}
+
+/* forget the glyphs, another font may be opened where a closed one was */
+void
+xatlasclear(void)
+{
+	if (atlas.g)
+		memset(atlas.g, 0, atlas.cap * sizeof(*atlas.g));
+	atlas.n = 0;
+	atlas.len = 0;
+
+	/* the frame so far still uses the uploaded glyphs */
+	if (xw.glyphset) {
+		xflushbatch();
+		XRenderFreeGlyphSet(xw.dpy, xw.glyphset);
+		xw.glyphset = XRenderCreateGlyphSet(xw.dpy, xw.a8);
+	}
+}
+
+/*
+ * Rasterize a glyph the way Xft would load it, in grey rather than subpixel
+ * coverage. Colour bitmaps are scaled to the font's height like Xft does.
+ */
+void
+xatlasraster(AtlasGlyph *g, XftFont *font, FT_UInt glyph)
+{
+	FT_Face face;
+	FT_GlyphSlot slot;
+	FT_Bitmap *b;
+	FcBool on;
+	int hintstyle, load = FT_LOAD_RENDER | FT_LOAD_COLOR;
+	int num = 1, den = 1, bpp, r, c, sc;
+	uchar *src, *dst;
+
+	g->font = font;
+	g->glyph = glyph;
+	g->x = g->y = g->w = g->h = 0;
+	g->color = 0;
+	g->off = 0;
+	if (!(face = XftLockFace(font)))
+		return;
+
+	if (FcPatternGetBool(font->pattern, FC_ANTIALIAS, 0, &on) == FcResultMatch &&
+	    !on)
+		load |= FT_LOAD_TARGET_MONO;
+	else if (FcPatternGetInteger(font->pattern, FC_HINT_STYLE, 0, &hintstyle) ==
+	    FcResultMatch && hintstyle <= FC_HINT_SLIGHT)
+		load |= FT_LOAD_TARGET_LIGHT;
+	if (FcPatternGetBool(font->pattern, FC_HINTING, 0, &on) == FcResultMatch &&
+	    !on)
+		load |= FT_LOAD_NO_HINTING;
+	if (FcPatternGetBool(font->pattern, FC_AUTOHINT, 0, &on) == FcResultMatch &&
+	    on)
+		load |= FT_LOAD_FORCE_AUTOHINT;
+
+	if (FT_Load_Glyph(face, glyph, load)) {
+		XftUnlockFace(font);
+		return;
+	}
+	slot = face->glyph;
+	b = &slot->bitmap;
+	if (b->pitch < 0 || (b->pixel_mode != FT_PIXEL_MODE_GRAY &&
+	    b->pixel_mode != FT_PIXEL_MODE_MONO &&
+	    b->pixel_mode != FT_PIXEL_MODE_BGRA)) {
+		XftUnlockFace(font);
+		return;
+	}
+
+	g->color = b->pixel_mode == FT_PIXEL_MODE_BGRA;
+	if (g->color && (int)b->rows > font->height) {
+		num = font->height;
+		den = b->rows;
+	}
+	bpp = g->color ? 4 : 1;
+	g->x = slot->bitmap_left * num / den;
+	g->y = -slot->bitmap_top * num / den;
+	g->w = b->width * num / den;
+	g->h = b->rows * num / den;
+
+	if (atlas.len + (size_t)g->w * g->h * bpp > atlas.size) {
+		atlas.size = MAX(2 * atlas.size,
+				atlas.len + (size_t)g->w * g->h * bpp);
+		atlas.data = urealloc(atlas.data, atlas.size);
+	}
+	g->off = atlas.len;
+	dst = atlas.data + g->off;
+	for (r = 0; r < g->h; r++) {
+		src = b->buffer + (r * den / num) * b->pitch;
+		for (c = 0; c < g->w; c++) {
+			sc = c * den / num;
+			if (g->color) {
+				memcpy(dst, src + 4 * sc, 4);
+				dst += 4;
+			} else if (b->pixel_mode == FT_PIXEL_MODE_MONO) {
+				*dst++ = (src[sc >> 3] >> (7 - (sc & 7)) & 1) * 255;
+			} else {
+				*dst++ = src[sc];
+			}
+		}
+	}
+	atlas.len += (size_t)g->w * g->h * bpp;
+	XftUnlockFace(font);
+}
+
+/*
+ * The bitmap of a glyph, rasterized the first time it's drawn, and uploaded
+ * when drawing with XRender. They're kept until a font is closed or there
+ * are ATLAS_MAX bytes of them.
+ */
+/* the slot of a glyph in the atlas, or the empty one it goes in */
+AtlasGlyph *
+xatlasslot(XftFont *font, FT_UInt glyph)
+{
+	AtlasGlyph *g;
+	size_t i;
+
+	i = ((uintptr_t)font / sizeof(void *) * 31 + glyph) * 2654435761u;
+	for (;; i++) {
+		g = &atlas.g[i & (atlas.cap - 1)];
+		if (!g->font || (g->font == font && g->glyph == glyph))
+			return g;
+	}
+}
+
+/*
+ * The bitmap of a glyph, rasterized the first time it's drawn. They're kept
+ * until a font is closed or there are ATLAS_MAX bytes of them.
+ */
+AtlasGlyph *
+xatlasglyph(XftFont *font, FT_UInt glyph)
+{
+	AtlasGlyph *old, *g;
+	size_t i, oldcap;
+
+	if (2 * (atlas.n + 1) > atlas.cap) {
+		old = atlas.g;
+		oldcap = atlas.cap;
+		atlas.cap = MAX(1024, 2 * oldcap);
+		atlas.g = umalloc(atlas.cap * sizeof(*atlas.g));
+		memset(atlas.g, 0, atlas.cap * sizeof(*atlas.g));
+		for (i = 0; i < oldcap; i++) {
+			if (old[i].font)
+				*xatlasslot(old[i].font, old[i].glyph) = old[i];
+		}
+		free(old);
+	}
+
+	g = xatlasslot(font, glyph);
+	if (!g->font) {
+		xatlasraster(g, font, glyph);
+		g->gid = ++atlas.n;
+		if (xw.pict && !g->color && g->w && g->h)
+			xrenderupload(g);
+	}
+	return g;
+}
+
+/* a colour premultiplied by a over the pixel d */
+uint32_t
+xblend(uint32_t d, uint32_t r, uint32_t g, uint32_t b, uint32_t a)
+{
+	uint32_t dr = d >> xw.rshift & 0xff, dg = d >> xw.gshift & 0xff,
+	         db = d >> xw.bshift & 0xff;
+
+	dr = r + (dr * (255 - a) + 127) / 255;
+	dg = g + (dg * (255 - a) + 127) / 255;
+	db = b + (db * (255 - a) + 127) / 255;
+	return (d & ~(0xffu << xw.rshift | 0xffu << xw.gshift | 0xffu << xw.bshift))
+		| dr << xw.rshift | dg << xw.gshift | db << xw.bshift;
+}
+
+void
+xfillrect(Color *c, int x, int y, int w, int h)
+{
+	uint32_t *p;
+	int i, j, x2, y2;
+
+	if (xw.pict) {
+		xbatchrect(BATCH_UNDER, c, x, y, w, h);
+		return;
+	}
+	if (!xw.img) {
+		XftDrawRect(xw.draw, c, x, y, w, h);
+		return;
+	}
+
+	x2 = MIN(x + w, xw.img->width);
+	y2 = MIN(y + h, xw.img->height);
+	for (j = MAX(y, 0); j < y2; j++) {
+		p = (uint32_t *)(xw.img->data + (size_t)j * xw.img->bytes_per_line);
+		for (i = MAX(x, 0); i < x2; i++)
+			p[i] = c->pixel;
+	}
+}
+
+/* like xfillrect(), but over the text drawn in the same frame */
+void
+xdrawrect(Color *c, int x, int y, int w, int h)
+{
+	if (xw.pict)
+		xbatchrect(BATCH_OVER, c, x, y, w, h);
+	else
+		xfillrect(c, x, y, w, h);
+}
+
+/* draw the glyphs clipped to a rectangle, because Xft is sometimes dirty */
+void
+xdrawspecs(Color *fg, const XftGlyphFontSpec *specs, int len,
+		int cx, int cy, int cw, int ch)
+{
+	XRectangle r = { 0, 0, cw, ch };
+	AtlasGlyph *g;
+	Batch *b;
+	uint32_t *d, fr, fgr, fb, a;
+	uchar *s;
+	int i, x, y, gx, gy, x1, x2, y1, y2;
+
+	/* between runs, as starting over flushes the batch */
+	if (atlas.len > ATLAS_MAX)
+		xatlasclear();
+
+	if (xw.pict) {
+		for (i = 0; i < len; i++) {
+			g = xatlasglyph(specs[i].font, specs[i].glyph);
+			if (g->color) {
+				if (batch.nxft == batch.xftcap) {
+					batch.xftcap = MAX(16, 2 * batch.xftcap);
+					batch.xft = urealloc(batch.xft,
+							batch.xftcap * sizeof(XftGlyph));
+				}
+				batch.xft[batch.nxft++] = (XftGlyph){
+					specs[i], *fg, { cx, cy, cw, ch }
+				};
+				continue;
+			}
+			if (!g->w || !g->h)
+				continue;
+			b = xbatch(BATCH_TEXT, fg);
+			if (b->n == b->cap) {
+				b->cap = MAX(64, 2 * b->cap);
+				b->elt = urealloc(b->elt, b->cap * sizeof(XGlyphElt32));
+				b->gid = urealloc(b->gid, b->cap * sizeof(unsigned int));
+			}
+			b->gid[b->n] = g->gid;
+			b->elt[b->n].xOff = specs[i].x;
+			b->elt[b->n].yOff = specs[i].y;
+			b->n++;
+		}
+		xbatchclip(cx, cy, cw, ch);
+		return;
+	}
+	if (!xw.img) {
+		XftDrawSetClipRectangles(xw.draw, cx, cy, &r, 1);
+		XftDrawGlyphFontSpec(xw.draw, fg, specs, len);
+		XftDrawSetClip(xw.draw, 0);
+		return;
+	}
+
+	fr = fg->color.red >> 8;
+	fgr = fg->color.green >> 8;
+	fb = fg->color.blue >> 8;
+	for (i = 0; i < len; i++) {
+		g = xatlasglyph(specs[i].font, specs[i].glyph);
+		gx = specs[i].x + g->x;
+		gy = specs[i].y + g->y;
+		x1 = MAX(gx, MAX(cx, 0));
+		x2 = MIN(gx + g->w, MIN(cx + cw, xw.img->width));
+		y1 = MAX(gy, MAX(cy, 0));
+		y2 = MIN(gy + g->h, MIN(cy + ch, xw.img->height));
+		for (y = y1; y < y2; y++) {
+			d = (uint32_t *)(xw.img->data +
+					(size_t)y * xw.img->bytes_per_line);
+			s = atlas.data + g->off +
+				((size_t)(y - gy) * g->w + (x1 - gx)) * (g->color ? 4 : 1);
+			for (x = x1; x < x2; x++) {
+				if (g->color) {
+					if ((a = s[3]))
+						d[x] = xblend(d[x], s[2], s[1], s[0], a);
+					s += 4;
+				} else if ((a = *s++) == 255) {
+					d[x] = fg->pixel;
+				} else if (a) {
+					d[x] = xblend(d[x], (fr * a + 127) / 255,
+							(fgr * a + 127) / 255,
+							(fb * a + 127) / 255, a);
+				}
+			}
+		}
+	}
+}
+
+int
+xmakeglyphfontspecs(XftGlyphFontSpec *specs, const Rune *u, const uchar *style, int len, int x, int y)
 {
 	float winx = borderpx + x * win.cw, winy = borderpx + y * win.ch, xp, yp;
-	ushort mode, prevmode = USHRT_MAX;
-	Font *font = &dc.font;
+	ushort mode;
+	int prevstyle = -1;
+	Font *font = &dc.fs->font;
 	int frcflags = FRC_NORMAL;
 	float runewidth = win.cw;
 	Rune rune;
 	FT_UInt glyphidx;
-	FcResult fcres;
-	FcPattern *fcpattern, *fontpattern;
-	FcFontSet *fcsets[] = { NULL };
-	FcCharSet *fccharset;
-	int i, f, numspecs = 0;
+	int i, numspecs = 0;
 
+	frcclock++;
 	for (i = 0, xp = winx, yp = winy + font->ascent; i < len; ++i) {
-		/* Fetch rune and mode for current glyph. */
-		rune = glyphs[i].u;
-		mode = glyphs[i].mode;
+		rune = u[i];
 
 		/* Determine font for glyph if different from previous glyph. */
-		if (prevmode != mode) {
-			prevmode = mode;
-			font = &dc.font;
+		if (prevstyle != style[i]) {
+			prevstyle = style[i];
+			mode = tglyph(rune, style[i]).mode;
 			frcflags = FRC_NORMAL;
 			runewidth = win.cw * ((mode & ATTR_WIDE) ? 2.0f : 1.0f);
-			if ((mode & ATTR_ITALIC) && (mode & ATTR_BOLD)) {
-				font = &dc.ibfont;
+			if ((mode & ATTR_ITALIC) && (mode & ATTR_BOLD))
 				frcflags = FRC_ITALICBOLD;
-			} else if (mode & ATTR_ITALIC) {
-				font = &dc.ifont;
+			else if (mode & ATTR_ITALIC)
 				frcflags = FRC_ITALIC;
-			} else if (mode & ATTR_BOLD) {
-				font = &dc.bfont;
+			else if (mode & ATTR_BOLD)
 				frcflags = FRC_BOLD;
-			}
+			font = xstylefont(frcflags);
 			yp = winy + font->ascent;
 		}
 
 		/* Lookup character index with default font. */
-		glyphidx = XftCharIndex(xw.dpy, font->match, rune);
+		glyphidx = xcharindex(font, rune);
 		if (glyphidx) {
 			specs[numspecs].font = font->match;
 			specs[numspecs].glyph = glyphidx;
@@ -985,72 +2472,8 @@ xmakeglyphfontspecs(XftGlyphFontSpec *specs, const Glyph *glyphs, int len, int x
 			continue;
 		}
 
-		/* Fallback on font cache, search the font cache for match. */
-		for (f = 0; f < frclen; f++) {
-			glyphidx = XftCharIndex(xw.dpy, frc[f].font, rune);
-			/* Everything correct. */
-			if (glyphidx && frc[f].flags == frcflags)
-				break;
-			/* We got a default font for a not found glyph. */
-			if (!glyphidx && frc[f].flags == frcflags
-					&& frc[f].unicodep == rune) {
-				break;
-			}
-		}
-
-		/* Nothing was found. Use fontconfig to find matching font. */
-		if (f >= frclen) {
-			if (!font->set)
-				font->set = FcFontSort(0, font->pattern,
-				                       1, 0, &fcres);
-			fcsets[0] = font->set;
-
-			/*
-			 * Nothing was found in the cache. Now use
-			 * some dozen of Fontconfig calls to get the
-			 * font for one single character.
-			 *
-			 * Xft and fontconfig are design failures.
-			 */
-			fcpattern = FcPatternDuplicate(font->pattern);
-			fccharset = FcCharSetCreate();
-
-			FcCharSetAddChar(fccharset, rune);
-			FcPatternAddCharSet(fcpattern, FC_CHARSET,
-					fccharset);
-			FcPatternAddBool(fcpattern, FC_SCALABLE, 1);
-
-			FcConfigSubstitute(0, fcpattern,
-					FcMatchPattern);
-			FcDefaultSubstitute(fcpattern);
-
-			fontpattern = FcFontSetMatch(0, fcsets, 1,
-					fcpattern, &fcres);
-
-			/* Allocate memory for the new cache entry. */
-			if (frclen >= frccap) {
-				frccap += 16;
-				frc = urealloc(frc, frccap * sizeof(Fontcache));
-			}
-
-			frc[frclen].font = XftFontOpenPattern(xw.dpy,
-					fontpattern);
-			if (!frc[frclen].font)
-				udie("XftFontOpenPattern failed seeking fallback font: %s\n",
-					strerror(errno));
-			frc[frclen].flags = frcflags;
-			frc[frclen].unicodep = rune;
-
-			glyphidx = XftCharIndex(xw.dpy, frc[frclen].font, rune);
-
-			f = frclen;
-			frclen++;
-
-			FcPatternDestroy(fcpattern);
-			FcCharSetDestroy(fccharset);
-		}
-
-		specs[numspecs].font = frc[f].font;
+		/* Fallback on the font cache, or fontconfig if it's not there. */
+		specs[numspecs].font = xfallback(font, frcflags, rune, &glyphidx);
 		specs[numspecs].glyph = glyphidx;
 		specs[numspecs].x = (short)xp;
 		specs[numspecs].y = (short)yp;
@@ -1069,14 +2492,13 @@ xdrawglyphfontspecs(const XftGlyphFontSpec *specs, Glyph base, int len, int x, i
 	    width = charlen * win.cw;
 	Color *fg, *bg, *temp, revfg, revbg, truefg, truebg;
 	XRenderColor colfg, colbg;
-	XRectangle r;
 
 	/* Fallback on color display for attributes not supported by the font */
 	if (base.mode & ATTR_ITALIC && base.mode & ATTR_BOLD) {
-		if (dc.ibfont.badslant || dc.ibfont.badweight)
+		if (dc.fs->ibfont.badslant || dc.fs->ibfont.badweight)
 			base.fg = defaultattr;
-	} else if ((base.mode & ATTR_ITALIC && dc.ifont.badslant) ||
-	    (base.mode & ATTR_BOLD && dc.bfont.badweight)) {
+	} else if ((base.mode & ATTR_ITALIC && dc.fs->ifont.badslant) ||
+	    (base.mode & ATTR_BOLD && dc.fs->bfont.badweight)) {
 		base.fg = defaultattr;
 	}
 
@@ -1169,31 +2591,17 @@ xdrawglyphfontspecs(const XftGlyphFontSpec *specs, Glyph base, int len, int x, i
 		xclear(winx, winy + win.ch, winx + width, win.h);
 
 	/* Clean up the region we want to draw to. */
-	XftDrawRect(xw.draw, bg, winx, winy, width, win.ch);
-
-	/* Set the clip region because Xft is sometimes dirty. */
-	r.x = 0;
-	r.y = 0;
-	r.height = win.ch;
-	r.width = width;
-	XftDrawSetClipRectangles(xw.draw, winx, winy, &r, 1);
+	xfillrect(bg, winx, winy, width, win.ch);
 
 	/* Render the glyphs. */
-	XftDrawGlyphFontSpec(xw.draw, fg, specs, len);
+	xdrawspecs(fg, specs, len, winx, winy, width, win.ch);
 
 	/* Render underline and strikethrough. */
-	if (base.mode & ATTR_UNDERLINE) {
-		XftDrawRect(xw.draw, fg, winx, winy + dc.font.ascent + 1,
-				width, 1);
-	}
-
-	if (base.mode & ATTR_STRUCK) {
-		XftDrawRect(xw.draw, fg, winx, winy + 2 * dc.font.ascent / 3,
-				width, 1);
-	}
+	if (base.mode & ATTR_UNDERLINE)
+		xdrawrect(fg, winx, winy + dc.fs->font.ascent + 1, width, 1);
 
-	/* Reset clip to none. */
-	XftDrawSetClip(xw.draw, 0);
+	if (base.mode & ATTR_STRUCK)
+		xdrawrect(fg, winx, winy + 2 * dc.fs->font.ascent / 3, width, 1);
 }
 
 void
@@ -1201,8 +2609,9 @@ xdrawglyph(Glyph g, int x, int y)
 {
 	int numspecs;
 	XftGlyphFontSpec spec;
+	uchar style = tstyle(g.mode, g.fg, g.bg);
 
-	numspecs = xmakeglyphfontspecs(&spec, &g, 1, x, y);
+	numspecs = xmakeglyphfontspecs(&spec, &g.u, &style, 1, x, y);
 	xdrawglyphfontspecs(&spec, g, numspecs, x, y);
 }
 
@@ -1214,6 +2623,9 @@ xdrawcursor(int cx, int cy, Glyph g)
 	if (IS_SET(MODE_HIDE))
 		return;
 
+	/* the cell under it was drawn in the layers of other colours */
+	xflushbatch();
+
 	/*
 	 * Select the right color for the right mode.
 	 */
@@ -1232,6 +2644,9 @@ xdrawcursor(int cx, int cy, Glyph g)
 
 	/* draw the new one */
 	if (IS_SET(MODE_FOCUSED)) {
+		/* blinking styles are left off for the off half of the blink */
+		if (IS_SET(MODE_BLINK) && xcursorblinks())
+			return;
 		switch (win.cursor) {
 		case 7: /* cdoedit extension: snowman (U+2603) */
 			g.u = 0x2603;
@@ -1243,7 +2658,7 @@ xdrawcursor(int cx, int cy, Glyph g)
 			break;
 		case 3: /* Blinking Underline */
 		case 4: /* Steady Underline */
-			XftDrawRect(xw.draw, &drawcol,
+			xdrawrect(&drawcol,
 					borderpx + cx * win.cw,
 					borderpx + (cy + 1) * win.ch - \
 						cursorthickness,
@@ -1251,26 +2666,26 @@ xdrawcursor(int cx, int cy, Glyph g)
 			break;
 		case 5: /* Blinking bar */
 		case 6: /* Steady bar */
-			XftDrawRect(xw.draw, &drawcol,
+			xdrawrect(&drawcol,
 					borderpx + cx * win.cw,
 					borderpx + cy * win.ch,
 					cursorthickness, win.ch);
 			break;
 		}
 	} else {
-		XftDrawRect(xw.draw, &drawcol,
+		xdrawrect(&drawcol,
 				borderpx + cx * win.cw,
 				borderpx + cy * win.ch,
 				win.cw - 1, 1);
-		XftDrawRect(xw.draw, &drawcol,
+		xdrawrect(&drawcol,
 				borderpx + cx * win.cw,
 				borderpx + cy * win.ch,
 				1, win.ch - 1);
-		XftDrawRect(xw.draw, &drawcol,
+		xdrawrect(&drawcol,
 				borderpx + (cx + 1) * win.cw - 1,
 				borderpx + cy * win.ch,
 				1, win.ch - 1);
-		XftDrawRect(xw.draw, &drawcol,
+		xdrawrect(&drawcol,
 				borderpx + cx * win.cw,
 				borderpx + (cy + 1) * win.ch - 1,
 				win.cw, 1);
@@ -1302,41 +2717,86 @@ xsettitle(char *p)
 int
 xstartdraw(void)
 {
-	return IS_SET(MODE_VISIBLE);
+	if (!IS_SET(MODE_VISIBLE))
+		return 0;
+	xshmwait();
+	return 1;
 }
 
 void
-xdrawline(Line line, int x1, int y1, int x2)
+xdrawline(const Rune *u, const uchar *style, int x1, int y1, int x2)
 {
 	int i, x, ox, numspecs;
-	Glyph base, new;
 	XftGlyphFontSpec *specs = xw.specbuf;
+	struct timespec t0, t1;
 
-	numspecs = xmakeglyphfontspecs(specs, &line[x1], x2 - x1, x1, y1);
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	numspecs = xmakeglyphfontspecs(specs, &u[x1], &style[x1], x2 - x1, x1, y1);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	specstat.ns += (t1.tv_sec - t0.tv_sec) * 1E9 + (t1.tv_nsec - t0.tv_nsec);
+	specstat.cells += x2 - x1;
+
+	/* draw each run of cells with the same style at once */
 	i = ox = 0;
 	for (x = x1; x < x2 && i < numspecs; x++) {
-		new = line[x];
-		if (i > 0 && ATTRCMP(base, new)) {
-			xdrawglyphfontspecs(specs, base, i, ox, y1);
+		if (i > 0 && style[x] != style[ox]) {
+			xdrawglyphfontspecs(specs, tglyph(u[ox], style[ox]), i, ox, y1);
 			specs += i;
 			numspecs -= i;
 			i = 0;
 		}
-		if (i == 0) {
+		if (i == 0)
 			ox = x;
-			base = new;
-		}
 		i++;
 	}
 	if (i > 0)
-		xdrawglyphfontspecs(specs, base, i, ox, y1);
+		xdrawglyphfontspecs(specs, tglyph(u[ox], style[ox]), i, ox, y1);
+}
+
+void
+xcopyarea(int x1, int y1, int x2, int y2)
+{
+	/* the cells on the edges of the grid own the borders next to them */
+	int left = x1 == 0 ? 0 : borderpx + x1 * win.cw;
+	int right = x2 * win.cw >= win.tw ? win.w : borderpx + x2 * win.cw;
+	int top = y1 == 0 ? 0 : borderpx + y1 * win.ch;
+	int bottom = y2 * win.ch >= win.th ? win.h : borderpx + y2 * win.ch;
+
+	xflushbatch();
+
+	if (xw.img) {
+		XShmPutImage(xw.dpy, xw.win, dc.gc, xw.img, left, top, left, top,
+				right - left, bottom - top, True);
+		xw.shmpending++;
+		return;
+	}
+	XCopyArea(xw.dpy, xw.buf, xw.win, dc.gc, left, top,
+			right - left, bottom - top, left, top);
+}
+
+void
+xscroll(int y1, int y2, int n)
+{
+	size_t bpl;
+
+	/* move rows y1 to y2 of the buffer up by n rows, or down if n is negative */
+	if (xw.img) {
+		bpl = xw.img->bytes_per_line;
+		memmove(xw.img->data + (borderpx + (y1 - n) * win.ch) * bpl,
+				xw.img->data + (borderpx + y1 * win.ch) * bpl,
+				(y2 - y1) * win.ch * bpl);
+		return;
+	}
+	xflushbatch();
+	XCopyArea(xw.dpy, xw.buf, xw.buf, dc.gc,
+			0, borderpx + y1 * win.ch, win.w, (y2 - y1) * win.ch,
+			0, borderpx + (y1 - n) * win.ch);
 }
 
 void
 xfinishdraw(void)
 {
-	XCopyArea(xw.dpy, xw.buf, xw.win, dc.gc, 0, 0, win.w,
-			win.h, 0, 0);
+	xflushbatch();
 	XSetForeground(xw.dpy, dc.gc,
 			dc.col[IS_SET(MODE_REVERSE)?
 				defaultfg : defaultbg].pixel);
@@ -1356,6 +2816,7 @@ void
 expose(XEvent *ev)
 {
 	(void)ev;
+	tfulldirt();
 	redraw();
 }
 
@@ -1386,8 +2847,16 @@ xsetmode(int set, unsigned int flags)
 {
 	int mode = win.mode;
 	MODBIT(win.mode, set, flags);
-	if ((win.mode & MODE_REVERSE) != (mode & MODE_REVERSE))
+	if ((win.mode & MODE_REVERSE) != (mode & MODE_REVERSE)) {
+		tfulldirt();
 		redraw();
+	}
+}
+
+int
+xcursorblinks(void)
+{
+	return win.cursor == 0 || (win.cursor < 6 && win.cursor % 2);
 }
 
 int
@@ -1420,19 +2889,74 @@ xbell(void)
 }
 
 void
-xdodraw(void)
+xdodraw(int changed, int blinked)
 {
-	XEvent ev;
-	while (XPending(xw.dpy)) {
-		XNextEvent(xw.dpy, &ev);
-		if (XFilterEvent(&ev, None))
-			continue;
-		if (handler[ev.type])
-			(handler[ev.type])(&ev);
-	}
+	unsigned long req = NextRequest(xw.dpy);
 
-	redraw();
+	/* nothing but the blink means the grid is as it was */
+	if (changed)
+		redraw();
+	else if (blinked)
+		redrawcursor();
+	else
+		return;
 	XFlush(xw.dpy);
+
+	reqstat.last = NextRequest(xw.dpy) - req;
+	reqstat.total += reqstat.last;
+	reqstat.frames++;
+}
+
+void
+xaddlatency(double ms)
+{
+	latency.ms[latency.n++ % LEN(latency.ms)] = ms;
+}
+
+int
+cmpdouble(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+size_t
+xlatency(double *p50, double *p99)
+{
+	size_t n = MIN(latency.n, LEN(latency.ms));
+	double sorted[LEN(latency.ms)];
+
+	if (!n)
+		return 0;
+	memcpy(sorted, latency.ms, n * sizeof(*sorted));
+	qsort(sorted, n, sizeof(*sorted), cmpdouble);
+	*p50 = sorted[(n - 1) * 50 / 100];
+	*p99 = sorted[(n - 1) * 99 / 100];
+	return n;
+}
+
+int
+xstartup(double *fonts, double *frame, int *loaded)
+{
+	*fonts = startup.fonts;
+	*frame = startup.frame;
+	*loaded = startup.loaded;
+	return startup.cached;
+}
+
+unsigned long
+xrequests(double *avg, const char **how)
+{
+	*avg = reqstat.frames ? (double)reqstat.total / reqstat.frames : 0;
+	*how = xw.img ? "shm" : xw.pict ? "render" : "xft";
+	return reqstat.last;
+}
+
+double
+xspectime(void)
+{
+	/* average nanoseconds to build the spec of one cell */
+	return specstat.cells ? specstat.ns / specstat.cells : 0;
 }
 
 void
@@ -1468,14 +2992,21 @@ kpress(XEvent *ev)
 	char buf[32];
 	int len;
 	Status status;
-	Shortcut *bp;
+	Shortcut *bp, *end;
 
 	if (IS_SET(MODE_KBDLOCK))
 		return;
 
 	len = XmbLookupString(xw.xic, e, buf, sizeof buf, &ksym, &status);
-	/* 1. shortcuts */
-	for (bp = shortcuts; bp < shortcuts + LEN(shortcuts); bp++) {
+	/* 1. shortcuts, the prompt has its own set while it's open */
+	if (eprompting()) {
+		bp = promptshortcuts;
+		end = promptshortcuts + LEN(promptshortcuts);
+	} else {
+		bp = shortcuts;
+		end = shortcuts + LEN(shortcuts);
+	}
+	for (; bp < end; bp++) {
 		if (ksym == bp->keysym && match(bp->modmask, bp->modval, e->state)) {
 			bp->func(&(bp->arg));
 			return;
@@ -1522,10 +3053,11 @@ run(void)
 {
 	XEvent ev;
 	int w = win.w, h = win.h;
-	fd_set rfd;
-	int xfd = XConnectionNumber(xw.dpy), xev, blinkset = 0, dodraw = 0;
-	struct timespec drawtimeout, *tv = NULL, now, last, lastblink;
-	long deltatime;
+	fd_set rfd, wfd;
+	int xfd = XConnectionNumber(xw.dpy), maxfd, n;
+	int blinkset, changed = 0, blinked = 0, typed = 0;
+	struct timespec timeout, *tv, now, last, lastblink, keytime = {0};
+	double wait;
 
 	/* Waiting for window mapping */
 	do {
@@ -1545,67 +3077,101 @@ run(void)
 
 	cresize(w, h);
 
-	xdodraw();
+	xdodraw(1, 0);
 
 	clock_gettime(CLOCK_MONOTONIC, &last);
-	lastblink = last;
+	startup.frame = TIMEDIFF(last, startup.start);
+	lastblink = now = last;
 
-	for (xev = actionfps;;) {
+	for (;;) {
 		FD_ZERO(&rfd);
+		FD_ZERO(&wfd);
 		FD_SET(xfd, &rfd);
+		maxfd = MAX(xfd, efds(&rfd, &wfd));
+		if (fcq.pipe[0] >= 0) {
+			FD_SET(fcq.pipe[0], &rfd);
+			maxfd = MAX(maxfd, fcq.pipe[0]);
+		}
+		blinkset = blinktimeout && xcursorblinks();
+
+		/*
+		 * Don't wait while the editor has work to do or events are
+		 * queued, wait for the frame cap once something has changed, for
+		 * the next blink, or else for as long as it takes.
+		 */
+		wait = -1;
+		if (ebusy() || XPending(xw.dpy))
+			wait = 0;
+		else if (changed)
+			wait = MAX(0, 1000.0 / xfps - TIMEDIFF(now, last));
+		else if (blinkset)
+			wait = MAX(0, blinktimeout - TIMEDIFF(now, lastblink));
+		if (ewait() >= 0 && (wait < 0 || ewait() < wait))
+			wait = ewait();
+		tv = NULL;
+		if (wait >= 0) {
+			timeout.tv_sec = wait / 1000;
+			timeout.tv_nsec = fmod(wait, 1000) * 1E6;
+			tv = &timeout;
+		}
 
-		if (pselect(xfd+1, &rfd, NULL, NULL, tv, NULL) < 0) {
+		if ((n = pselect(maxfd+1, &rfd, &wfd, NULL, tv, NULL)) < 0) {
 			if (errno == EINTR)
 				continue;
 			udie("select failed: %s\n", strerror(errno));
 		}
-
-		if (blinktimeout) {
-			if (!blinkset)
-				MODBIT(win.mode, 0, MODE_BLINK);
-		}
-
-		xev = actionfps;
-
 		clock_gettime(CLOCK_MONOTONIC, &now);
-		drawtimeout.tv_sec = 0;
-		drawtimeout.tv_nsec =  (1000 * 1E6)/ xfps;
-		tv = &drawtimeout;
+		eio(&rfd, &wfd);
+		/* the rows drawn with missing glyphs look unchanged otherwise */
+		if (fcq.pipe[0] >= 0 && FD_ISSET(fcq.pipe[0], &rfd) &&
+		    xfallbackdone())
+			tfulldirt();
+
+		/* only redraw the grid when the editor could have changed it */
+		if (n > !!FD_ISSET(xfd, &rfd) || ebusy())
+			changed = 1;
+		ework();
+
+		/* drain the whole burst of input before drawing any of it */
+		while (XPending(xw.dpy)) {
+			XNextEvent(xw.dpy, &ev);
+			if (xw.img && ev.type == xw.shmcompletion) {
+				xw.shmpending--;
+				continue;
+			}
+			changed = 1;
+			if (ev.type == KeyPress && !typed) {
+				typed = 1;
+				keytime = now;
+			}
+			if (XFilterEvent(&ev, None))
+				continue;
+			if (handler[ev.type])
+				(handler[ev.type])(&ev);
+		}
 
-		dodraw = 0;
-		if (blinktimeout && TIMEDIFF(now, lastblink) > blinktimeout) {
+		/* the cursor stays on while typing */
+		if (!blinkset || typed) {
+			if (IS_SET(MODE_BLINK))
+				blinked = 1;
+			MODBIT(win.mode, 0, MODE_BLINK);
+			lastblink = now;
+		} else if (TIMEDIFF(now, lastblink) >= blinktimeout) {
 			win.mode ^= MODE_BLINK;
 			lastblink = now;
-			dodraw = 1;
-		}
-		deltatime = TIMEDIFF(now, last);
-		if (deltatime > 1000 / (xev ? xfps : actionfps)) {
-			dodraw = 1;
-			last = now;
+			blinked = 1;
 		}
 
-		if (dodraw) {
-			xdodraw();
-			if (xev && !FD_ISSET(xfd, &rfd))
-				xev--;
-			if (!FD_ISSET(xfd, &rfd)) {
-				if (blinkset) {
-					if (TIMEDIFF(now, lastblink) \
-							> blinktimeout) {
-						drawtimeout.tv_nsec = 1000;
-					} else {
-						drawtimeout.tv_nsec = (1E6 * \
-							(blinktimeout - \
-							TIMEDIFF(now,
-								lastblink)));
-					}
-					drawtimeout.tv_sec = \
-					    drawtimeout.tv_nsec / 1E9;
-					drawtimeout.tv_nsec %= (long)1E9;
-				} else {
-					tv = NULL;
-				}
+		if (changed && TIMEDIFF(now, last) < 1000.0 / xfps)
+			continue;
+		if (changed || blinked) {
+			xdodraw(changed, blinked);
+			last = now;
+			if (typed) {
+				clock_gettime(CLOCK_MONOTONIC, &now);
+				xaddlatency(TIMEDIFF(now, keytime));
 			}
+			changed = blinked = typed = 0;
 		}
 	}
 }
@@ -1619,6 +3185,7 @@ usage(void)
 int
 main(int argc, char *argv[])
 {
+	clock_gettime(CLOCK_MONOTONIC, &startup.start);
 	xw.l = xw.t = 0;
 	xw.isfixed = False;
 	win.cursor = cursorshape;